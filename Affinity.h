@@ -0,0 +1,39 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef Affinity_h
+#define Affinity_h
+
+#include <pthread.h>
+
+#include <thread>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+// Pins |thread| to core |cpu|, wrapping around if there are fewer cores. On
+// macOS this is only a hint: threads with different affinity tags are kept
+// on different cores where possible.
+inline void
+PinThread(std::thread& thread, int cpu)
+{
+  unsigned cores = std::thread::hardware_concurrency();
+  if (cores) {
+    cpu %= cores;
+  }
+
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#elif defined(__APPLE__)
+  thread_affinity_policy_data_t policy = { cpu + 1 };
+  thread_policy_set(pthread_mach_thread_np(thread.native_handle()),
+                    THREAD_AFFINITY_POLICY, (thread_policy_t)&policy,
+                    THREAD_AFFINITY_POLICY_COUNT);
+#endif
+}
+
+#endif // Affinity_h
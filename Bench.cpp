@@ -0,0 +1,252 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+// Drives the capture pipeline from a synthetic or file-backed frame source and
+// reports how fast each stage runs, so the hot path can be measured without a
+// capture card.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CaptureLib.h"
+#include "EncodeLib.h"
+#include "FrameSource.h"
+#include "Luma.h"
+
+static void
+Usage()
+{
+  fprintf(stderr,
+          "usage: bench [options]\n"
+          "  -r, --rate=FPS        delivery rate; 0 runs as fast as possible (default 0)\n"
+          "  -n, --frames=N        number of frames to record (default 600)\n"
+          "  -W, --width=PIXELS    frame width (default 1920)\n"
+          "  -H, --height=PIXELS   frame height (default 1080)\n"
+          "  -f, --format=FORMAT   argb (default) or uyvy input\n"
+          "  -d, --decimate        keep every other pixel of every other row (uyvy only)\n"
+          "  -i, --input=FILE      raw video to play instead of the test pattern\n"
+          "  -a, --audio=FILE      48 kHz s16le stereo audio to play instead of clicks\n"
+          "  -o, --output=BASE     write BASE.pop and friends (default: discard)\n"
+          "  -p, --pool=FRAMES     frames that may wait for the encoder (default 120)\n"
+          "  -w, --workers=N       frame processing threads (default 2)\n"
+          "  -k, --kernel=NAME     luma kernel: scalar, sse2, avx2 or avx512 (default: best)\n"
+          "  -t, --threshold=LEVEL left-channel level of a marker click (default 100)\n"
+          "  -m, --debounce=MS     minimum time between marker clicks (default 50)\n"
+          "  -c, --change=LEVEL    luma change that counts as a reaction (default 24)\n"
+          "  -C, --changed=PIXELS  pixels that must change for a reaction (default 16)\n"
+          "  -R, --roi=X,Y,W,H     only record this rectangle; may be repeated\n"
+          "  -F, --roi-file=FILE   only record the X,Y,W,H rectangles listed in FILE\n"
+          "  -L, --latency-roi=X,Y,W,H\n"
+          "                        only look for reactions in this rectangle\n"
+          "  -P, --preroll=SECS    also keep this much video from before each marker\n"
+          "  -T, --triggers=N      record a clip for each of N markers (default 1)\n"
+          "  -g, --segment-frames=N\n"
+          "                        start a new .pop segment every N frames\n"
+          "  -G, --segment-mb=MB   start a new segment once one reaches MB megabytes\n"
+          "  -y, --sync=N          start a sync point every N frames, where a player\n"
+          "                        can start decoding\n"
+          "  -e, --dedup=ROWS      rows the encoder remembers for reuse (default 4096);\n"
+          "                        0 only reuses the previous frame's rows\n"
+          "  -l, --tiles=SIZE      store changed SIZE x SIZE tiles instead of rows\n"
+          "  -j, --json=FILE       also write the stage timings to FILE as JSON\n");
+  exit(1);
+}
+
+int
+main(int argc, char** argv)
+{
+  static const struct option longOptions[] = {
+    { "rate", required_argument, nullptr, 'r' },
+    { "frames", required_argument, nullptr, 'n' },
+    { "width", required_argument, nullptr, 'W' },
+    { "height", required_argument, nullptr, 'H' },
+    { "format", required_argument, nullptr, 'f' },
+    { "decimate", no_argument, nullptr, 'd' },
+    { "input", required_argument, nullptr, 'i' },
+    { "audio", required_argument, nullptr, 'a' },
+    { "output", required_argument, nullptr, 'o' },
+    { "pool", required_argument, nullptr, 'p' },
+    { "workers", required_argument, nullptr, 'w' },
+    { "kernel", required_argument, nullptr, 'k' },
+    { "threshold", required_argument, nullptr, 't' },
+    { "debounce", required_argument, nullptr, 'm' },
+    { "change", required_argument, nullptr, 'c' },
+    { "changed", required_argument, nullptr, 'C' },
+    { "roi", required_argument, nullptr, 'R' },
+    { "roi-file", required_argument, nullptr, 'F' },
+    { "latency-roi", required_argument, nullptr, 'L' },
+    { "preroll", required_argument, nullptr, 'P' },
+    { "triggers", required_argument, nullptr, 'T' },
+    { "segment-frames", required_argument, nullptr, 'g' },
+    { "segment-mb", required_argument, nullptr, 'G' },
+    { "sync", required_argument, nullptr, 'y' },
+    { "dedup", required_argument, nullptr, 'e' },
+    { "tiles", required_argument, nullptr, 'l' },
+    { "json", required_argument, nullptr, 'j' },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  SyntheticOptions options;
+  options.paced = false;
+  size_t numFrames = 600;
+  std::string output;
+  size_t poolSize = kDefaultPoolSize;
+  bool decimate = false;
+  size_t workers = kDefaultWorkers;
+  int16_t threshold = kDefaultOnsetThreshold;
+  size_t debounce = kDefaultOnsetDebounce;
+  uint8_t changeLevel = kDefaultChangeLevel;
+  size_t changedPixels = kDefaultChangedPixels;
+  std::vector<Region> regions;
+  Region latencyRegion;
+  double preroll = 0;
+  size_t triggers = 1;
+  size_t segmentFrames = 0;
+  uint64_t segmentBytes = 0;
+  size_t syncFrames = 0;
+  size_t dedupEntries = kDefaultDedupEntries;
+  size_t tileSize = 0;
+  std::string jsonName;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:n:W:H:f:di:a:o:p:w:k:t:m:c:C:R:F:L:P:T:g:G:y:e:l:j:", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'r':
+        options.fps = atof(optarg);
+        options.paced = options.fps > 0;
+        if (!options.paced) {
+          options.fps = 60;
+        }
+        break;
+      case 'n': numFrames = atoi(optarg); break;
+      case 'W': options.width = atoi(optarg); break;
+      case 'H': options.height = atoi(optarg); break;
+      case 'f': options.format = ParsePixelFormat(optarg); break;
+      case 'd': decimate = true; break;
+      case 'i': options.videoFile = optarg; break;
+      case 'a': options.audioFile = optarg; break;
+      case 'o': output = optarg; break;
+      case 'p': poolSize = atoi(optarg); break;
+      case 'w': workers = atoi(optarg); break;
+      case 'k':
+        if (!SetLumaKernel(optarg)) {
+          Fail("unknown or unsupported luma kernel");
+        }
+        break;
+      case 't': threshold = atoi(optarg); break;
+      case 'm': debounce = atof(optarg) * kAudioSampleRate / 1000; break;
+      case 'c': changeLevel = atoi(optarg); break;
+      case 'C': changedPixels = atoi(optarg); break;
+      case 'R': {
+        Region region;
+        if (!ParseRegion(optarg, &region)) {
+          Fail("region must be X,Y,W,H");
+        }
+        regions.push_back(region);
+        break;
+      }
+      case 'F': LoadRegions(optarg, &regions); break;
+      case 'L':
+        if (!ParseRegion(optarg, &latencyRegion)) {
+          Fail("region must be X,Y,W,H");
+        }
+        break;
+      case 'P': preroll = atof(optarg); break;
+      case 'T': triggers = atoi(optarg); break;
+      case 'g': segmentFrames = atoi(optarg); break;
+      case 'G': segmentBytes = uint64_t(atof(optarg) * 1024 * 1024); break;
+      case 'y': syncFrames = atoi(optarg); break;
+      case 'e': dedupEntries = atoi(optarg); break;
+      case 'l': tileSize = atoi(optarg); break;
+      case 'j': jsonName = optarg; break;
+      default: Usage();
+    }
+  }
+
+  if (!numFrames || !triggers || tileSize > kMaxTileSize) {
+    Usage();
+  }
+
+  size_t width = options.width;
+  size_t height = options.height;
+
+  printf("%zu x %zu %s, %zu frames, %s, %s luma kernel, %s onset kernel, "
+         "%s scanline kernel\n",
+         width, height, PixelFormatName(options.format), numFrames,
+         options.paced ? "paced" : "as fast as possible",
+         GetLumaKernel()->name, OnsetKernelName(), ScanlineKernelName());
+
+  std::string popName = output.empty() ? "/dev/null" : output + ".pop";
+  std::string eventsName = output.empty() ? "" : output + ".events";
+
+  FrameProcessor processor(popName, poolSize);
+  processor.SetMaxFrames(numFrames);
+  processor.SetDecimate(decimate);
+  processor.SetWorkers(workers);
+  processor.SetRegions(regions);
+  processor.SetPreroll(preroll);
+  processor.SetMaxTriggers(triggers);
+  processor.SetDedupEntries(dedupEntries);
+  processor.SetTileSize(tileSize);
+  if (!output.empty()) {
+    processor.SetSegments(segmentFrames, segmentBytes);
+  }
+  processor.SetSyncInterval(syncFrames);
+  processor.SetOnsetThreshold(threshold);
+  processor.SetOnsetDebounce(debounce);
+
+  LatencyMeter* latency = processor.GetLatencyMeter();
+  latency->SetChangeLevel(changeLevel);
+  latency->SetChangedPixels(changedPixels);
+  latency->SetRegion(latencyRegion);
+  latency->SetReport(false);
+  processor.SetEventsName(eventsName);
+  processor.SetMotionName(output.empty() ? "" : output + ".motion");
+
+  SyntheticFrameSource source(options);
+
+  double start = Now();
+  source.Start(&processor);
+
+  while (!processor.Done()) {
+    usleep(1000);
+  }
+
+  source.Stop();
+  double elapsed = Now() - start;
+
+  processor.Finish();
+  double drain = Now() - start - elapsed;
+
+  printf("\ncapture\n");
+  printf("  %zu frames delivered in %.2f s: %.1f frames/s\n",
+         source.FramesDelivered(), elapsed, source.FramesDelivered() / elapsed);
+  printf("  dropped %zu at the source, %zu at the worker queue, %zu at the encoder\n",
+         source.FramesDropped(), processor.QueueDroppedFrames(),
+         processor.DroppedFrames());
+  printf("  worker queue high water mark %zu\n", processor.QueueHighWater());
+  printf("  %zu marker onsets\n", processor.NumOnsets());
+  latency->PrintSummary();
+  processor.PrintStats();
+
+  const EncoderThread* encoder = processor.GetEncoder();
+  const StageStats& encodeStats = encoder->EncodeStats();
+
+  printf("\nencode\n");
+  printf("  %.1f bytes/frame, %.1f MB/s, finished %.2f s after capture\n",
+         double(encoder->BytesWritten()) / encoder->NumFrames(),
+         double(encoder->NumFrames() * encoder->FrameSize()) / (encodeStats.totalNs / 1000.0),
+         drain);
+
+  if (!jsonName.empty()) {
+    FILE* json = fopen(jsonName.c_str(), "w");
+    if (!json) {
+      Fail("unable to open JSON output");
+    }
+    processor.WriteStatsJson(json);
+    fclose(json);
+  }
+
+  return 0;
+}
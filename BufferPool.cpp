@@ -0,0 +1,116 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "BufferPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#ifdef __APPLE__
+#include <mach/vm_statistics.h>
+#endif
+
+const size_t kPageSize = 4096;
+const size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Several pools usually exceed RLIMIT_MEMLOCK together, so the warning about
+// it is only printed for the first.
+static std::atomic<bool> gWarnedUnlocked(false);
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+static size_t
+RoundUp(size_t n, size_t multiple)
+{
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+// Tries for explicitly reserved huge pages first, then falls back to normal
+// pages (which Linux may still back with transparent huge pages).
+static char*
+MapBuffers(size_t size, bool* hugePages)
+{
+  void* p = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+  p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+#elif defined(__APPLE__)
+  p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_ANON | MAP_PRIVATE, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#endif
+
+  *hugePages = p != MAP_FAILED;
+  if (p != MAP_FAILED) {
+    return static_cast<char*>(p);
+  }
+
+  p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_ANON | MAP_PRIVATE, -1, 0);
+  if (p == MAP_FAILED) {
+    Fail("mmap failed");
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+  return static_cast<char*>(p);
+}
+
+BufferPool::BufferPool(size_t bufferSize, size_t count)
+ : mBufferSize(RoundUp(bufferSize, kPageSize))
+ , mCount(count)
+{
+  mMappedSize = RoundUp(mBufferSize * mCount, kHugePageSize);
+  mBase = MapBuffers(mMappedSize, &mHugePages);
+
+  // Fault everything in now rather than on first touch during capture.
+  memset(mBase, 0, mMappedSize);
+
+  mLocked = mlock(mBase, mMappedSize) == 0;
+  if (!mLocked && !gWarnedUnlocked.exchange(true)) {
+    fprintf(stderr, "warning: unable to lock %zu MB of frame buffers; "
+            "raise RLIMIT_MEMLOCK to avoid paging\n", mMappedSize >> 20);
+  }
+
+  for (size_t i = 0; i < mCount; i++) {
+    mFreeBuffers.push_back(mBase + i * mBufferSize);
+  }
+}
+
+BufferPool::~BufferPool()
+{
+  if (mLocked) {
+    munlock(mBase, mMappedSize);
+  }
+  munmap(mBase, mMappedSize);
+}
+
+char*
+BufferPool::Get()
+{
+  std::lock_guard<std::mutex> guard(mMutex);
+  if (mFreeBuffers.empty()) {
+    return nullptr;
+  }
+
+  char* buffer = mFreeBuffers.back();
+  mFreeBuffers.pop_back();
+  return buffer;
+}
+
+void
+BufferPool::Put(char* buffer)
+{
+  std::lock_guard<std::mutex> guard(mMutex);
+  mFreeBuffers.push_back(buffer);
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef BufferPool_h
+#define BufferPool_h
+
+#include <stddef.h>
+
+#include <mutex>
+#include <vector>
+
+// A fixed set of equally sized buffers carved out of one mapping. The memory
+// is backed by 2 MB pages where the system allows it, touched up front and
+// locked, so filling a buffer during capture never takes a page fault.
+class BufferPool
+{
+public:
+  BufferPool(size_t bufferSize, size_t count);
+  ~BufferPool();
+
+  // Returns a free buffer, or nullptr if they are all in use. Never blocks
+  // for longer than it takes to pop a free list.
+  char* Get();
+  void Put(char* buffer);
+
+  bool Contains(const void* p) const {
+    return p >= mBase && p < mBase + mBufferSize * mCount;
+  }
+
+  size_t BufferSize() const { return mBufferSize; }
+  size_t Count() const { return mCount; }
+  bool HugePages() const { return mHugePages; }
+  bool Locked() const { return mLocked; }
+
+private:
+  char* mBase;
+  size_t mMappedSize;
+  size_t mBufferSize;
+  size_t mCount;
+  bool mHugePages;
+  bool mLocked;
+
+  std::mutex mMutex;
+  std::vector<char*> mFreeBuffers;
+};
+
+#endif // BufferPool_h
@@ -5,46 +5,33 @@
 
 #include <atomic>
 #include <assert.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/mman.h>
-#include <sys/time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "BufferPool.h"
+#include "CaptureDaemon.h"
+#include "CaptureLib.h"
 #include "EncodeLib.h"
+#include "FrameSource.h"
 
 #define RELEASE(p) do { (p)->Release(); (p) = nullptr; } while (0)
 
-void
-Fail(const char* err)
-{
-  fprintf(stderr, "error: %s\n", err);
-  exit(1);
-}
-
-double
-Now()
-{
-  struct timeval tv;
-  gettimeofday(&tv, nullptr);
-  return double(tv.tv_usec) / 1000000.0 + double(tv.tv_sec);
-}
-
-// We drop every second x and y pixels.
-const size_t kMaxFrameSize = 3840 * 2160 / 2 / 2;
-
-// One minute max.
-const size_t kMaxFrames = 60 * 60;
-
-const size_t kFrameBufferSize = kMaxFrames * kMaxFrameSize;
-
 class CaptureCallback : public IDeckLinkInputCallback
 {
 public:
-  CaptureCallback(IDeckLinkInput* input, char* frameBuffer)
+  CaptureCallback(IDeckLinkInput* input, PixelFormat format)
    : mRefCount(1)
    , mInput(input)
-   , mFrameBuffer(frameBuffer)
-   , mWidth(0)
-   , mHeight(0)
+   , mFormat(format)
+   , mSink(nullptr)
   {}
 
   virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv) {
@@ -73,240 +60,297 @@ public:
   VideoInputFrameArrived(IDeckLinkVideoInputFrame*,
                          IDeckLinkAudioInputPacket*);
 
-  void GetSize(size_t* width, size_t* height) {
-    *width = mWidth;
-    *height = mHeight;
-  }
+  void SetSink(FrameSink* sink) { mSink = sink; }
 
 private:
+  // BufferOwner hooks, so a sink that keeps a frame or packet past the
+  // callback holds a COM reference and the driver doesn't reuse its buffer.
+  static void AddRefVideo(void* frame);
+  static void ReleaseVideo(void* frame);
+  static void AddRefAudio(void* packet);
+  static void ReleaseAudio(void* packet);
+
   std::atomic<int32_t> mRefCount;
   IDeckLinkInput* mInput;
-  char* mFrameBuffer;
-  size_t mWidth, mHeight;
+  PixelFormat mFormat;
+  FrameSink* mSink;
 };
 
-static std::atomic<uint32_t> gFrameCounter(0);
-static std::atomic<uint32_t> gSkipFrameCounter(0);
-static bool gHasFirstFrame;
-
-// Data is expected to be in UYVY format, with 32 bits for every two pixels.
-void
-ReduceFrameBy8(size_t width, size_t height, char* frameBytes, char* result)
+static BMDPixelFormat
+ToBMDPixelFormat(PixelFormat format)
 {
-  const size_t rowBytes = width * 2;
-
-  char* input = frameBytes;
-  char* output = result;
+  return format == kPixelFormatARGB ? bmdFormat8BitARGB : bmdFormat8BitYUV;
+}
 
-  for (size_t h = 0; h < height; h += 2) {
-    for (size_t i = 0; i < rowBytes; i += 4) {
-      input++; // cb0
-      char y0 = *input++;
-      input++; // cr0
-      input++; // y1
+/* static */ void
+CaptureCallback::AddRefVideo(void* frame)
+{
+  static_cast<IDeckLinkVideoInputFrame*>(frame)->AddRef();
+}
 
-      *output++ = y0;
-    }
+/* static */ void
+CaptureCallback::ReleaseVideo(void* frame)
+{
+  static_cast<IDeckLinkVideoInputFrame*>(frame)->Release();
+}
 
-    // Skip the next row.
-    input += rowBytes;
-  }
+/* static */ void
+CaptureCallback::AddRefAudio(void* packet)
+{
+  static_cast<IDeckLinkAudioInputPacket*>(packet)->AddRef();
 }
 
-size_t
-ProcessFrame(size_t width, size_t height, char* frameBytes, char* result, int decoration)
+/* static */ void
+CaptureCallback::ReleaseAudio(void* packet)
 {
-  const size_t rowBytes = width * 4;
+  static_cast<IDeckLinkAudioInputPacket*>(packet)->Release();
+}
 
-  char* input = frameBytes;
-  char* output = result;
+HRESULT
+CaptureCallback::VideoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame,
+                                        IDeckLinkAudioInputPacket* audioFrame)
+{
+  VideoFrame video = {};
+  AudioPacket audio = {};
 
-  for (size_t h = 0; h < height; h++) {
-    bool invert = decoration;
-#if 0
-    if (decoration == 1 && h < height/2) {
-      invert = true;
+  if (videoFrame) {
+    BMDTimeValue time, duration;
+    if (videoFrame->GetStreamTime(&time, &duration, kTimeScale) != S_OK) {
+      Fail("GetStreamTime failed");
     }
-    if (decoration == 2 && h >= height/2) {
-      invert = true;
-    }
-#endif
-    for (size_t i = 0; i < rowBytes; i += 4) {
-      char first = *input++; // alpha
-      char second = *input++;
-      char third = *input++;
-      char fourth = *input++;
 
-      // Not sure why, but this channel seems to contain the luminosity.
-      int32_t luminosity = third;
+    void* frameBytes;
+    videoFrame->GetBytes(&frameBytes);
+
+    video.bytes = static_cast<const char*>(frameBytes);
+    video.width = videoFrame->GetWidth();
+    video.height = videoFrame->GetHeight();
+    video.rowBytes = videoFrame->GetRowBytes();
+    video.format = mFormat;
+    video.streamTime = time;
+    video.duration = duration;
+    video.hasInputSource = !(videoFrame->GetFlags() & bmdFrameHasNoInputSource);
+    video.owner.object = videoFrame;
+    video.owner.addRef = AddRefVideo;
+    video.owner.release = ReleaseVideo;
+
+    // The card's reference clock is shared by all of its inputs. Missing it
+    // for a frame only loses that frame's alignment, so it isn't fatal.
+    BMDTimeValue referenceTime, referenceDuration;
+    if (videoFrame->GetHardwareReferenceTimestamp(1000000000, &referenceTime,
+                                                  &referenceDuration) == S_OK) {
+      video.referenceTimeNs = referenceTime;
+    }
+  }
 
-      *output++ = invert ? 256 - luminosity : luminosity;
+  if (audioFrame) {
+    BMDTimeValue audioTime;
+    if (audioFrame->GetPacketTime(&audioTime, kTimeScale) != S_OK) {
+      Fail("GetPacketTime failed");
     }
 
-    // Skip the next row.
-    //input += rowBytes;
+    void* audioBuffer;
+    audioFrame->GetBytes(&audioBuffer);
+
+    audio.samples = static_cast<const int16_t*>(audioBuffer);
+    audio.sampleFrameCount = audioFrame->GetSampleFrameCount();
+    audio.packetTime = audioTime;
+    audio.owner.object = audioFrame;
+    audio.owner.addRef = AddRefAudio;
+    audio.owner.release = ReleaseAudio;
   }
 
-  return width * height;
+  mSink->FrameArrived(videoFrame ? &video : nullptr,
+                      audioFrame ? &audio : nullptr);
+  return S_OK;
 }
 
 HRESULT
-CaptureCallback::VideoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame,
-                                        IDeckLinkAudioInputPacket* audioFrame)
+CaptureCallback::VideoInputFormatChanged(BMDVideoInputFormatChangedEvents events,
+                                         IDeckLinkDisplayMode *mode,
+                                         BMDDetectedVideoInputFormatFlags formatFlags)
 {
-  printf("Frame");
-  if (!mWidth) return S_OK;
-  assert(mWidth != 0);
-  assert(mHeight != 0);
-
-  if (!videoFrame) {
-    printf("No video in frame!\n");
-    return S_OK;
-  }
+  BMDTimeValue t, scale;
+  mode->GetFrameRate(&t, &scale);
 
-  if (!audioFrame) {
-    printf("No audio in frame\n");
-    return S_OK;
-  }
+  mInput->PauseStreams();
 
-  gSkipFrameCounter++;
-  if (gSkipFrameCounter <= 60) {
-    return S_OK;
-  }
+  BMDDisplayModeSupport support;
+  mInput->DoesSupportVideoMode(mode->GetDisplayMode(),
+                               ToBMDPixelFormat(mFormat),
+                               bmdVideoInputFlagDefault,
+                               &support, nullptr);
+  printf("support: %d\n", support == bmdDisplayModeSupported);
 
-  BMDTimeValue time, duration;
-  if (videoFrame->GetStreamTime(&time, &duration, 60000) != S_OK) {
-    Fail("GetStreamTime failed");
+  if (mInput->EnableVideoInput(mode->GetDisplayMode(),
+                               ToBMDPixelFormat(mFormat),
+                               bmdVideoInputEnableFormatDetection) != S_OK) {
+    Fail("EnableVideoInput failed from VideoInputFormatChanged");
   }
 
-  long audioFrameCount = audioFrame->GetSampleFrameCount();
-  //printf("audio sample frame count = %ld\n", audioFrameCount);
-
-  BMDTimeValue audioTime;
-  if (audioFrame->GetPacketTime(&audioTime, 60000) != S_OK) {
-    Fail("GetPacketTime failed");
+  if (mInput->EnableAudioInput(bmdAudioSampleRate48kHz,
+                               bmdAudioSampleType16bitInteger,
+                               2) != S_OK) {
+    Fail("EnableAudioInput failed");
   }
 
-  void* frameBytes;
-  videoFrame->GetBytes(&frameBytes);
-  printf(" %lld", time / duration);
+  mSink->FormatChanged(mode->GetWidth(), mode->GetHeight(),
+                       mFormat, double(scale) / double(t));
 
-  printf(" (audio %lld)", audioTime / duration);
+  mInput->FlushStreams();
+  mInput->StartStreams();
+  return S_OK;
+}
 
-  void* audioBuffer;
-  audioFrame->GetBytes(&audioBuffer);
-  int16_t* audioBytes = static_cast<int16_t*>(audioBuffer);
+// Enough for every worker queue to be full with a few frames to spare for the
+// driver.
+static size_t
+CaptureBuffersFor(size_t workers)
+{
+  return workers * (kWorkerQueueSize + 1) + 8;
+}
 
-#if 0
-  int type = 0;
-  for (size_t i = 0; i < audioFrameCount * 2; i += 2) {
-    if (audioBytes[i] > 100) {
-      int dips = 0;
-      for (size_t j = 0; j < 20 && i + j < audioFrameCount * 2; j += 2) {
-        printf(" %d", audioBytes[i + j]);
-        if (audioBytes[i + j] < 0) {
-          dips++;
-        }
-      }
+// Gives the card buffers from a BufferPool, so captured frames are DMAed
+// straight into pre-faulted, locked memory that the workers then read in
+// place.
+class FrameAllocator : public IDeckLinkMemoryAllocator
+{
+public:
+  explicit FrameAllocator(size_t count)
+   : mRefCount(1)
+   , mCount(count)
+   , mOutstanding(0)
+  {}
 
-      if (dips >= 3) {
-        type = 1;
-      } else {
-        type = 2;
-      }
-      i = i + 30;
-    }
+  virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv) {
+    return E_NOINTERFACE;
   }
-#endif
 
-  int type = 0;
-  for (size_t i = 0; i < audioFrameCount * 2; i += 2) {
-    if (audioBytes[i] > 100) {
-      type = 1;
-    }
+  virtual ULONG STDMETHODCALLTYPE AddRef() {
+    int32_t old = std::atomic_fetch_add(&mRefCount, 1);
+    return old;
   }
 
-  if (type) {
-    gHasFirstFrame = true;
-
-    printf(" type = %d", type);
+  virtual ULONG STDMETHODCALLTYPE  Release() {
+    int32_t old = std::atomic_fetch_sub(&mRefCount, 1);
+    if (old == 1) {
+      delete this;
+    }
+    return old - 1;
   }
 
-#if 0
-  double sum = 0;
-  for (size_t i = 0; i < audioFrameCount * 2; i += 2) {
-    sum += audioBytes[i];
-  }
-  double avg = sum / audioFrameCount;
+  virtual HRESULT STDMETHODCALLTYPE
+  AllocateBuffer(uint32_t bufferSize, void** allocatedBuffer);
 
-  double sumSq = 0;
-  for (size_t i = 0; i < audioFrameCount * 2; i += 2) {
-    double dev = audioBytes[i] - avg;
-    sumSq += dev * dev;
-  }
+  virtual HRESULT STDMETHODCALLTYPE
+  ReleaseBuffer(void* buffer);
 
-  double stddev = sqrt(sumSq / audioFrameCount);
+  virtual HRESULT STDMETHODCALLTYPE Commit() { return S_OK; }
+  virtual HRESULT STDMETHODCALLTYPE Decommit() { return S_OK; }
 
-  if (stddev > 100) {
-    printf(" [mean %f, stddev = %f]", avg, stddev);
-  }
-#endif
+private:
+  std::atomic<int32_t> mRefCount;
+  size_t mCount;
+  std::unique_ptr<BufferPool> mPool;
+  std::atomic<size_t> mOutstanding;
+};
 
-  printf("\n");
+HRESULT
+FrameAllocator::AllocateBuffer(uint32_t bufferSize, void** allocatedBuffer)
+{
+  // The buffer size is only known once the driver asks, which happens as
+  // streams start rather than per frame, so that is when the pool is made.
+  if (!mPool || mPool->BufferSize() < bufferSize) {
+    if (mOutstanding) {
+      return E_OUTOFMEMORY;
+    }
 
-  if (!gHasFirstFrame) {
-    return S_OK;
+    mPool.reset(new BufferPool(bufferSize, mCount));
+    printf("capture buffers: %zu x %zu KB, %s pages, %slocked\n",
+           mPool->Count(), mPool->BufferSize() >> 10,
+           mPool->HugePages() ? "huge" : "normal",
+           mPool->Locked() ? "" : "not ");
   }
 
-  //printf("first sample: %d %d %d %d %d %d\n", audioBytes[0], audioBytes[1],
-  //       audioBytes[2], audioBytes[3],
-  //       audioBytes[4], audioBytes[5]);
-
-  if (videoFrame->GetFlags() & bmdFrameHasNoInputSource) {
-    printf("  [frame has no input source!]\n");
-  } else /* if (std::atomic_load(&gFrameCounter) % 2 == 0) */ {
-    void* frameBytes;
-    videoFrame->GetBytes(&frameBytes);
-
-    mFrameBuffer += ProcessFrame(mWidth, mHeight, (char*)frameBytes, mFrameBuffer, type);
-    //ReduceFrameBy8(mWidth, mHeight, (char*)frameBytes, mFrameBuffer);
-    //mFrameBuffer += mWidth * mHeight / 2 / 2;
+  char* buffer = mPool->Get();
+  if (!buffer) {
+    return E_OUTOFMEMORY;
   }
 
-  gFrameCounter++;
+  mOutstanding++;
+  *allocatedBuffer = buffer;
   return S_OK;
 }
 
 HRESULT
-CaptureCallback::VideoInputFormatChanged(BMDVideoInputFormatChangedEvents events,
-                                         IDeckLinkDisplayMode *mode,
-                                         BMDDetectedVideoInputFormatFlags formatFlags)
+FrameAllocator::ReleaseBuffer(void* buffer)
 {
-  BMDTimeValue t, scale;
-  mode->GetFrameRate(&t, &scale);
-  printf("format changed\n");
-  printf("%ld x %ld %f fpd\n", mode->GetWidth(), mode->GetHeight(),
-         float(scale) / float(t));
+  mPool->Put(static_cast<char*>(buffer));
+  mOutstanding--;
+  return S_OK;
+}
 
-  assert(mWidth == 0);
-  assert(mHeight == 0);
+// Captures from one DeckLink device, counting from 0 in the order the driver
+// lists them.
+class DeckLinkFrameSource : public FrameSource
+{
+public:
+  DeckLinkFrameSource(size_t device, PixelFormat format, size_t numBuffers);
+  virtual ~DeckLinkFrameSource();
 
-  mWidth = mode->GetWidth();
-  mHeight = mode->GetHeight();
+  virtual void Start(FrameSink* sink);
+  virtual void Stop();
 
-  mInput->PauseStreams();
+private:
+  PixelFormat mFormat;
+  IDeckLink* mDeckLink;
+  IDeckLinkInput* mInput;
+  CaptureCallback* mCallback;
+  FrameAllocator* mAllocator;
+};
 
-  BMDDisplayModeSupport support;
-  mInput->DoesSupportVideoMode(mode->GetDisplayMode(),
-                               bmdFormat8BitARGB,
-                               bmdVideoInputFlagDefault,
-                               &support, nullptr);
-  printf("support: %d\n", support == bmdDisplayModeSupported);
+DeckLinkFrameSource::DeckLinkFrameSource(size_t device, PixelFormat format,
+                                         size_t numBuffers)
+ : mFormat(format)
+{
+  IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+  for (size_t i = 0; i <= device; i++) {
+    if (i) {
+      RELEASE(mDeckLink);
+    }
+    if (deckLinkIterator->Next(&mDeckLink) != S_OK) {
+      Fail("device iteration failed");
+    }
+  }
+  RELEASE(deckLinkIterator);
 
-  if (mInput->EnableVideoInput(mode->GetDisplayMode(),
-                               bmdFormat8BitARGB,
+  if (mDeckLink->QueryInterface(IID_IDeckLinkInput, (void**)&mInput) != S_OK) {
+    Fail("IDeckLinkInput QI failed");
+  }
+
+  mCallback = new CaptureCallback(mInput, mFormat);
+  mAllocator = new FrameAllocator(numBuffers);
+}
+
+DeckLinkFrameSource::~DeckLinkFrameSource()
+{
+  RELEASE(mCallback);
+  RELEASE(mAllocator);
+  RELEASE(mInput);
+  RELEASE(mDeckLink);
+}
+
+void
+DeckLinkFrameSource::Start(FrameSink* sink)
+{
+  if (mInput->SetVideoInputFrameMemoryAllocator(mAllocator) != S_OK) {
+    Fail("SetVideoInputFrameMemoryAllocator failed");
+  }
+
+  if (mInput->EnableVideoInput(bmdModeHD1080p5994,
+                               ToBMDPixelFormat(mFormat),
                                bmdVideoInputEnableFormatDetection) != S_OK) {
-    Fail("EnableVideoInput failed from VideoInputFormatChanged");
+    Fail("EnableVideoInput failed");
   }
 
   if (mInput->EnableAudioInput(bmdAudioSampleRate48kHz,
@@ -315,9 +359,26 @@ CaptureCallback::VideoInputFormatChanged(BMDVideoInputFormatChangedEvents events
     Fail("EnableAudioInput failed");
   }
 
-  mInput->FlushStreams();
+  mCallback->SetSink(sink);
+  mInput->SetCallback(mCallback);
+
   mInput->StartStreams();
-  return S_OK;
+}
+
+void
+DeckLinkFrameSource::Stop()
+{
+  mInput->StopStreams();
+
+  if (mInput->DisableVideoInput() != S_OK) {
+    Fail("DisableVideoInput failed");
+  }
+
+  if (mInput->DisableAudioInput() != S_OK) {
+    Fail("DisableAudioInput failed");
+  }
+
+  mInput->SetCallback(nullptr);
 }
 
 void
@@ -339,86 +400,367 @@ WriteRaw(const char* fname, int width, int height, char* frameBuffer, int numFra
   close(fd);
 }
 
+// SIGINT makes this readable, so the main thread can sleep in poll().
+static int gInterruptPipe[2];
+
+static void
+Interrupt(int)
+{
+  char byte = 0;
+  write(gInterruptPipe[1], &byte, 1);
+}
+
+void
+Usage()
+{
+  fprintf(stderr,
+          "usage: capture [options] [seconds]\n"
+          "  -s, --source=SOURCE   decklink (default), synthetic or a raw video file\n"
+          "  -r, --rate=FPS        frame rate of a synthetic or file source (default 60)\n"
+          "  -W, --width=PIXELS    frame width of a synthetic or file source\n"
+          "  -H, --height=PIXELS   frame height of a synthetic or file source\n"
+          "  -a, --audio=FILE      48 kHz s16le stereo audio for a synthetic source\n"
+          "  -p, --pool=FRAMES     frames that may wait for the encoder (default 120)\n"
+          "  -f, --format=FORMAT   capture argb (default) or uyvy\n"
+          "  -d, --decimate        keep every other pixel of every other row (uyvy only)\n"
+          "  -w, --workers=N       frame processing threads (default 2)\n"
+          "  -b, --buffers=N       frames the card can capture into (default: enough\n"
+          "                        to fill every worker's queue)\n"
+          "  -t, --threshold=LEVEL left-channel level of a marker click (default 100)\n"
+          "  -m, --debounce=MS     minimum time between marker clicks (default 50)\n"
+          "  -c, --change=LEVEL    luma change that counts as a reaction (default 24)\n"
+          "  -C, --changed=PIXELS  pixels that must change for a reaction (default 16)\n"
+          "  -R, --roi=X,Y,W,H     only record this rectangle; may be repeated\n"
+          "  -F, --roi-file=FILE   only record the X,Y,W,H rectangles listed in FILE\n"
+          "  -L, --latency-roi=X,Y,W,H\n"
+          "                        only look for reactions in this rectangle\n"
+          "  -P, --preroll=SECS    also keep this much video from before each marker\n"
+          "  -T, --triggers=N      record a clip for each of N markers (default 1);\n"
+          "                        0 keeps going until interrupted\n"
+          "  -g, --segment-frames=N\n"
+          "                        start a new .pop segment every N frames\n"
+          "  -G, --segment-mb=MB   start a new segment once one reaches MB megabytes\n"
+          "  -y, --sync=N          start a sync point every N frames, where a player\n"
+          "                        can start decoding\n"
+          "  -l, --tiles=SIZE      store changed SIZE x SIZE tiles instead of rows\n"
+          "  -D, --device=N        capture from device N (default 0); may be repeated\n"
+          "                        to capture several inputs at once\n"
+          "  -k, --cpu=N           pin processing threads to cores from N on (default:\n"
+          "                        only with several inputs, from 0)\n"
+          "  -j, --json=FILE       also write the stage timings to FILE as JSON\n"
+          "  -S, --daemon=SOCKET   keep capturing and record on commands sent to the\n"
+          "                        Unix socket SOCKET (see CaptureDaemon.h)\n"
+          "  -v, --verbose         print a line for every frame\n"
+          "seconds: video to record per marker (default 10); 0 records until\n"
+          "  interrupted\n");
+  exit(1);
+}
+
 int
 main(int argc, char* argv[])
 {
   printf("Hello world!\n");
 
-  int numSecs = 10;
-  if (argc > 1) {
-    numSecs = atoi(argv[1]);
+  static const struct option longOptions[] = {
+    { "source", required_argument, nullptr, 's' },
+    { "rate", required_argument, nullptr, 'r' },
+    { "width", required_argument, nullptr, 'W' },
+    { "height", required_argument, nullptr, 'H' },
+    { "audio", required_argument, nullptr, 'a' },
+    { "pool", required_argument, nullptr, 'p' },
+    { "format", required_argument, nullptr, 'f' },
+    { "decimate", no_argument, nullptr, 'd' },
+    { "workers", required_argument, nullptr, 'w' },
+    { "buffers", required_argument, nullptr, 'b' },
+    { "threshold", required_argument, nullptr, 't' },
+    { "debounce", required_argument, nullptr, 'm' },
+    { "change", required_argument, nullptr, 'c' },
+    { "changed", required_argument, nullptr, 'C' },
+    { "roi", required_argument, nullptr, 'R' },
+    { "roi-file", required_argument, nullptr, 'F' },
+    { "latency-roi", required_argument, nullptr, 'L' },
+    { "preroll", required_argument, nullptr, 'P' },
+    { "triggers", required_argument, nullptr, 'T' },
+    { "segment-frames", required_argument, nullptr, 'g' },
+    { "segment-mb", required_argument, nullptr, 'G' },
+    { "sync", required_argument, nullptr, 'y' },
+    { "tiles", required_argument, nullptr, 'l' },
+    { "device", required_argument, nullptr, 'D' },
+    { "cpu", required_argument, nullptr, 'k' },
+    { "json", required_argument, nullptr, 'j' },
+    { "daemon", required_argument, nullptr, 'S' },
+    { "verbose", no_argument, nullptr, 'v' },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  std::string source = "decklink";
+  SyntheticOptions synthetic;
+  size_t poolSize = kDefaultPoolSize;
+  bool decimate = false;
+  size_t workers = kDefaultWorkers;
+  size_t captureBuffers = 0;
+  int16_t threshold = kDefaultOnsetThreshold;
+  size_t debounce = kDefaultOnsetDebounce;
+  uint8_t changeLevel = kDefaultChangeLevel;
+  size_t changedPixels = kDefaultChangedPixels;
+  std::vector<Region> regions;
+  Region latencyRegion;
+  double preroll = 0;
+  size_t triggers = 1;
+  size_t segmentFrames = 0;
+  uint64_t segmentBytes = 0;
+  size_t syncFrames = 0;
+  size_t tileSize = 0;
+  std::vector<size_t> devices;
+  int firstCpu = -1;
+  std::string jsonName;
+  std::string socketPath;
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:r:W:H:a:p:f:dw:b:t:m:c:C:R:F:L:P:T:g:G:y:l:D:k:j:S:v", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 's': source = optarg; break;
+      case 'r': synthetic.fps = atof(optarg); break;
+      case 'W': synthetic.width = atoi(optarg); break;
+      case 'H': synthetic.height = atoi(optarg); break;
+      case 'a': synthetic.audioFile = optarg; break;
+      case 'p': poolSize = atoi(optarg); break;
+      case 'f': synthetic.format = ParsePixelFormat(optarg); break;
+      case 'd': decimate = true; break;
+      case 'w': workers = atoi(optarg); break;
+      case 'b': captureBuffers = atoi(optarg); break;
+      case 't': threshold = atoi(optarg); break;
+      case 'm': debounce = atof(optarg) * kAudioSampleRate / 1000; break;
+      case 'c': changeLevel = atoi(optarg); break;
+      case 'C': changedPixels = atoi(optarg); break;
+      case 'R': {
+        Region region;
+        if (!ParseRegion(optarg, &region)) {
+          Fail("region must be X,Y,W,H");
+        }
+        regions.push_back(region);
+        break;
+      }
+      case 'F': LoadRegions(optarg, &regions); break;
+      case 'L':
+        if (!ParseRegion(optarg, &latencyRegion)) {
+          Fail("region must be X,Y,W,H");
+        }
+        break;
+      case 'P': preroll = atof(optarg); break;
+      case 'T': triggers = atoi(optarg); break;
+      case 'g': segmentFrames = atoi(optarg); break;
+      case 'G': segmentBytes = uint64_t(atof(optarg) * 1024 * 1024); break;
+      case 'y': syncFrames = atoi(optarg); break;
+      case 'l': tileSize = atoi(optarg); break;
+      case 'D': devices.push_back(atoi(optarg)); break;
+      case 'k': firstCpu = atoi(optarg); break;
+      case 'j': jsonName = optarg; break;
+      case 'S': socketPath = optarg; break;
+      case 'v': verbose = true; break;
+      default: Usage();
+    }
   }
 
-  char* frameBuffer = (char*)mmap(nullptr, kFrameBufferSize,
-                                  PROT_READ | PROT_WRITE,
-                                  MAP_ANON | MAP_PRIVATE,
-                                  0, 0);
-  if (frameBuffer == MAP_FAILED) {
-    Fail("mmap failed");
+  int numSecs = 10;
+  if (optind < argc) {
+    numSecs = atoi(argv[optind]);
   }
 
-  IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
-  IDeckLink* deckLink;
-  if (deckLinkIterator->Next(&deckLink) != S_OK) {
-    Fail("device iteration failed");
+  if (tileSize > kMaxTileSize) {
+    Usage();
   }
-  RELEASE(deckLinkIterator);
 
-  IDeckLinkInput* input;
-  if (deckLink->QueryInterface(IID_IDeckLinkInput, (void**)&input) != S_OK) {
-    Fail("IDeckLinkInput QI failed");
+  if (!captureBuffers) {
+    captureBuffers = CaptureBuffersFor(workers);
   }
 
-  if (input->EnableVideoInput(bmdModeHD1080p5994,
-                              bmdFormat8BitARGB,
-                              bmdVideoInputEnableFormatDetection) != S_OK) {
-    Fail("EnableVideoInput failed");
+  if (devices.empty()) {
+    devices.push_back(0);
+  }
+  if (devices.size() > 1 && firstCpu < 0) {
+    firstCpu = 0;
   }
 
-  if (input->EnableAudioInput(bmdAudioSampleRate48kHz,
-                              bmdAudioSampleType16bitInteger,
-                              2) != S_OK) {
-    Fail("EnableAudioInput failed");
+  if (!socketPath.empty() && devices.size() > 1) {
+    Fail("--daemon captures from one device");
   }
 
-  CaptureCallback* callback = new CaptureCallback(input, frameBuffer);
-  input->SetCallback(callback);
+  if (pipe(gInterruptPipe) == -1) {
+    Fail("pipe failed");
+  }
 
-  input->StartStreams();
+  auto makeSource = [&](size_t device) -> FrameSource* {
+    if (source == "decklink") {
+      return new DeckLinkFrameSource(device, synthetic.format, captureBuffers);
+    }
+    if (source != "synthetic") {
+      synthetic.videoFile = source;
+    }
+    return new SyntheticFrameSource(synthetic);
+  };
+
+  // Makes the processor for the |index|th input, writing |base|.pop and
+  // friends.
+  auto makeProcessor = [&](const std::string& base, size_t index) {
+    FrameProcessor* processor =
+      new FrameProcessor(base + ".pop", poolSize);
+    processor->SetVerbose(verbose);
+    processor->SetMaxSeconds(numSecs);
+    processor->SetDecimate(decimate);
+    processor->SetWorkers(workers);
+    processor->SetRegions(regions);
+    processor->SetPreroll(preroll);
+    processor->SetMaxTriggers(triggers);
+    processor->SetSegments(segmentFrames, segmentBytes);
+    processor->SetSyncInterval(syncFrames);
+    processor->SetTileSize(tileSize);
+    processor->SetOnsetThreshold(threshold);
+    processor->SetOnsetDebounce(debounce);
+    processor->SetEventsName(base + ".events");
+    processor->SetTimesName(base + ".times");
+    processor->SetMotionName(base + ".motion");
+    if (firstCpu >= 0) {
+      processor->SetFirstCpu(firstCpu + index * (workers + 1));
+    }
 
-  int numFrames = numSecs * 60;
+    LatencyMeter* latency = processor->GetLatencyMeter();
+    latency->SetChangeLevel(changeLevel);
+    latency->SetChangedPixels(changedPixels);
+    latency->SetRegion(latencyRegion);
+    return processor;
+  };
+
+  if (!socketPath.empty()) {
+    std::unique_ptr<FrameSource> input(makeSource(devices[0]));
+    {
+      CaptureDaemon daemon(socketPath, [&](const std::string& name) {
+        return makeProcessor(name, 0);
+      });
+      input->Start(&daemon);
+      signal(SIGINT, Interrupt);
+      daemon.Run(gInterruptPipe[0]);
+      input->Stop();
+    }
+    printf("Done.\n");
+    return 0;
+  }
 
-  while (gFrameCounter < numFrames) {
-    sched_yield();
+  // Each input gets its own source, processor, workers and encoder, and
+  // writes its own files: video.pop and friends for a single input, or
+  // video-N.pop for device N when there are several.
+  struct Input
+  {
+    size_t device;
+    std::unique_ptr<FrameSource> source;
+    std::unique_ptr<FrameProcessor> processor;
+  };
+  std::vector<Input> inputs(devices.size());
+
+  int donePipe[2];
+  if (pipe(donePipe) == -1) {
+    Fail("pipe failed");
   }
 
-  input->StopStreams();
+  for (size_t i = 0; i < inputs.size(); i++) {
+    Input& input = inputs[i];
+    input.device = devices[i];
+    input.source.reset(makeSource(input.device));
 
-  double stop = Now();
+    std::string base = "video";
+    if (inputs.size() > 1) {
+      base += "-" + std::to_string(input.device);
+    }
+    input.processor.reset(makeProcessor(base, i));
+    input.processor->SetDoneFd(donePipe[1]);
+  }
 
-  if (input->DisableVideoInput() != S_OK) {
-    Fail("DisableVideoInput failed");
+  for (Input& input : inputs) {
+    input.source->Start(input.processor.get());
   }
 
-  if (input->DisableAudioInput() != S_OK) {
-    Fail("DisableAudioInput failed");
+  signal(SIGINT, Interrupt);
+
+  // Sleep until a processor finishes or we are interrupted.
+  for (;;) {
+    bool done = true;
+    for (Input& input : inputs) {
+      done = done && input.processor->Done();
+    }
+    if (done) {
+      break;
+    }
+
+    pollfd fds[2] = { { donePipe[0], POLLIN, 0 }, { gInterruptPipe[0], POLLIN, 0 } };
+    if (poll(fds, 2, -1) == -1) {
+      continue;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    char byte;
+    read(donePipe[0], &byte, 1);
   }
 
-  printf("Finished recording.\n");
+  for (Input& input : inputs) {
+    input.source->Stop();
+  }
 
-  size_t width, height;
-  callback->GetSize(&width, &height);
+  for (Input& input : inputs) {
+    FrameProcessor* processor = input.processor.get();
+    if (inputs.size() > 1) {
+      printf("Device %zu:\n", input.device);
+    }
 
-  input->SetCallback(nullptr);
-  RELEASE(callback);
+    printf("Finished recording %zu frames from %zu markers.\n",
+           processor->NumFrames(), processor->NumTriggers());
 
-  RELEASE(input);
-  RELEASE(deckLink);
+    if (processor->QueueDroppedFrames()) {
+      printf("Dropped %zu frames waiting for a worker.\n",
+             processor->QueueDroppedFrames());
+    }
+    if (processor->DroppedFrames()) {
+      printf("Dropped %zu frames waiting for the encoder.\n",
+             processor->DroppedFrames());
+    }
+  }
 
   printf("Writing to disk...\n");
 
-  //WriteRaw("video.raw", width, height, frameBuffer, numFrames);
-  WriteCompressed("video.pop", "video.idx", width, height, frameBuffer, numFrames);
+  // Workers hold references to source buffers until they finish, so the
+  // sources go last.
+  for (Input& input : inputs) {
+    input.processor->Finish();
+  }
+  for (Input& input : inputs) {
+    input.source.reset();
+  }
+
+  for (Input& input : inputs) {
+    if (inputs.size() > 1) {
+      printf("Device %zu:\n", input.device);
+    }
+    printf("Logged %zu marker onsets.\n", input.processor->NumOnsets());
+    input.processor->GetLatencyMeter()->PrintSummary();
+    input.processor->PrintStats();
+  }
+
+  if (!jsonName.empty()) {
+    FILE* json = fopen(jsonName.c_str(), "w");
+    if (!json) {
+      Fail("unable to open JSON output");
+    }
+    fprintf(json, "[\n");
+    for (size_t i = 0; i < inputs.size(); i++) {
+      inputs[i].processor->WriteStatsJson(json);
+      if (i + 1 < inputs.size()) {
+        fprintf(json, ",\n");
+      }
+    }
+    fprintf(json, "]\n");
+    fclose(json);
+  }
 
   printf("Done.\n");
 
@@ -0,0 +1,356 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "CaptureDaemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <sstream>
+
+// Commands are short; a client sending more than this without a newline is
+// dropped.
+static const size_t kMaxCommandLength = 1024;
+
+CaptureDaemon::CaptureDaemon(const std::string& socketPath,
+                             const ProcessorFactory& factory)
+ : mSocketPath(socketPath)
+ , mFactory(factory)
+ , mListenFd(-1)
+ , mQuit(false)
+ , mRecording(nullptr)
+ , mRecordingWaits(false)
+ , mNumRecordings(0)
+ , mHasFormat(false)
+ , mWidth(0)
+ , mHeight(0)
+ , mFormat(kPixelFormatARGB)
+ , mFps(0)
+ , mSink(nullptr)
+ , mSinkWidth(0)
+ , mSinkHeight(0)
+ , mSinkFormat(kPixelFormatARGB)
+ , mSkipFrameCounter(0)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path)) {
+    Fail("socket path too long");
+  }
+  strcpy(addr.sun_path, socketPath.c_str());
+
+  mListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (mListenFd == -1) {
+    Fail("unable to create socket");
+  }
+
+  // A socket left behind by an earlier run would make bind fail.
+  unlink(socketPath.c_str());
+  if (bind(mListenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+    Fail("unable to bind socket");
+  }
+  if (listen(mListenFd, 4) == -1) {
+    Fail("unable to listen on socket");
+  }
+
+  // A client that hangs up before its reply must not take the daemon down.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pipe(mDonePipe) == -1) {
+    Fail("pipe failed");
+  }
+  fcntl(mDonePipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(mDonePipe[1], F_SETFL, O_NONBLOCK);
+}
+
+CaptureDaemon::~CaptureDaemon()
+{
+  StopRecording();
+
+  for (Client& client : mClients) {
+    close(client.fd);
+  }
+  close(mListenFd);
+  close(mDonePipe[0]);
+  close(mDonePipe[1]);
+  unlink(mSocketPath.c_str());
+}
+
+void
+CaptureDaemon::FormatChanged(size_t width, size_t height,
+                             PixelFormat format, double fps)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mHasFormat = true;
+  mWidth = width;
+  mHeight = height;
+  mFormat = format;
+  mFps = fps;
+  mSkipFrameCounter = 0;
+}
+
+void
+CaptureDaemon::FrameArrived(const VideoFrame* video, const AudioPacket* audio)
+{
+  // The input settles once, not once per recording.
+  mSkipFrameCounter++;
+  if (mSkipFrameCounter <= kWarmupFrames) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (!mSink) {
+    return;
+  }
+
+  // A recording keeps the format it started with.
+  if (video && (video->width != mSinkWidth || video->height != mSinkHeight ||
+                video->format != mSinkFormat)) {
+    return;
+  }
+
+  mSink->FrameArrived(video, audio);
+}
+
+void
+CaptureDaemon::Run(int interruptFd)
+{
+  printf("Listening on %s\n", mSocketPath.c_str());
+
+  while (!mQuit) {
+    std::vector<pollfd> fds;
+    fds.push_back({ mListenFd, POLLIN, 0 });
+    fds.push_back({ mDonePipe[0], POLLIN, 0 });
+    fds.push_back({ interruptFd, POLLIN, 0 });
+    for (const Client& client : mClients) {
+      fds.push_back({ client.fd, POLLIN, 0 });
+    }
+
+    if (poll(fds.data(), fds.size(), -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Fail("poll failed");
+    }
+
+    if (fds[2].revents) {
+      break;
+    }
+
+    if (fds[1].revents) {
+      char bytes[16];
+      while (read(mDonePipe[0], bytes, sizeof(bytes)) > 0) {
+      }
+      if (mRecording && mRecording->Done()) {
+        StopRecording();
+      }
+    }
+
+    // Clients were polled in order, and only ever removed below.
+    std::vector<Client> clients;
+    for (size_t i = 0; i < mClients.size(); i++) {
+      Client& client = mClients[i];
+      if (fds[3 + i].revents && !ReadClient(&client)) {
+        close(client.fd);
+        continue;
+      }
+      clients.push_back(client);
+    }
+    mClients.swap(clients);
+
+    if (fds[0].revents) {
+      Accept();
+    }
+  }
+
+  StopRecording();
+}
+
+void
+CaptureDaemon::Accept()
+{
+  int fd = accept(mListenFd, nullptr, nullptr);
+  if (fd == -1) {
+    return;
+  }
+  mClients.push_back({ fd, std::string(), false });
+}
+
+bool
+CaptureDaemon::ReadClient(Client* client)
+{
+  char bytes[256];
+  ssize_t length = read(client->fd, bytes, sizeof(bytes));
+  if (length <= 0) {
+    return false;
+  }
+  client->input.append(bytes, length);
+
+  size_t end;
+  while ((end = client->input.find('\n')) != std::string::npos) {
+    std::string line = client->input.substr(0, end);
+    client->input.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    Command(client, line);
+  }
+  return client->input.size() <= kMaxCommandLength;
+}
+
+void
+CaptureDaemon::Command(Client* client, const std::string& line)
+{
+  std::istringstream words(line);
+  std::string command;
+  words >> command;
+
+  if (command == "start" || command == "arm") {
+    std::string name;
+    double seconds = 0;
+    words >> name >> seconds;
+    if (name.empty()) {
+      name = "recording-" + std::to_string(mNumRecordings);
+    }
+    StartRecording(client, command == "arm", name, seconds);
+  } else if (command == "stop") {
+    if (!mRecording) {
+      Reply(client, "error not recording");
+      return;
+    }
+    client->waiting = true;
+    StopRecording();
+  } else if (command == "wait") {
+    if (!mRecording) {
+      Reply(client, "error not recording");
+      return;
+    }
+    client->waiting = true;
+  } else if (command == "status") {
+    if (!mRecording) {
+      Reply(client, "ok idle");
+    } else if (mRecordingWaits && !mRecording->NumTriggers()) {
+      Reply(client, "ok armed " + mRecordingName);
+    } else {
+      Reply(client, "ok recording " + mRecordingName + " " +
+                    std::to_string(mRecording->NumFrames()));
+    }
+  } else if (command == "quit") {
+    Reply(client, "ok");
+    mQuit = true;
+  } else if (!command.empty()) {
+    Reply(client, "error unknown command " + command);
+  }
+}
+
+void
+CaptureDaemon::StartRecording(Client* client, bool waitForMarker,
+                              const std::string& name, double seconds)
+{
+  if (mRecording) {
+    Reply(client, "error already recording " + mRecordingName);
+    return;
+  }
+
+  size_t width, height;
+  PixelFormat format;
+  double fps;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mHasFormat) {
+      Reply(client, "error no input");
+      return;
+    }
+    width = mWidth;
+    height = mHeight;
+    format = mFormat;
+    fps = mFps;
+  }
+
+  // Everything slow, from allocating the pool to starting the workers,
+  // happens here, before the source sees the new processor.
+  FrameProcessor* processor = mFactory(name);
+  processor->SetWarmupFrames(0);
+  processor->SetWaitForMarker(waitForMarker);
+  processor->SetMaxTriggers(1);
+  processor->SetMaxSeconds(seconds);
+  processor->SetDoneFd(mDonePipe[1]);
+  processor->FormatChanged(width, height, format, fps);
+
+  mRecording = processor;
+  mRecordingName = name;
+  mRecordingWaits = waitForMarker;
+  mNumRecordings++;
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSink = processor;
+    mSinkWidth = width;
+    mSinkHeight = height;
+    mSinkFormat = format;
+  }
+
+  printf("%s %s\n", waitForMarker ? "Armed" : "Recording", name.c_str());
+  Reply(client, "ok " + name);
+}
+
+void
+CaptureDaemon::StopRecording()
+{
+  if (!mRecording) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSink = nullptr;
+  }
+
+  FrameProcessor* processor = mRecording;
+  mRecording = nullptr;
+  processor->Finish();
+
+  printf("Finished recording %s: %zu frames from %zu markers.\n",
+         mRecordingName.c_str(), processor->NumFrames(), processor->NumTriggers());
+  if (processor->QueueDroppedFrames()) {
+    printf("Dropped %zu frames waiting for a worker.\n",
+           processor->QueueDroppedFrames());
+  }
+  if (processor->DroppedFrames()) {
+    printf("Dropped %zu frames waiting for the encoder.\n",
+           processor->DroppedFrames());
+  }
+  printf("Logged %zu marker onsets.\n", processor->NumOnsets());
+  processor->GetLatencyMeter()->PrintSummary();
+  processor->PrintStats();
+
+  std::string reply = "ok " + mRecordingName + " " +
+                      std::to_string(processor->NumFrames());
+  for (Client& client : mClients) {
+    if (client.waiting) {
+      client.waiting = false;
+      Reply(&client, reply);
+    }
+  }
+
+  delete processor;
+}
+
+void
+CaptureDaemon::Reply(Client* client, const std::string& reply)
+{
+  // Replies are a line each, so a blocking write is only held up by a client
+  // that stops reading, and then only once its socket buffer is full.
+  std::string line = reply + "\n";
+  if (write(client->fd, line.data(), line.size()) != ssize_t(line.size())) {
+    fprintf(stderr, "Dropped a reply to a client\n");
+  }
+}
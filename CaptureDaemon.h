@@ -0,0 +1,93 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef CaptureDaemon_h
+#define CaptureDaemon_h
+
+#include <stddef.h>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CaptureLib.h"
+#include "FrameSource.h"
+
+// Makes a configured processor that writes NAME.pop and friends.
+typedef std::function<FrameProcessor*(const std::string& name)> ProcessorFactory;
+
+// Keeps an input running and records from it on command. Commands are lines
+// of text on a Unix domain socket:
+//
+//   start [NAME] [SECONDS]  record now, for SECONDS or until stopped
+//   arm [NAME] [SECONDS]    record from the next marker, with pre-roll
+//   stop                    finish the current recording
+//   wait                    reply once the current recording has finished
+//   status                  say what is being recorded
+//   quit                    finish the current recording and exit
+//
+// Every reply is one line starting with "ok" or "error". A recording that
+// finishes is answered with "ok NAME FRAMES". Every command gets a new
+// processor, so each recording has its own files and statistics.
+class CaptureDaemon : public FrameSink
+{
+public:
+  CaptureDaemon(const std::string& socketPath, const ProcessorFactory& factory);
+  ~CaptureDaemon();
+
+  virtual void FormatChanged(size_t width, size_t height,
+                             PixelFormat format, double fps);
+  virtual void FrameArrived(const VideoFrame* video, const AudioPacket* audio);
+
+  // Serves commands until "quit" or until |interruptFd| becomes readable.
+  // Sleeps in poll() in between.
+  void Run(int interruptFd);
+
+  // Finishes the recording in progress, if any. Call after stopping the
+  // source.
+  void StopRecording();
+
+private:
+  struct Client
+  {
+    int fd;
+    std::string input;
+    bool waiting;
+  };
+
+  void Accept();
+  bool ReadClient(Client* client);
+  void Command(Client* client, const std::string& line);
+  void StartRecording(Client* client, bool waitForMarker,
+                      const std::string& name, double seconds);
+  void Reply(Client* client, const std::string& reply);
+
+  std::string mSocketPath;
+  ProcessorFactory mFactory;
+  int mListenFd;
+  int mDonePipe[2];
+  std::vector<Client> mClients;
+  bool mQuit;
+
+  // Only touched by Run(), apart from the swap under mMutex.
+  FrameProcessor* mRecording;
+  std::string mRecordingName;
+  bool mRecordingWaits;
+  size_t mNumRecordings;
+
+  // Shared with the source's thread. The lock is only contended while a
+  // recording starts or stops.
+  std::mutex mMutex;
+  bool mHasFormat;
+  size_t mWidth, mHeight;
+  PixelFormat mFormat;
+  double mFps;
+  FrameProcessor* mSink;
+  size_t mSinkWidth, mSinkHeight;
+  PixelFormat mSinkFormat;
+
+  // Owned by the source's thread.
+  size_t mSkipFrameCounter;
+};
+
+#endif // CaptureDaemon_h
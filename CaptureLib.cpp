@@ -0,0 +1,836 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "CaptureLib.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "Affinity.h"
+#include "Luma.h"
+
+// Converts a time in kTimeScale units to nanoseconds without overflowing.
+static int64_t
+TimeToNs(int64_t time)
+{
+  return time / kTimeScale * 1000000000 + time % kTimeScale * 1000000000 / kTimeScale;
+}
+
+void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+double
+Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return double(tv.tv_usec) / 1000000.0 + double(tv.tv_sec);
+}
+
+// Data is expected to be in UYVY format, with 32 bits for every two pixels.
+// Keeps the first Y of every pair on every other row.
+size_t
+ReduceFrameBy8(size_t width, size_t height, size_t rowBytes, const char* frameBytes,
+               char* result, int decoration)
+{
+  ExtractLumaFn extractLuma = GetLumaKernel()->extractUYVYHalf;
+
+  const char* input = frameBytes;
+  char* output = result;
+
+  // An odd last row has no pair, so it is dropped like the odd column.
+  for (size_t h = 0; h < height / 2; h++) {
+    extractLuma(input, output, width / 2, decoration);
+    output += width / 2;
+
+    // Skip the next row.
+    input += rowBytes * 2;
+  }
+
+  return (width / 2) * (height / 2);
+}
+
+// Data is expected to be in UYVY format, with 32 bits for every two pixels.
+size_t
+ProcessFrameUYVY(size_t width, size_t height, size_t rowBytes, const char* frameBytes,
+                 char* result, int decoration)
+{
+  ExtractLumaFn extractLuma = GetLumaKernel()->extractUYVY;
+
+  const char* input = frameBytes;
+  char* output = result;
+
+  for (size_t h = 0; h < height; h++) {
+    extractLuma(input, output, width, decoration);
+    input += rowBytes;
+    output += width;
+  }
+
+  return width * height;
+}
+
+size_t
+ProcessFrame(size_t width, size_t height, size_t rowBytes, const char* frameBytes,
+             char* result, int decoration)
+{
+  ExtractLumaFn extractLuma = GetLumaKernel()->extractARGB;
+
+  const char* input = frameBytes;
+  char* output = result;
+
+  for (size_t h = 0; h < height; h++) {
+    bool invert = decoration;
+#if 0
+    if (decoration == 1 && h < height/2) {
+      invert = true;
+    }
+    if (decoration == 2 && h >= height/2) {
+      invert = true;
+    }
+#endif
+    extractLuma(input, output, width, invert);
+    input += rowBytes;
+    output += width;
+
+    // Skip the next row.
+    //input += rowBytes;
+  }
+
+  return width * height;
+}
+
+size_t
+ProcessRegions(size_t rowBytes, PixelFormat format, bool decimate,
+               const std::vector<Region>& regions, const char* frameBytes,
+               char* result, int decoration)
+{
+  const LumaKernel* kernel = GetLumaKernel();
+  ExtractLumaFn extractLuma;
+  if (format == kPixelFormatARGB) {
+    extractLuma = kernel->extractARGB;
+  } else {
+    extractLuma = decimate ? kernel->extractUYVYHalf : kernel->extractUYVY;
+  }
+
+  const size_t step = decimate ? 2 : 1;
+  const size_t pixelBytes = format == kPixelFormatARGB ? 4 : 2;
+
+  char* output = result;
+  for (const Region& region : regions) {
+    for (size_t y = 0; y < region.height; y++) {
+      const char* input = frameBytes + (region.y + y) * step * rowBytes +
+                          region.x * step * pixelBytes;
+      extractLuma(input, output, region.width, decoration);
+      output += region.width;
+    }
+  }
+
+  return output - result;
+}
+
+FrameProcessor::FrameProcessor(const std::string& popName, size_t poolSize)
+ : mPopName(popName)
+ , mPoolSize(poolSize)
+ , mMaxFrames(0)
+ , mMaxSeconds(0)
+ , mFormat(kPixelFormatARGB)
+ , mDecimate(false)
+ , mWidth(0)
+ , mHeight(0)
+ , mOutputWidth(0)
+ , mOutputHeight(0)
+ , mFps(0)
+ , mVerbose(false)
+ , mOnsetThreshold(kDefaultOnsetThreshold)
+ , mOnsetDebounce(kDefaultOnsetDebounce)
+ , mTimesFile(nullptr)
+ , mFirstCpu(-1)
+ , mNumWorkers(kDefaultWorkers)
+ , mStopping(false)
+ , mNextSequence(0)
+ , mWarmupFrames(kWarmupFrames)
+ , mSkipFrameCounter(0)
+ , mNextCommit(0)
+ , mArmed(true)
+ , mPrerollSeconds(0)
+ , mPrerollFrames(0)
+ , mWaitForMarker(true)
+ , mSegmentFrames(0)
+ , mSegmentBytes(0)
+ , mSyncInterval(0)
+ , mDedupEntries(kDefaultDedupEntries)
+ , mTileSize(0)
+ , mMaxTriggers(1)
+ , mClipFrames(0)
+ , mTriggers(0)
+ , mDone(false)
+ , mDoneFd(-1)
+ , mHasLastOnset(false)
+ , mLastOnsetSample(0)
+ , mNumOnsets(0)
+ , mFrameCounter(0)
+ , mDroppedFrames(0)
+ , mQueueDroppedFrames(0)
+ , mHasPrevFrame(false)
+ , mPrevStreamTime(0)
+ , mPrevArrivalNs(0)
+ , mStreamGaps(0)
+ , mStreamMissedFrames(0)
+ , mNoVideoFrames(0)
+ , mNoAudioFrames(0)
+ , mNoReferenceTimeFrames(0)
+{
+}
+
+FrameProcessor::~FrameProcessor()
+{
+  Finish();
+}
+
+void
+FrameProcessor::FormatChanged(size_t width, size_t height,
+                              PixelFormat format, double fps)
+{
+  printf("format changed\n");
+  printf("%zu x %zu %s %f fps\n", width, height, PixelFormatName(format), fps);
+
+  assert(mWidth == 0);
+  assert(mHeight == 0);
+
+  if (mDecimate && format != kPixelFormatUYVY) {
+    Fail("decimation needs UYVY input");
+  }
+
+  mFormat = format;
+  mFps = fps;
+  mArmed = mWaitForMarker;
+  mOutputWidth = mDecimate ? width / 2 : width;
+  mOutputHeight = mDecimate ? height / 2 : height;
+
+  Region frame(0, 0, mOutputWidth, mOutputHeight);
+  for (const Region& region : mRegions) {
+    if (!frame.Contains(region)) {
+      Fail("region of interest is outside the frame");
+    }
+  }
+
+  mPrerollFrames = size_t(mPrerollSeconds * fps + 0.5);
+  if (mMaxSeconds) {
+    mMaxFrames = size_t(mMaxSeconds * fps + 0.5);
+  }
+  mEncoder.reset(new EncoderThread(mOutputWidth, mOutputHeight,
+                                   mPoolSize + mPrerollFrames, mRegions));
+  mEncoder->SetSegments(mSegmentFrames, mSegmentBytes);
+  mEncoder->SetSyncInterval(mSyncInterval);
+  mEncoder->SetDedupEntries(mDedupEntries);
+  mEncoder->SetTileSize(mTileSize);
+  mEncoder->SetFrameRate(fps);
+  if (!mMotionName.empty()) {
+    mEncoder->SetMotionName(mMotionName);
+  }
+  mEncoder->Start(mPopName.c_str());
+  mLatency.Init(mOutputWidth, mOutputHeight, mRegions);
+  if (!mLatency.WatchedPixels()) {
+    Fail("latency rectangle is outside the recorded frame");
+  }
+
+  if (!mEventsName.empty()) {
+    mEventLog.Open(mEventsName);
+  }
+
+  if (!mTimesName.empty()) {
+    mTimesFile = fopen(mTimesName.c_str(), "wb");
+    if (!mTimesFile) {
+      Fail("unable to open times file");
+    }
+    uint32_t header[2] = { 0, kTimesVersion };
+    memcpy(header, "PTIM", 4);
+    if (fwrite(header, sizeof(header), 1, mTimesFile) != 1) {
+      Fail("unable to write times file");
+    }
+  }
+
+  // A worker can run at most a full queue plus the frame in hand ahead of
+  // the slowest one, which bounds how many results wait to be committed.
+  mResults.resize(mNumWorkers * (kWorkerQueueSize + 2));
+
+  for (size_t i = 0; i < mNumWorkers; i++) {
+    mWorkers.emplace_back(new Worker(kWorkerQueueSize));
+  }
+  for (auto& worker : mWorkers) {
+    worker->thread = std::thread(&FrameProcessor::WorkerThread, this, worker.get());
+  }
+
+  if (mFirstCpu >= 0) {
+    for (size_t i = 0; i < mNumWorkers; i++) {
+      PinThread(mWorkers[i]->thread, mFirstCpu + i);
+    }
+    mEncoder->PinToCpu(mFirstCpu + mNumWorkers);
+  }
+
+  mWidth = width;
+  mHeight = height;
+}
+
+void
+FrameProcessor::Finish()
+{
+  mStopping = true;
+  for (auto& worker : mWorkers) {
+    worker->condVar.notify_one();
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+
+  if (mEncoder) {
+    for (const HeldFrame& held : mPreroll) {
+      mEncoder->ReturnBuffer(held.buffer);
+    }
+    mPreroll.clear();
+    mEncoder->Finish();
+  }
+  mEventLog.Close();
+
+  if (mTimesFile) {
+    fclose(mTimesFile);
+    mTimesFile = nullptr;
+  }
+}
+
+void
+FrameProcessor::FrameArrived(const VideoFrame* video, const AudioPacket* audio)
+{
+  uint64_t callbackStart = NowNs();
+
+  if (!mWidth) return;
+  assert(mWidth != 0);
+  assert(mHeight != 0);
+
+  if (!video) {
+    if (mVerbose) {
+      printf("No video in frame!\n");
+    }
+    mNoVideoFrames++;
+    return;
+  }
+
+  if (!audio) {
+    if (mVerbose) {
+      printf("No audio in frame\n");
+    }
+    mNoAudioFrames++;
+    return;
+  }
+
+  mSkipFrameCounter++;
+  if (mSkipFrameCounter <= mWarmupFrames) {
+    return;
+  }
+
+  if (!video->referenceTimeNs) {
+    mNoReferenceTimeFrames++;
+  }
+
+  if (mHasPrevFrame) {
+    int64_t streamGap = video->streamTime - mPrevStreamTime;
+    if (streamGap > video->duration) {
+      mStreamGaps++;
+      mStreamMissedFrames += streamGap / video->duration - 1;
+    }
+
+    int64_t arrivalGap = callbackStart - mPrevArrivalNs;
+    int64_t jitter = arrivalGap - TimeToNs(streamGap);
+    mJitterStats.Add(jitter < 0 ? -jitter : jitter);
+  }
+  mHasPrevFrame = true;
+  mPrevStreamTime = video->streamTime;
+  mPrevArrivalNs = callbackStart;
+
+  if (mStopping) {
+    return;
+  }
+
+  QueuedFrame frame;
+  frame.sequence = mNextSequence;
+  frame.arrivalNs = callbackStart;
+  frame.video = *video;
+  frame.audio = *audio;
+
+  // Workers take frames round-robin, so sequence numbers map to workers.
+  Worker* worker = mWorkers[frame.sequence % mWorkers.size()].get();
+
+  video->owner.AddRef();
+  audio->owner.AddRef();
+  if (!worker->queue.Push(frame)) {
+    video->owner.Release();
+    audio->owner.Release();
+    mQueueDroppedFrames++;
+    return;
+  }
+  mNextSequence++;
+
+  if (worker->sleeping) {
+    worker->condVar.notify_one();
+  }
+
+  mCallbackStats.Add(NowNs() - callbackStart);
+}
+
+void
+FrameProcessor::WorkerThread(Worker* worker)
+{
+  for (;;) {
+    QueuedFrame frame;
+    if (worker->queue.Pop(&frame)) {
+      ProcessQueuedFrame(worker, frame);
+      continue;
+    }
+
+    if (mStopping) {
+      return;
+    }
+
+    // The callback only notifies sleeping workers, so the timeout covers a
+    // push that lands between our Pop and setting |sleeping|.
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    worker->sleeping = true;
+    if (!worker->queue.Depth() && !mStopping) {
+      worker->condVar.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    worker->sleeping = false;
+  }
+}
+
+void
+FrameProcessor::ProcessQueuedFrame(Worker* worker, const QueuedFrame& frame)
+{
+  uint64_t start = NowNs();
+  worker->queueWaitStats.Add(start - frame.arrivalNs);
+
+  Result result;
+  result.frameNumber = frame.video.streamTime / frame.video.duration;
+  result.audioNumber = frame.audio.packetTime / frame.video.duration;
+
+  result.times.streamTimeNs = TimeToNs(frame.video.streamTime);
+  result.times.referenceTimeNs = frame.video.referenceTimeNs;
+  result.times.arrivalNs = frame.arrivalNs;
+  result.packetTime = frame.audio.packetTime;
+  result.numOnsets = FindOnsets(frame.audio.samples, frame.audio.sampleFrameCount,
+                                mOnsetThreshold, mOnsetDebounce,
+                                result.onsets, kMaxOnsetsPerPacket);
+  result.type = result.numOnsets ? 1 : 0;
+  uint64_t markerEnd = NowNs();
+  worker->markerStats.Add(markerEnd - start);
+
+  if (frame.video.hasInputSource) {
+    result.buffer = mEncoder->GetBuffer();
+  }
+
+  if (result.buffer) {
+    const size_t rowBytes = frame.video.rowBytes;
+    if (!mRegions.empty()) {
+      ProcessRegions(rowBytes, mFormat, mDecimate, mRegions, frame.video.bytes,
+                     result.buffer, result.type);
+    } else if (mFormat == kPixelFormatARGB) {
+      ProcessFrame(mWidth, mHeight, rowBytes, frame.video.bytes, result.buffer,
+                   result.type);
+    } else if (mDecimate) {
+      ReduceFrameBy8(mWidth, mHeight, rowBytes, frame.video.bytes, result.buffer,
+                     result.type);
+    } else {
+      ProcessFrameUYVY(mWidth, mHeight, rowBytes, frame.video.bytes, result.buffer,
+                       result.type);
+    }
+    worker->processStats.Add(NowNs() - markerEnd);
+  } else if (frame.video.hasInputSource) {
+    // The encoder has fallen a whole pool behind.
+    mDroppedFrames++;
+  }
+
+  frame.video.owner.Release();
+  frame.audio.owner.Release();
+
+  std::lock_guard<std::mutex> guard(mCommitMutex);
+  Result& slot = mResults[frame.sequence % mResults.size()];
+  assert(!slot.ready);
+  slot = result;
+  slot.ready = true;
+  CommitResults();
+}
+
+// Called with mCommitMutex held.
+void
+FrameProcessor::CommitResults()
+{
+  for (;;) {
+    Result& slot = mResults[mNextCommit % mResults.size()];
+    if (!slot.ready) {
+      return;
+    }
+
+    Commit(slot);
+    slot = Result();
+    mNextCommit++;
+  }
+}
+
+// Called with mCommitMutex held, once per frame in arrival order.
+void
+FrameProcessor::Commit(const Result& result)
+{
+  if (mVerbose) {
+    printf("Frame %lld (audio %lld)", (long long)result.frameNumber,
+           (long long)result.audioNumber);
+    if (result.type) {
+      printf(" type = %d", result.type);
+    }
+    if (!result.buffer) {
+      printf("  [no frame recorded]");
+    }
+    printf("\n");
+  }
+
+  if (result.type && mArmed && !mDone) {
+    mArmed = false;
+    mClipFrames = 0;
+    mTriggers++;
+    if (mVerbose) {
+      printf("Trigger %zu at frame %zu, with %zu frames of pre-roll\n",
+             size_t(mTriggers), mFrameCounter + mPreroll.size(), mPreroll.size());
+    }
+    FlushPreroll();
+  }
+
+  bool record = result.buffer && !mArmed && !mDone;
+  int64_t onsetNs;
+  bool onset = LogOnsets(result, record ? int64_t(mFrameCounter) : -1, &onsetNs);
+
+  if (result.buffer) {
+    uint64_t start = NowNs();
+    if (onset) {
+      mLatency.Arm(onsetNs, result.buffer, result.type);
+    } else {
+      mLatency.AddFrame(result.times.streamTimeNs, result.buffer, result.type);
+    }
+    mLatencyStats.Add(NowNs() - start);
+  }
+
+  if (!result.buffer) {
+    return;
+  }
+
+  if (mArmed && !mDone) {
+    HoldPreroll(result.buffer, result.times);
+    return;
+  }
+
+  if (!record) {
+    mEncoder->ReturnBuffer(result.buffer);
+    return;
+  }
+
+  Record(result.buffer, result.times);
+
+  mClipFrames++;
+  if (mMaxFrames && mClipFrames >= mMaxFrames) {
+    if (!mWaitForMarker || (mMaxTriggers && mTriggers >= mMaxTriggers)) {
+      SetDone();
+    } else {
+      mArmed = true;
+    }
+  }
+}
+
+// Called with mCommitMutex held.
+void
+FrameProcessor::SetDone()
+{
+  mDone = true;
+  if (mDoneFd == -1) {
+    return;
+  }
+
+  // A full non-blocking pipe already has a wakeup waiting in it.
+  char byte = 0;
+  while (write(mDoneFd, &byte, 1) != 1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
+    if (errno != EINTR) {
+      Fail("unable to signal the end of recording");
+    }
+  }
+}
+
+// Called with mCommitMutex held.
+void
+FrameProcessor::HoldPreroll(char* buffer, const FrameTimes& times)
+{
+  mPreroll.push_back(HeldFrame { buffer, times });
+  if (mPreroll.size() > mPrerollFrames) {
+    mEncoder->ReturnBuffer(mPreroll.front().buffer);
+    mPreroll.pop_front();
+  }
+}
+
+// Called with mCommitMutex held.
+void
+FrameProcessor::FlushPreroll()
+{
+  for (const HeldFrame& held : mPreroll) {
+    Record(held.buffer, held.times);
+  }
+  mPreroll.clear();
+}
+
+// Called with mCommitMutex held.
+void
+FrameProcessor::Record(char* buffer, const FrameTimes& times)
+{
+  mEncoder->SubmitBuffer(buffer, times.streamTimeNs);
+  mFrameCounter++;
+
+  if (mTimesFile && fwrite(&times, sizeof(times), 1, mTimesFile) != 1) {
+    Fail("write failed");
+  }
+}
+
+// Called with mCommitMutex held. Returns whether |result| had an onset, and
+// the first one's stream time in |onsetNs|.
+bool
+FrameProcessor::LogOnsets(const Result& result, int64_t recordedFrame, int64_t* onsetNs)
+{
+  bool found = false;
+
+  // Rounded down to a whole sample, which is all debouncing needs.
+  int64_t packetSample = result.packetTime * int64_t(kAudioSampleRate) / kTimeScale;
+  int64_t packetNs = TimeToNs(result.packetTime);
+
+  for (size_t i = 0; i < result.numOnsets; i++) {
+    int64_t sample = packetSample + result.onsets[i];
+    if (mHasLastOnset && sample - mLastOnsetSample < int64_t(mOnsetDebounce)) {
+      continue;
+    }
+    mHasLastOnset = true;
+    mLastOnsetSample = sample;
+    mNumOnsets++;
+
+    int64_t streamTimeNs = packetNs + int64_t(result.onsets[i]) * 1000000000 / kAudioSampleRate;
+    if (!found) {
+      found = true;
+      *onsetNs = streamTimeNs;
+    }
+
+    if (mVerbose) {
+      printf("Onset at sample %u of packet %lld\n", result.onsets[i],
+             (long long)result.packetTime);
+    }
+
+    if (mEventLog.IsOpen()) {
+      OnsetEvent event;
+      event.packetTime = result.packetTime;
+      event.streamTimeNs = streamTimeNs;
+      event.sampleOffset = result.onsets[i];
+      event.frame = recordedFrame;
+      mEventLog.Write(event);
+    }
+  }
+  return found;
+}
+
+size_t
+FrameProcessor::QueueDepth() const
+{
+  size_t depth = 0;
+  for (auto& worker : mWorkers) {
+    depth += worker->queue.Depth();
+  }
+  return depth;
+}
+
+size_t
+FrameProcessor::QueueHighWater() const
+{
+  size_t highWater = 0;
+  for (auto& worker : mWorkers) {
+    highWater = std::max(highWater, worker->queue.HighWater());
+  }
+  return highWater;
+}
+
+// The per-worker stats are only stable once the workers have finished.
+
+StageStats
+FrameProcessor::QueueWaitStats() const
+{
+  StageStats stats;
+  for (auto& worker : mWorkers) {
+    stats.Merge(worker->queueWaitStats);
+  }
+  return stats;
+}
+
+StageStats
+FrameProcessor::MarkerStats() const
+{
+  StageStats stats;
+  for (auto& worker : mWorkers) {
+    stats.Merge(worker->markerStats);
+  }
+  return stats;
+}
+
+StageStats
+FrameProcessor::ProcessStats() const
+{
+  StageStats stats;
+  for (auto& worker : mWorkers) {
+    stats.Merge(worker->processStats);
+  }
+  return stats;
+}
+
+// The stages in pipeline order, with the jitter of frame arrival last.
+static void
+GetStages(const FrameProcessor* processor,
+          std::vector<std::pair<const char*, StageStats>>* stages)
+{
+  stages->emplace_back("callback", processor->CallbackStats());
+  stages->emplace_back("queue wait", processor->QueueWaitStats());
+  stages->emplace_back("marker", processor->MarkerStats());
+  stages->emplace_back("luma", processor->ProcessStats());
+  stages->emplace_back("latency", processor->LatencyStats());
+  if (processor->GetEncoder()) {
+    stages->emplace_back("encode", processor->GetEncoder()->EncodeStats());
+  }
+  stages->emplace_back("jitter", processor->JitterStats());
+}
+
+void
+FrameProcessor::PrintStats() const
+{
+  std::vector<std::pair<const char*, StageStats>> stages;
+  GetStages(this, &stages);
+
+  double budgetUs = mFps ? 1000000.0 / mFps : 0;
+
+  printf("  %-10s %8s %9s %9s %9s %9s %9s  (us)\n",
+         "stage", "count", "mean", "p50", "p99", "p99.9", "max");
+  for (auto& stage : stages) {
+    const StageStats& stats = stage.second;
+    printf("  %-10s %8llu %9.1f %9.1f %9.1f %9.1f %9.1f",
+           stage.first, (unsigned long long)stats.count, stats.MeanUs(),
+           stats.PercentileUs(50), stats.PercentileUs(99),
+           stats.PercentileUs(99.9), stats.MaxUs());
+    // Jitter is how far arrivals stray, not time spent, so it has no share
+    // of the budget.
+    if (budgetUs && strcmp(stage.first, "jitter") != 0) {
+      printf(" %6.1f%% of frame budget", stats.MeanUs() * 100.0 / budgetUs);
+    }
+    printf("\n");
+  }
+
+  if (mEncoder && mEncoder->NumFrames()) {
+    const DedupStats& dedup = mEncoder->GetDedupStats();
+    const StageStats& encode = mEncoder->EncodeStats();
+    printf("  encoder: %.1f bytes/frame, %.1f MB/s, reused %.1f%% of rows "
+           "(%.1f%% from the hash table), %.1f%% stored as deltas\n",
+           double(mEncoder->BytesWritten()) / mEncoder->NumFrames(),
+           double(encode.count * mEncoder->FrameSize()) / (encode.totalNs / 1000.0),
+           dedup.HitRate() * 100, dedup.tableHits * 100.0 / dedup.rows,
+           dedup.deltaRows * 100.0 / dedup.rows);
+    if (dedup.scrolledFrames) {
+      printf("  scrolling: %llu frames scrolled, %.1f%% of rows stored as moved\n",
+             (unsigned long long)dedup.scrolledFrames,
+             dedup.shiftedRows * 100.0 / dedup.rows);
+    }
+    if (dedup.tileFrames) {
+      printf("  tiles: %llu frames stored as tiles, %.1f%% of their tiles changed\n",
+             (unsigned long long)dedup.tileFrames,
+             dedup.dirtyTiles * 100.0 / dedup.tiles);
+    }
+  }
+
+  if (mStreamGaps) {
+    printf("  input skipped %zu frames in %zu gaps\n",
+           size_t(mStreamMissedFrames), size_t(mStreamGaps));
+  }
+  if (mNoVideoFrames || mNoAudioFrames) {
+    printf("  %zu callbacks without video, %zu without audio\n",
+           size_t(mNoVideoFrames), size_t(mNoAudioFrames));
+  }
+  if (mNoReferenceTimeFrames) {
+    printf("  %zu frames without a reference time\n", size_t(mNoReferenceTimeFrames));
+  }
+}
+
+void
+FrameProcessor::WriteStatsJson(FILE* file) const
+{
+  std::vector<std::pair<const char*, StageStats>> stages;
+  GetStages(this, &stages);
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"frames\": {\n");
+  fprintf(file, "    \"recorded\": %zu,\n", NumFrames());
+  fprintf(file, "    \"dropped_at_queue\": %zu,\n", QueueDroppedFrames());
+  fprintf(file, "    \"dropped_at_encoder\": %zu,\n", DroppedFrames());
+  fprintf(file, "    \"stream_gaps\": %zu,\n", StreamGaps());
+  fprintf(file, "    \"stream_missed\": %zu,\n", StreamMissedFrames());
+  fprintf(file, "    \"without_video\": %zu,\n", FramesWithoutVideo());
+  fprintf(file, "    \"without_audio\": %zu,\n", FramesWithoutAudio());
+  fprintf(file, "    \"without_reference_time\": %zu,\n", FramesWithoutReferenceTime());
+  fprintf(file, "    \"onsets\": %zu\n", NumOnsets());
+  fprintf(file, "  },\n");
+  if (mEncoder) {
+    const DedupStats& dedup = mEncoder->GetDedupStats();
+    const StageStats& encode = mEncoder->EncodeStats();
+    fprintf(file, "  \"encoder\": {\n");
+    fprintf(file, "    \"bytes\": %llu,\n",
+            (unsigned long long)mEncoder->BytesWritten());
+    fprintf(file, "    \"segments\": %zu,\n", mEncoder->NumSegments());
+    fprintf(file, "    \"mb_per_s\": %.3f,\n", encode.totalNs ?
+            double(encode.count * mEncoder->FrameSize()) / (encode.totalNs / 1000.0) : 0);
+    fprintf(file, "    \"rows\": %llu,\n", (unsigned long long)dedup.rows);
+    fprintf(file, "    \"previous_row_hits\": %llu,\n",
+            (unsigned long long)dedup.previousRowHits);
+    fprintf(file, "    \"table_hits\": %llu,\n", (unsigned long long)dedup.tableHits);
+    fprintf(file, "    \"delta_rows\": %llu,\n", (unsigned long long)dedup.deltaRows);
+    fprintf(file, "    \"copied_frames\": %llu,\n",
+            (unsigned long long)dedup.copiedFrames);
+    fprintf(file, "    \"scrolled_frames\": %llu,\n",
+            (unsigned long long)dedup.scrolledFrames);
+    fprintf(file, "    \"shifted_rows\": %llu,\n", (unsigned long long)dedup.shiftedRows);
+    fprintf(file, "    \"tile_frames\": %llu,\n", (unsigned long long)dedup.tileFrames);
+    fprintf(file, "    \"tiles\": %llu,\n", (unsigned long long)dedup.tiles);
+    fprintf(file, "    \"dirty_tiles\": %llu,\n", (unsigned long long)dedup.dirtyTiles);
+    fprintf(file, "    \"hit_rate\": %.6f\n", dedup.HitRate());
+    fprintf(file, "  },\n");
+  }
+  fprintf(file, "  \"stages\": {\n");
+  for (size_t i = 0; i < stages.size(); i++) {
+    const StageStats& stats = stages[i].second;
+    fprintf(file, "    \"%s\": { \"count\": %llu, \"mean_us\": %.3f, "
+            "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+            "\"p999_us\": %.3f, \"max_us\": %.3f }%s\n",
+            stages[i].first, (unsigned long long)stats.count, stats.MeanUs(),
+            stats.PercentileUs(50), stats.PercentileUs(90),
+            stats.PercentileUs(99), stats.PercentileUs(99.9), stats.MaxUs(),
+            i + 1 < stages.size() ? "," : "");
+  }
+  fprintf(file, "  }\n");
+  fprintf(file, "}\n");
+}
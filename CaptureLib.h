@@ -0,0 +1,397 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef CaptureLib_h
+#define CaptureLib_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EncodeLib.h"
+#include "FrameSource.h"
+#include "Latency.h"
+#include "Onset.h"
+#include "SPSCQueue.h"
+#include "Stats.h"
+
+void
+Fail(const char* err);
+
+double
+Now();
+
+// Two seconds of 60 fps frames waiting for the encoder.
+const size_t kDefaultPoolSize = 120;
+
+// Frames delivered before this many have arrived are dropped while the input
+// settles.
+const size_t kWarmupFrames = 60;
+
+// Each of these writes a luma plane to |result| and returns its size. A
+// non-zero |decoration| inverts it. Input rows start |rowBytes| apart, which
+// may include padding after the pixels.
+
+// ARGB input.
+size_t
+ProcessFrame(size_t width, size_t height, size_t rowBytes, const char* frameBytes,
+             char* result, int decoration);
+
+// UYVY input at full resolution.
+size_t
+ProcessFrameUYVY(size_t width, size_t height, size_t rowBytes, const char* frameBytes,
+                 char* result, int decoration);
+
+// UYVY input decimated 2x2, so the plane is (width / 2) x (height / 2).
+size_t
+ReduceFrameBy8(size_t width, size_t height, size_t rowBytes, const char* frameBytes,
+               char* result, int decoration);
+
+// Writes only |regions| of the frame to |result|, each region's rows in turn,
+// and returns the size. Regions are in output coordinates, so with |decimate|
+// each one covers twice its size of UYVY input in both directions.
+size_t
+ProcessRegions(size_t rowBytes, PixelFormat format, bool decimate,
+               const std::vector<Region>& regions, const char* frameBytes,
+               char* result, int decoration);
+
+// Onsets beyond this many in one packet are ignored.
+const size_t kMaxOnsetsPerPacket = 4;
+
+// One record of a .times file for every recorded frame, in .pop order. The
+// file starts with the magic "PTIM" and a uint32 version.
+struct FrameTimes
+{
+  // The input's own stream time.
+  int64_t streamTimeNs;
+
+  // VideoFrame::referenceTimeNs, shared by every input on a card, or 0 if
+  // the card didn't give one.
+  int64_t referenceTimeNs;
+
+  // CLOCK_MONOTONIC when the frame reached the capture callback, shared by
+  // every input in the process.
+  int64_t arrivalNs;
+};
+
+const uint32_t kTimesVersion = 1;
+
+// Two workers by default; luma extraction for one 1080p frame takes well
+// under a frame time, so this leaves room for hiccups.
+const size_t kDefaultWorkers = 2;
+
+// Frames each worker can have queued before the callback starts dropping.
+const size_t kWorkerQueueSize = 16;
+
+// Turns captured frames into luma frames and streams them to the encoder.
+// Recording starts with the first frame carrying an audio marker, after the
+// warm-up frames. Until then the most recent frames are held back as
+// pre-roll and written out ahead of the marker frame. Once a recording has
+// its frames the processor can re-arm and wait for the next marker, so one
+// session can hold several triggered clips.
+//
+// The capture callback only takes references to the frame and its audio,
+// stamps them and pushes them onto a lock-free queue. Worker threads do the
+// marker detection and luma extraction, and their results are committed to
+// the encoder in frame order.
+class FrameProcessor : public FrameSink
+{
+public:
+  FrameProcessor(const std::string& popName, size_t poolSize);
+  ~FrameProcessor();
+
+  virtual void FormatChanged(size_t width, size_t height,
+                             PixelFormat format, double fps);
+  virtual void FrameArrived(const VideoFrame* video, const AudioPacket* audio);
+
+  // Processes the queued frames, waits for them to be written out and
+  // releases every frame reference. Call after stopping the source.
+  void Finish();
+
+  void SetVerbose(bool verbose) { mVerbose = verbose; }
+
+  // Stop recording after this many frames following each marker; 0 records
+  // until Finish().
+  void SetMaxFrames(size_t maxFrames) { mMaxFrames = maxFrames; }
+
+  // The same in seconds, turned into frames at the rate the format brings.
+  // Must be called before the format is known.
+  void SetMaxSeconds(double seconds) { mMaxSeconds = seconds; }
+
+  // Keep this much video from before each marker. Must be called before the
+  // format is known.
+  void SetPreroll(double seconds) { mPrerollSeconds = seconds; }
+
+  // Record a clip for this many markers, then stop; 0 re-arms forever.
+  void SetMaxTriggers(size_t triggers) { mMaxTriggers = triggers; }
+
+  // Split the recording into segments of at most this many frames or
+  // bytes; see Encoder::SetSegments(). Must be called before the format is
+  // known.
+  void SetSegments(size_t maxFrames, uint64_t maxBytes) {
+    mSegmentFrames = maxFrames;
+    mSegmentBytes = maxBytes;
+  }
+
+  // Start a sync point every this many frames; see
+  // Encoder::SetSyncInterval(). Must be called before the format is known.
+  void SetSyncInterval(size_t frames) { mSyncInterval = frames; }
+
+  // Rows the encoder remembers for reuse; see Encoder::SetDedupEntries().
+  // Must be called before the format is known.
+  void SetDedupEntries(size_t entries) { mDedupEntries = entries; }
+
+  // Store changed tiles instead of rows; see Encoder::SetTileSize(). Must be
+  // called before the format is known.
+  void SetTileSize(size_t size) { mTileSize = size; }
+
+  // Start recording with the first frame instead of waiting for a marker;
+  // the recording is one clip. Must be called before the format is known.
+  void SetWaitForMarker(bool wait) { mWaitForMarker = wait; }
+
+  // Frames to drop at the start while the input settles.
+  void SetWarmupFrames(size_t frames) { mWarmupFrames = frames; }
+
+  // Write a byte to |fd| when Done() becomes true, so a caller can sleep in
+  // poll() instead of checking.
+  void SetDoneFd(int fd) { mDoneFd = fd; }
+
+  // Keep every other pixel of every other row of UYVY input.
+  void SetDecimate(bool decimate) { mDecimate = decimate; }
+
+  // Must be called before the format is known.
+  void SetWorkers(size_t workers) { mNumWorkers = workers; }
+
+  // Only extract and record these rectangles of the output frame. Must be
+  // called before the format is known.
+  void SetRegions(const std::vector<Region>& regions) { mRegions = regions; }
+
+  // The marker click detector's level and debounce, in sample frames.
+  void SetOnsetThreshold(int16_t threshold) { mOnsetThreshold = threshold; }
+  void SetOnsetDebounce(size_t frames) { mOnsetDebounce = frames; }
+
+  // Log every marker onset to this file. Must be called before the format
+  // is known.
+  void SetEventsName(const std::string& name) { mEventsName = name; }
+
+  // Log the FrameTimes of every recorded frame to this file. Must be called
+  // before the format is known.
+  void SetTimesName(const std::string& name) { mTimesName = name; }
+
+  // Log how far every recorded frame scrolled to this .motion file. Must be
+  // called before the format is known.
+  void SetMotionName(const std::string& name) { mMotionName = name; }
+
+  // Pin the workers and then the encoder thread to consecutive cores from
+  // |cpu|; -1 leaves them unpinned. Must be called before the format is
+  // known.
+  void SetFirstCpu(int cpu) { mFirstCpu = cpu; }
+
+  // Measures the time from each marker to the screen changing. Configure it
+  // before the format is known.
+  LatencyMeter* GetLatencyMeter() { return &mLatency; }
+
+  // The size of the luma frames, of which only the regions are recorded if
+  // there are any.
+  void GetSize(size_t* width, size_t* height) {
+    *width = mOutputWidth;
+    *height = mOutputHeight;
+  }
+
+  size_t NumFrames() const { return mFrameCounter; }
+  size_t NumTriggers() const { return mTriggers; }
+
+  // True once the last clip has all its frames.
+  bool Done() const { return mDone; }
+  size_t DroppedFrames() const { return mDroppedFrames; }
+  size_t QueueDroppedFrames() const { return mQueueDroppedFrames; }
+  size_t NumOnsets() const { return mNumOnsets; }
+  const EncoderThread* GetEncoder() const { return mEncoder.get(); }
+
+  // Frames waiting for a worker across all queues, and the deepest any one
+  // worker's queue has been.
+  size_t QueueDepth() const;
+  size_t QueueHighWater() const;
+
+  // Frames the input skipped, going by gaps in their stream times, and how
+  // many gaps there were.
+  size_t StreamMissedFrames() const { return mStreamMissedFrames; }
+  size_t StreamGaps() const { return mStreamGaps; }
+
+  // Callbacks that came without video or without audio.
+  size_t FramesWithoutVideo() const { return mNoVideoFrames; }
+  size_t FramesWithoutAudio() const { return mNoAudioFrames; }
+
+  // Frames that came without a reference time.
+  size_t FramesWithoutReferenceTime() const { return mNoReferenceTimeFrames; }
+
+  const StageStats& CallbackStats() const { return mCallbackStats; }
+  StageStats QueueWaitStats() const;
+  StageStats MarkerStats() const;
+  StageStats ProcessStats() const;
+  const StageStats& LatencyStats() const { return mLatencyStats; }
+
+  // How far each frame's arrival strayed from its stream time's distance to
+  // the previous frame.
+  const StageStats& JitterStats() const { return mJitterStats; }
+
+  // Prints a table of every stage's timings, or writes them as JSON. Only
+  // valid after Finish().
+  void PrintStats() const;
+  void WriteStatsJson(FILE* file) const;
+
+private:
+  struct QueuedFrame
+  {
+    uint64_t sequence;
+    uint64_t arrivalNs;
+    VideoFrame video;
+    AudioPacket audio;
+  };
+
+  struct Worker
+  {
+    explicit Worker(size_t queueSize)
+     : queue(queueSize)
+     , sleeping(false)
+    {}
+
+    SPSCQueue<QueuedFrame> queue;
+    std::thread thread;
+
+    // Lets an idle worker sleep without the callback taking a lock unless
+    // the worker is actually asleep.
+    std::mutex mutex;
+    std::condition_variable condVar;
+    std::atomic<bool> sleeping;
+
+    StageStats queueWaitStats;
+    StageStats markerStats;
+    StageStats processStats;
+  };
+
+  // A processed frame waiting for its turn to be committed.
+  struct Result
+  {
+    Result() : ready(false), buffer(nullptr), type(0), numOnsets(0) {}
+
+    bool ready;
+    char* buffer;
+    int type;
+    int64_t frameNumber;
+    int64_t audioNumber;
+    int64_t packetTime;
+    FrameTimes times;
+    size_t numOnsets;
+    uint32_t onsets[kMaxOnsetsPerPacket];
+  };
+
+  void WorkerThread(Worker* worker);
+  void ProcessQueuedFrame(Worker* worker, const QueuedFrame& frame);
+  void CommitResults();
+  void Commit(const Result& result);
+  void HoldPreroll(char* buffer, const FrameTimes& times);
+  void FlushPreroll();
+  void Record(char* buffer, const FrameTimes& times);
+  void SetDone();
+  bool LogOnsets(const Result& result, int64_t recordedFrame, int64_t* onsetNs);
+
+  std::string mPopName;
+  size_t mPoolSize;
+  std::unique_ptr<EncoderThread> mEncoder;
+
+  size_t mMaxFrames;
+  double mMaxSeconds;
+  PixelFormat mFormat;
+  bool mDecimate;
+  size_t mWidth, mHeight;
+  size_t mOutputWidth, mOutputHeight;
+  double mFps;
+  std::vector<Region> mRegions;
+  bool mVerbose;
+
+  int16_t mOnsetThreshold;
+  size_t mOnsetDebounce;
+  std::string mEventsName;
+  std::string mTimesName;
+  std::string mMotionName;
+  FILE* mTimesFile;
+  int mFirstCpu;
+
+  size_t mNumWorkers;
+  std::vector<std::unique_ptr<Worker>> mWorkers;
+  std::atomic<bool> mStopping;
+
+  // Owned by the callback thread.
+  uint64_t mNextSequence;
+  size_t mWarmupFrames;
+  size_t mSkipFrameCounter;
+
+  // Results indexed by sequence number modulo their count, committed in
+  // order under mCommitMutex.
+  std::mutex mCommitMutex;
+  std::vector<Result> mResults;
+  uint64_t mNextCommit;
+
+  // Waiting for a marker, with up to mPrerollFrames of the latest frames
+  // held in mPreroll, oldest first. The held buffers come from the encoder's
+  // pool, which is enlarged to make room for them.
+  struct HeldFrame
+  {
+    char* buffer;
+    FrameTimes times;
+  };
+
+  bool mArmed;
+  double mPrerollSeconds;
+  size_t mPrerollFrames;
+  std::deque<HeldFrame> mPreroll;
+
+  bool mWaitForMarker;
+  size_t mSegmentFrames;
+  uint64_t mSegmentBytes;
+  size_t mSyncInterval;
+  size_t mDedupEntries;
+  size_t mTileSize;
+  size_t mMaxTriggers;
+  size_t mClipFrames;
+  std::atomic<size_t> mTriggers;
+  std::atomic<bool> mDone;
+  int mDoneFd;
+
+  // Packets are searched for onsets independently, so debouncing across
+  // packet boundaries happens here, in order.
+  EventLog mEventLog;
+  bool mHasLastOnset;
+  int64_t mLastOnsetSample;
+  std::atomic<size_t> mNumOnsets;
+
+  LatencyMeter mLatency;
+  StageStats mLatencyStats;
+
+  std::atomic<size_t> mFrameCounter;
+  std::atomic<size_t> mDroppedFrames;
+  std::atomic<size_t> mQueueDroppedFrames;
+
+  // Owned by the callback thread.
+  StageStats mCallbackStats;
+  StageStats mJitterStats;
+  bool mHasPrevFrame;
+  int64_t mPrevStreamTime;
+  uint64_t mPrevArrivalNs;
+  std::atomic<size_t> mStreamGaps;
+  std::atomic<size_t> mStreamMissedFrames;
+  std::atomic<size_t> mNoVideoFrames;
+  std::atomic<size_t> mNoAudioFrames;
+  std::atomic<size_t> mNoReferenceTimeFrames;
+};
+
+#endif // CaptureLib_h
@@ -0,0 +1,668 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+// Encodes and decodes synthetic clips of typical screen content, and any
+// captured video.raw files, with each encoder setting, and reports how fast
+// both run, how big the output is, how much memory they take and how often
+// rows were reused. Every decoded frame is checked against its input.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DecodeLib.h"
+#include "EncodeLib.h"
+#include "Stats.h"
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+// A clip to encode. Frames are made, or read, one at a time, so a clip costs
+// no memory of its own and the same frame can be made again to check the
+// decoder.
+class Corpus
+{
+public:
+  Corpus(const std::string& name, size_t width, size_t height, size_t numFrames)
+   : mName(name), mWidth(width), mHeight(height), mNumFrames(numFrames)
+  {}
+  virtual ~Corpus() {}
+
+  virtual void GetFrame(size_t index, char* frame) = 0;
+
+  const std::string& Name() const { return mName; }
+  size_t Width() const { return mWidth; }
+  size_t Height() const { return mHeight; }
+  size_t NumFrames() const { return mNumFrames; }
+  size_t FrameSize() const { return mWidth * mHeight; }
+
+protected:
+  std::string mName;
+  size_t mWidth, mHeight;
+  size_t mNumFrames;
+};
+
+static uint32_t
+Hash(uint32_t x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+// Light text on 8 x 16 cells: whether cell |column| of text line |line|
+// holds a glyph, and whether pixel |x|, |y| of it is inked.
+static bool
+GlyphPixel(uint32_t line, uint32_t column, size_t x, size_t y)
+{
+  uint32_t lineLength = 20 + Hash(line * 2 + 1) % 70;
+  if (column >= lineLength || Hash(line) % 5 == 0) {
+    return false;
+  }
+  uint32_t glyph = Hash(line * 131 + column);
+  if (glyph % 6 == 0 || x < 1 || x > 6 || y < 3 || y > 13) {
+    return false;
+  }
+  return (Hash(glyph + uint32_t(y) * 8 + uint32_t(x)) & 3) != 0;
+}
+
+// A desktop: a wallpaper gradient with a text window over most of it, and
+// the clips below that change it the way people use one. The window is
+// maximized in the scroll clip, like a browser usually is.
+class DesktopCorpus : public Corpus
+{
+public:
+  enum Kind { kStatic, kCaret, kTyping, kScroll };
+
+  DesktopCorpus(const char* name, Kind kind, size_t width, size_t height,
+                size_t numFrames)
+   : Corpus(name, width, height, numFrames)
+   , mKind(kind)
+   , mLeft(kind == kScroll ? 0 : width / 10)
+   , mTop(kind == kScroll ? 0 : height / 10)
+   , mRight(kind == kScroll ? width : width - width / 10)
+   , mBottom(height - height / 10)
+   , mTextTop(mTop + 24)
+  {
+    mDesktop.resize(FrameSize());
+    for (size_t y = 0; y < height; y++) {
+      char* row = &mDesktop[y * width];
+      for (size_t x = 0; x < width; x++) {
+        row[x] = char(60 + (x + y) * 100 / (width + height));
+      }
+      if (y >= mTop && y < mBottom) {
+        memset(row + mLeft, y < mTextTop ? 110 : 235, mRight - mLeft);
+      }
+    }
+
+    // The text the window shows, as far down as the scroll clip goes.
+    size_t textWidth = mRight - mLeft;
+    size_t pageHeight = mBottom - mTextTop + (mKind == kScroll ? numFrames * kScrollRows : 0);
+    mPage.assign(textWidth * pageHeight, char(235));
+    for (size_t y = 0; y < pageHeight; y++) {
+      for (size_t x = 0; x < textWidth; x++) {
+        if (GlyphPixel(uint32_t(y / 16), uint32_t(x / 8), x % 8, y % 16)) {
+          mPage[y * textWidth + x] = 40;
+        }
+      }
+    }
+    if (mKind != kTyping) {
+      DrawText(mDesktop.data(), 0);
+    }
+  }
+
+  void GetFrame(size_t index, char* frame) override {
+    memcpy(frame, mDesktop.data(), FrameSize());
+    switch (mKind) {
+      case kStatic:
+        break;
+      case kCaret:
+        // Blinks every half second at 60 fps.
+        if ((index / 30) % 2 == 0) {
+          DrawCaret(frame, mLeft + 8 * 12, mTextTop + 16 * 3);
+        }
+        break;
+      case kTyping: {
+        // A key every third frame, wrapping at 80 columns.
+        size_t typed = index / 3;
+        size_t columns = std::min<size_t>(80, (mRight - mLeft) / 8 - 1);
+        for (size_t i = 0; i < typed; i++) {
+          DrawGlyph(frame, i / columns, i % columns, uint32_t(i));
+        }
+        DrawCaret(frame, mLeft + 8 * (typed % columns), mTextTop + 16 * (typed / columns));
+        break;
+      }
+      case kScroll:
+        DrawText(frame, index * kScrollRows);
+        break;
+    }
+  }
+
+private:
+  // Like a trackpad scroll.
+  static const size_t kScrollRows = 3;
+
+  // Draws the window's text scrolled down by |scroll| rows.
+  void DrawText(char* frame, size_t scroll) {
+    size_t textWidth = mRight - mLeft;
+    for (size_t y = mTextTop; y < mBottom; y++) {
+      memcpy(frame + y * mWidth + mLeft, &mPage[(y - mTextTop + scroll) * textWidth],
+             textWidth);
+    }
+  }
+
+  void DrawGlyph(char* frame, size_t line, size_t column, uint32_t glyph) {
+    size_t top = mTextTop + line * 16;
+    size_t left = mLeft + column * 8;
+    if (top + 16 > mBottom) {
+      return;
+    }
+    for (size_t y = 0; y < 16; y++) {
+      for (size_t x = 0; x < 8; x++) {
+        if (GlyphPixel(glyph, 0, x, y)) {
+          frame[(top + y) * mWidth + left + x] = 40;
+        }
+      }
+    }
+  }
+
+  void DrawCaret(char* frame, size_t x, size_t y) {
+    for (size_t i = 0; i < 16 && y + i < mBottom; i++) {
+      frame[(y + i) * mWidth + x] = 0;
+    }
+  }
+
+  Kind mKind;
+  size_t mLeft, mTop, mRight, mBottom, mTextTop;
+  std::vector<char> mDesktop;
+  std::vector<char> mPage;
+};
+
+// Full-motion video: moving rings with a little sensor noise, so every
+// pixel changes every frame.
+class VideoCorpus : public Corpus
+{
+public:
+  using Corpus::Corpus;
+
+  void GetFrame(size_t index, char* frame) override {
+    double t = double(index) / 60.0;
+    long cx = long(mWidth / 2 + mWidth / 4 * cos(t * 1.3));
+    long cy = long(mHeight / 2 + mHeight / 4 * sin(t * 0.9));
+    for (size_t y = 0; y < mHeight; y++) {
+      uint32_t noise = Hash(uint32_t(index * mHeight + y));
+      long dy = long(y) - cy;
+      for (size_t x = 0; x < mWidth; x++) {
+        long dx = long(x) - cx;
+        noise = noise * 1664525 + 1013904223;
+        frame[y * mWidth + x] = char(((dx * dx + dy * dy) >> 7) + index * 3 + (noise >> 29));
+      }
+    }
+  }
+};
+
+class NoiseCorpus : public Corpus
+{
+public:
+  using Corpus::Corpus;
+
+  void GetFrame(size_t index, char* frame) override {
+    uint32_t state = Hash(uint32_t(index) + 1);
+    for (size_t i = 0; i < FrameSize(); i++) {
+      state = state * 1664525 + 1013904223;
+      frame[i] = char(state >> 24);
+    }
+  }
+};
+
+// A video.raw file, as written by capture: a 16-bit width and height, then
+// the frames.
+class FileCorpus : public Corpus
+{
+public:
+  FileCorpus(const std::string& name, int fd, size_t width, size_t height,
+             size_t numFrames)
+   : Corpus(name, width, height, numFrames), mFd(fd)
+  {}
+  ~FileCorpus() { close(mFd); }
+
+  static Corpus* Open(const char* fileName, size_t maxFrames) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+      Fail("unable to open input file");
+    }
+    uint16_t size[2];
+    struct stat stbuf;
+    if (read(fd, size, sizeof(size)) != sizeof(size) || !size[0] || !size[1] ||
+        fstat(fd, &stbuf)) {
+      Fail("bad input file");
+    }
+    size_t frames = (stbuf.st_size - sizeof(size)) / (size_t(size[0]) * size[1]);
+    return new FileCorpus(fileName, fd, size[0], size[1], std::min(frames, maxFrames));
+  }
+
+  void GetFrame(size_t index, char* frame) override {
+    off_t offset = 2 * sizeof(uint16_t) + off_t(index) * FrameSize();
+    if (pread(mFd, frame, FrameSize(), offset) != ssize_t(FrameSize())) {
+      Fail("read failed");
+    }
+  }
+
+private:
+  int mFd;
+};
+
+// The encoder settings that are compared.
+struct Config
+{
+  const char* name;
+  size_t dedupEntries;
+  size_t tileSize;
+  size_t syncInterval;
+};
+
+static const Config kConfigs[] = {
+  { "rows", kDefaultDedupEntries, 0, 0 },
+  { "rows-nodedup", 0, 0, 0 },
+  { "rows-sync60", kDefaultDedupEntries, 0, 60 },
+  { "tiles16", kDefaultDedupEntries, 16, 0 },
+  { "tiles64", kDefaultDedupEntries, 64, 0 },
+};
+
+struct EncodeResult
+{
+  uint64_t ns;
+  uint64_t bytes;
+  DedupStats dedup;
+};
+
+struct DecodeResult
+{
+  uint64_t ns;
+  uint64_t mismatchedFrames;
+};
+
+// Runs |fn| in a child process, so the peak RSS of each run is its own, and
+// returns that in kilobytes. The child sends back what |fn| returns.
+template <typename Result, typename Fn>
+static long
+RunInChild(Fn fn, Result* result)
+{
+  int fds[2];
+  if (pipe(fds)) {
+    Fail("pipe failed");
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    Fail("fork failed");
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    Result childResult = fn();
+    ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+    _exit(written == ssize_t(sizeof(childResult)) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  size_t received = 0;
+  while (received < sizeof(Result)) {
+    ssize_t n = read(fds[0], reinterpret_cast<char*>(result) + received,
+                     sizeof(Result) - received);
+    if (n <= 0) {
+      break;
+    }
+    received += n;
+  }
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) || received != sizeof(Result)) {
+    Fail("benchmark run failed");
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Encodes the clip |repeat| times, the way capture does, and keeps the
+// fastest. Only the encoder's own time is counted.
+static EncodeResult
+Encode(Corpus* corpus, const Config& config, const std::string& popName, size_t repeat)
+{
+  std::vector<char> frame(corpus->FrameSize());
+  EncodeResult result;
+  result.ns = UINT64_MAX;
+  for (size_t n = 0; n < repeat; n++) {
+    Encoder encoder(corpus->Width(), corpus->Height());
+    encoder.SetDedupEntries(config.dedupEntries);
+    encoder.SetTileSize(config.tileSize);
+    encoder.SetSyncInterval(config.syncInterval);
+    encoder.Open(popName.c_str());
+
+    uint64_t ns = 0;
+    for (size_t i = 0; i < corpus->NumFrames(); i++) {
+      corpus->GetFrame(i, frame.data());
+      uint64_t start = NowNs();
+      encoder.AddFrame(frame.data(), int64_t(i) * 1000000000 / 60);
+      ns += NowNs() - start;
+    }
+    uint64_t start = NowNs();
+    encoder.Close();
+    ns += NowNs() - start;
+
+    if (ns < result.ns) {
+      result.ns = ns;
+      result.bytes = encoder.BytesWritten();
+      result.dedup = encoder.GetDedupStats();
+    }
+  }
+  return result;
+}
+
+// Decodes the file |repeat| times through its index and keeps the fastest,
+// checking each frame against the clip the first time.
+static DecodeResult
+Decode(Corpus* corpus, const std::string& popName, size_t repeat)
+{
+  int fd = open(popName.c_str(), O_RDONLY);
+  struct stat stbuf;
+  if (fd == -1 || fstat(fd, &stbuf)) {
+    Fail("unable to open encoded file");
+  }
+  size_t length = stbuf.st_size;
+  const char* input = (const char*)mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (input == MAP_FAILED) {
+    Fail("mmap failed");
+  }
+
+  PopTrailer trailer;
+  if (length < sizeof(PopHeader) + sizeof(trailer)) {
+    Fail("encoded file too short");
+  }
+  memcpy(&trailer, input + length - sizeof(trailer), sizeof(trailer));
+  if (memcmp(trailer.magic, "PIDX", 4) || trailer.numFrames != corpus->NumFrames()) {
+    Fail("encoded file has no index");
+  }
+  const char* frames = input + trailer.framesOffset;
+
+  std::vector<char> frame(corpus->FrameSize());
+  std::vector<char> expected(corpus->FrameSize());
+  DecodeResult result;
+  result.ns = UINT64_MAX;
+  result.mismatchedFrames = 0;
+  for (size_t n = 0; n < repeat; n++) {
+    FrameDecoder decoder(corpus->Width(), corpus->Height());
+    uint64_t ns = 0;
+    for (size_t i = 0; i < trailer.numFrames; i++) {
+      PopFrameEntry entry;
+      memcpy(&entry, frames + i * sizeof(entry), sizeof(entry));
+      uint64_t start = NowNs();
+      decoder.ReadFrame(input, entry.offset, frame.data());
+      ns += NowNs() - start;
+
+      if (n == 0) {
+        corpus->GetFrame(i, expected.data());
+        if (memcmp(frame.data(), expected.data(), frame.size())) {
+          result.mismatchedFrames++;
+        }
+      }
+    }
+    result.ns = std::min(result.ns, ns);
+  }
+
+  munmap((void*)input, length);
+  close(fd);
+  return result;
+}
+
+struct Run
+{
+  std::string corpus;
+  const Config* config;
+  size_t width, height, numFrames;
+  EncodeResult encode;
+  DecodeResult decode;
+  long encodeRssKb, decodeRssKb;
+
+  double RawBytes() const { return double(width) * height * numFrames; }
+  double EncodeMBps() const { return RawBytes() / (encode.ns / 1000.0); }
+  double DecodeMBps() const { return RawBytes() / (decode.ns / 1000.0); }
+  double BytesPerFrame() const { return double(encode.bytes) / numFrames; }
+
+  // Rows stored as references, or in tile mode tiles left as they were.
+  double ReuseRate() const {
+    const DedupStats& dedup = encode.dedup;
+    return dedup.tiles ? 1.0 - double(dedup.dirtyTiles) / dedup.tiles : dedup.HitRate();
+  }
+};
+
+static void
+WriteJson(FILE* file, const std::vector<Run>& runs)
+{
+  fprintf(file, "{\n");
+  fprintf(file, "  \"scanline_kernel\": \"%s\",\n", ScanlineKernelName());
+  fprintf(file, "  \"runs\": [\n");
+  for (size_t i = 0; i < runs.size(); i++) {
+    const Run& run = runs[i];
+    const DedupStats& dedup = run.encode.dedup;
+    fprintf(file, "    {\n");
+    fprintf(file, "      \"corpus\": \"%s\",\n", run.corpus.c_str());
+    fprintf(file, "      \"config\": \"%s\",\n", run.config->name);
+    fprintf(file, "      \"width\": %zu,\n", run.width);
+    fprintf(file, "      \"height\": %zu,\n", run.height);
+    fprintf(file, "      \"frames\": %zu,\n", run.numFrames);
+    fprintf(file, "      \"bytes\": %llu,\n", (unsigned long long)run.encode.bytes);
+    fprintf(file, "      \"bytes_per_frame\": %.1f,\n", run.BytesPerFrame());
+    fprintf(file, "      \"ratio\": %.3f,\n", run.RawBytes() / run.encode.bytes);
+    fprintf(file, "      \"encode_mb_per_s\": %.3f,\n", run.EncodeMBps());
+    fprintf(file, "      \"decode_mb_per_s\": %.3f,\n", run.DecodeMBps());
+    fprintf(file, "      \"encode_peak_rss_kb\": %ld,\n", run.encodeRssKb);
+    fprintf(file, "      \"decode_peak_rss_kb\": %ld,\n", run.decodeRssKb);
+    fprintf(file, "      \"rows\": %llu,\n", (unsigned long long)dedup.rows);
+    fprintf(file, "      \"previous_row_hits\": %llu,\n",
+            (unsigned long long)dedup.previousRowHits);
+    fprintf(file, "      \"table_hits\": %llu,\n", (unsigned long long)dedup.tableHits);
+    fprintf(file, "      \"delta_rows\": %llu,\n", (unsigned long long)dedup.deltaRows);
+    fprintf(file, "      \"copied_frames\": %llu,\n", (unsigned long long)dedup.copiedFrames);
+    fprintf(file, "      \"scrolled_frames\": %llu,\n",
+            (unsigned long long)dedup.scrolledFrames);
+    fprintf(file, "      \"tile_frames\": %llu,\n", (unsigned long long)dedup.tileFrames);
+    fprintf(file, "      \"tiles\": %llu,\n", (unsigned long long)dedup.tiles);
+    fprintf(file, "      \"dirty_tiles\": %llu,\n", (unsigned long long)dedup.dirtyTiles);
+    fprintf(file, "      \"hit_rate\": %.6f,\n", dedup.HitRate());
+    fprintf(file, "      \"reuse_rate\": %.6f,\n", run.ReuseRate());
+    fprintf(file, "      \"mismatched_frames\": %llu\n",
+            (unsigned long long)run.decode.mismatchedFrames);
+    fprintf(file, "    }%s\n", i + 1 < runs.size() ? "," : "");
+  }
+  fprintf(file, "  ]\n");
+  fprintf(file, "}\n");
+}
+
+static void
+Usage()
+{
+  fprintf(stderr,
+          "usage: codecbench [options] [video.raw...]\n"
+          "Encodes and decodes synthetic clips, and any raw video files given, with\n"
+          "each encoder setting. Clips: static, caret, typing, scroll, video, noise.\n"
+          "Settings: rows, rows-nodedup, rows-sync60, tiles16, tiles64.\n"
+          "  -W, --width=PIXELS    clip width (default 1920)\n"
+          "  -H, --height=PIXELS   clip height (default 1080)\n"
+          "  -n, --frames=N        frames in each clip, and most read from a file\n"
+          "                        (default 300)\n"
+          "  -c, --corpus=NAME     only run this clip; may be repeated, and \"none\"\n"
+          "                        only runs the files\n"
+          "  -s, --config=NAME     only run this setting; may be repeated\n"
+          "  -r, --repeat=N        time N runs of each and keep the fastest (default 1)\n"
+          "  -o, --output=FILE     where to write the encoded file (default\n"
+          "                        codecbench.pop); removed afterwards\n"
+          "  -j, --json=FILE       also write the results to FILE as JSON\n");
+  exit(1);
+}
+
+int
+main(int argc, char** argv)
+{
+  static const struct option longOptions[] = {
+    { "width", required_argument, nullptr, 'W' },
+    { "height", required_argument, nullptr, 'H' },
+    { "frames", required_argument, nullptr, 'n' },
+    { "corpus", required_argument, nullptr, 'c' },
+    { "config", required_argument, nullptr, 's' },
+    { "repeat", required_argument, nullptr, 'r' },
+    { "output", required_argument, nullptr, 'o' },
+    { "json", required_argument, nullptr, 'j' },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  size_t width = 1920;
+  size_t height = 1080;
+  size_t numFrames = 300;
+  size_t repeat = 1;
+  std::vector<std::string> corpusNames;
+  std::vector<std::string> configNames;
+  std::string popName = "codecbench.pop";
+  std::string jsonName;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "W:H:n:c:s:r:o:j:", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'W': width = atoi(optarg); break;
+      case 'H': height = atoi(optarg); break;
+      case 'n': numFrames = atoi(optarg); break;
+      case 'c': corpusNames.push_back(optarg); break;
+      case 's': configNames.push_back(optarg); break;
+      case 'r': repeat = atoi(optarg); break;
+      case 'o': popName = optarg; break;
+      case 'j': jsonName = optarg; break;
+      default: Usage();
+    }
+  }
+  if (width < 64 || height < 64 || width > UINT16_MAX || height > UINT16_MAX ||
+      !numFrames || !repeat) {
+    Usage();
+  }
+
+  std::vector<std::unique_ptr<Corpus>> corpora;
+  corpora.emplace_back(new DesktopCorpus("static", DesktopCorpus::kStatic,
+                                         width, height, numFrames));
+  corpora.emplace_back(new DesktopCorpus("caret", DesktopCorpus::kCaret,
+                                         width, height, numFrames));
+  corpora.emplace_back(new DesktopCorpus("typing", DesktopCorpus::kTyping,
+                                         width, height, numFrames));
+  corpora.emplace_back(new DesktopCorpus("scroll", DesktopCorpus::kScroll,
+                                         width, height, numFrames));
+  corpora.emplace_back(new VideoCorpus("video", width, height, numFrames));
+  corpora.emplace_back(new NoiseCorpus("noise", width, height, numFrames));
+  if (!corpusNames.empty()) {
+    std::vector<std::unique_ptr<Corpus>> chosen;
+    for (const std::string& name : corpusNames) {
+      bool found = name == "none";
+      for (std::unique_ptr<Corpus>& corpus : corpora) {
+        if (corpus && corpus->Name() == name) {
+          chosen.push_back(std::move(corpus));
+          found = true;
+        }
+      }
+      if (!found) {
+        Usage();
+      }
+    }
+    corpora = std::move(chosen);
+  }
+  for (int i = optind; i < argc; i++) {
+    corpora.emplace_back(FileCorpus::Open(argv[i], numFrames));
+  }
+
+  std::vector<const Config*> configs;
+  for (const Config& config : kConfigs) {
+    bool chosen = configNames.empty();
+    for (const std::string& name : configNames) {
+      chosen = chosen || name == config.name;
+    }
+    if (chosen) {
+      configs.push_back(&config);
+    }
+  }
+  if (configs.size() < (configNames.empty() ? 1 : configNames.size())) {
+    Usage();
+  }
+
+  printf("scanline kernel: %s\n", ScanlineKernelName());
+  printf("%-14s %-13s %9s %12s %10s %10s %9s %9s %7s\n", "corpus", "config",
+         "ratio", "bytes/frame", "enc MB/s", "dec MB/s", "enc RSS", "dec RSS", "reused");
+
+  std::vector<Run> runs;
+  bool ok = true;
+  for (std::unique_ptr<Corpus>& corpus : corpora) {
+    for (const Config* config : configs) {
+      Run run;
+      run.corpus = corpus->Name();
+      run.config = config;
+      run.width = corpus->Width();
+      run.height = corpus->Height();
+      run.numFrames = corpus->NumFrames();
+      if (!run.numFrames) {
+        Fail("empty input file");
+      }
+
+      Corpus* clip = corpus.get();
+      run.encodeRssKb = RunInChild([&]() {
+        return Encode(clip, *config, popName, repeat);
+      }, &run.encode);
+      run.decodeRssKb = RunInChild([&]() {
+        return Decode(clip, popName, repeat);
+      }, &run.decode);
+      unlink(popName.c_str());
+
+      printf("%-14s %-13s %8.1fx %12.0f %10.1f %10.1f %7ldMB %7ldMB %6.1f%%\n",
+             run.corpus.c_str(), config->name, run.RawBytes() / run.encode.bytes,
+             run.BytesPerFrame(), run.EncodeMBps(), run.DecodeMBps(),
+             run.encodeRssKb / 1024, run.decodeRssKb / 1024,
+             run.ReuseRate() * 100);
+      if (run.decode.mismatchedFrames) {
+        fprintf(stderr, "%s %s: %llu frames decoded wrongly\n", run.corpus.c_str(),
+                config->name, (unsigned long long)run.decode.mismatchedFrames);
+        ok = false;
+      }
+      runs.push_back(run);
+    }
+  }
+
+  if (!jsonName.empty()) {
+    FILE* json = fopen(jsonName.c_str(), "w");
+    if (!json) {
+      Fail("unable to open JSON output");
+    }
+    WriteJson(json, runs);
+    fclose(json);
+  }
+
+  return ok ? 0 : 1;
+}
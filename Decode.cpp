@@ -1,27 +1,47 @@
 /* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
 
-#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <unistd.h>
 
-const int kMaxScanLineWidth = 3840;
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DecodeLib.h"
+#include "PopFormat.h"
+
 static uint16_t gWidth, gHeight;
 
-const char kReuseScanline = 51;
-const char kNewScanline = 122;
+// The regions that were recorded. Recordings of the whole picture have a
+// single region covering all of it.
+static std::vector<PopRegion> gRegions;
 
-// One minute max.
-const size_t kMaxFrames = 60 * 60;
+static std::unique_ptr<FrameDecoder> gDecoder;
 
-uint64_t gIndex[kMaxFrames];
 size_t gNumFrames;
 
+// The frames to write out, numbered over the whole recording.
+size_t gStartFrame = 0;
+size_t gEndFrame = SIZE_MAX;
+
+// Frames are gathered and written this many bytes at a time rather than with
+// a write() each, which a pipe takes much better.
+const size_t kOutputBytes = 4 << 20;
+static int gOutFd;
+static std::vector<char> gOutput;
+
+// The footer of a file read from a pipe is checked this many bytes at a time.
+const size_t kFooterBlockBytes = 64 << 10;
+
 void
 Fail(const char* err)
 {
@@ -29,94 +49,591 @@ Fail(const char* err)
   exit(1);
 }
 
-const char*
-RunLengthDecode(const char* input, char* output)
+// Reads |length| bytes unless the input ends first, and returns how many it
+// read.
+size_t
+ReadFully(int fd, void* data, size_t length)
 {
-  const char* inp = input;
-  char* outp = output;
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = read(fd, static_cast<char*>(data) + done, length - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      Fail("read failed");
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
 
-  while (outp - output < gWidth) {
-    char count = *inp++;
-    char byte = *inp++;
+void
+PreadFully(int fd, void* data, size_t length, uint64_t offset)
+{
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = pread(fd, static_cast<char*>(data) + done, length - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      Fail("read failed");
+    }
+    done += n;
+  }
+}
 
-    for (; count; count--) {
-      *outp++ = byte;
+void
+FlushOutput()
+{
+  size_t done = 0;
+  while (done < gOutput.size()) {
+    ssize_t n = write(gOutFd, gOutput.data() + done, gOutput.size() - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      Fail("write failed");
     }
+    done += n;
   }
+  gOutput.clear();
+}
 
-  return inp;
+void
+WriteOutput(const void* data, size_t length)
+{
+  if (gOutput.size() + length > kOutputBytes) {
+    FlushOutput();
+  }
+  const char* bytes = static_cast<const char*>(data);
+  gOutput.insert(gOutput.end(), bytes, bytes + length);
 }
 
-size_t
-ReadScanline(const char* input, size_t offset, char* output)
-{
-  if (input[offset] == kNewScanline) {
-    offset++;
-    const char* result = RunLengthDecode(input + offset, output);
-    offset += result - (input + offset);
-  } else if (input[offset] == kReuseScanline) {
-    offset++;
-    uint64_t innerOffset;
-    memcpy(&innerOffset, input + offset, sizeof(uint64_t));
-    offset += sizeof(uint64_t);
-
-    ReadScanline(input, innerOffset, output);
+// Writes frame |number| out if it was asked for.
+void
+WriteFrame(const char* frame, size_t number)
+{
+  if (number >= gStartFrame && number < gEndFrame) {
+    WriteOutput(frame, size_t(gWidth) * gHeight);
+  }
+}
+
+// Sets the size and regions of the recording. Every segment of a recording
+// must have the same ones.
+void
+SetFormat(uint16_t width, uint16_t height, const std::vector<PopRegion>& regions,
+          bool first)
+{
+  if (!first) {
+    if (width != gWidth || height != gHeight || regions.size() != gRegions.size() ||
+        memcmp(regions.data(), gRegions.data(), regions.size() * sizeof(PopRegion))) {
+      Fail("segments have different sizes");
+    }
+    return;
+  }
+
+  gWidth = width;
+  gHeight = height;
+  gRegions = regions;
+
+  fprintf(stderr, "%d x %d\n", gWidth, gHeight);
+  std::vector<Region> decoderRegions;
+  for (const PopRegion& region : gRegions) {
+    if (region.x + region.width > gWidth || region.y + region.height > gHeight) {
+      Fail("region outside the frame");
+    }
+    if (gRegions.size() > 1 || region.width != gWidth) {
+      fprintf(stderr, "  region %d,%d %d x %d\n", region.x, region.y, region.width,
+              region.height);
+    }
+    decoderRegions.push_back(Region(region.x, region.y, region.width, region.height));
+  }
+  gDecoder.reset(new FrameDecoder(gWidth, gHeight, decoderRegions));
+}
+
+// Reads the size and regions from the start of a version 1 index.
+void
+ReadIndexHeader(int indexfd, bool first)
+{
+  uint16_t width, height;
+  std::vector<PopRegion> regions;
+  read(indexfd, &width, sizeof(uint16_t));
+  read(indexfd, &height, sizeof(uint16_t));
+
+  // A zero width means a list of regions follows the real size.
+  if (width == 0) {
+    regions.resize(height);
+    read(indexfd, &width, sizeof(uint16_t));
+    read(indexfd, &height, sizeof(uint16_t));
+    read(indexfd, regions.data(), regions.size() * sizeof(PopRegion));
   } else {
-    assert(false);
+    regions.push_back(PopRegion { 0, 0, width, height });
   }
 
-  return offset;
+  SetFormat(width, height, regions, first);
 }
 
-int
-main(int argc, char** argv)
+// Reads the header of a version 2 file, the PopHeader and the regions after
+// it, which has already been checked to be as long as it says.
+void
+ReadPopHeader(const char* input, size_t length, bool first)
 {
-  int fd = open("video.pop", O_RDONLY, 0664);
-  int outfd = open("video.raw2", O_WRONLY|O_CREAT|O_TRUNC, 0664);
-  int indexfd = open("video.idx", O_RDONLY, 0664);
+  PopHeader header;
+  memcpy(&header, input, sizeof(header));
+  if (header.version != kPopVersion || header.pixelFormat != 1) {
+    Fail("unsupported .pop version");
+  }
+  if (header.headerSize > length ||
+      header.headerSize < sizeof(header) + header.numRegions * sizeof(PopRegion)) {
+    Fail("bad .pop header");
+  }
 
-  read(indexfd, &gWidth, sizeof(uint16_t));
-  read(indexfd, &gHeight, sizeof(uint16_t));
+  std::vector<PopRegion> regions(header.numRegions);
+  memcpy(regions.data(), input + sizeof(header), regions.size() * sizeof(PopRegion));
+  if (regions.empty()) {
+    regions.push_back(PopRegion { 0, 0, header.width, header.height });
+  }
+  SetFormat(header.width, header.height, regions, first);
+  if (first && header.fps) {
+    fprintf(stderr, "%.2f fps\n", header.fps);
+  }
+}
+
+// Finds the last sync point at or before |frame| in the chunk table of a
+// version 2 file, reading only the entries it looks at.
+PopChunkEntry
+FindSyncChunk(int fd, const PopTrailer& trailer, size_t frame)
+{
+  PopChunkEntry chunk;
+  auto readChunk = [&](size_t i) {
+    PreadFully(fd, &chunk, sizeof(chunk), trailer.chunksOffset + i * sizeof(chunk));
+  };
+
+  size_t low = 0;
+  size_t high = trailer.numChunks - 1;
+  while (low < high) {
+    size_t mid = (low + high + 1) / 2;
+    readChunk(mid);
+    if (chunk.firstFrame <= frame) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
 
-  printf("%d x %d\n", gWidth, gHeight);
+  for (; low; low--) {
+    readChunk(low);
+    if (chunk.flags & kPopChunkSync) {
+      return chunk;
+    }
+  }
+  readChunk(0);
+  return chunk;
+}
 
+// Checks the index of a version 2 file against its trailer, reading it a
+// block at a time.
+void
+CheckIndex(int fd, uint64_t length, const PopTrailer& trailer)
+{
+  uint64_t indexLength = trailer.numFrames * sizeof(PopFrameEntry) +
+                         uint64_t(trailer.numChunks) * sizeof(PopChunkEntry);
+  if (trailer.framesOffset + indexLength + sizeof(trailer) != length ||
+      trailer.chunksOffset != trailer.framesOffset + trailer.numFrames * sizeof(PopFrameEntry)) {
+    Fail("corrupt .pop index");
+  }
+
+  std::vector<char> block(kFooterBlockBytes);
+  uint32_t crc = 0;
+  for (uint64_t done = 0; done < indexLength; ) {
+    size_t n = std::min<uint64_t>(block.size(), indexLength - done);
+    PreadFully(fd, block.data(), n, trailer.framesOffset + done);
+    crc = PopChecksum(block.data(), n, crc);
+    done += n;
+  }
+  if (crc != trailer.checksum) {
+    Fail("corrupt .pop index");
+  }
+}
+
+// Reads the footer of a version 2 file from a pipe, the first |have| bytes of
+// which are already in |start|, and checks it. Returns the number of frames
+// it lists.
+uint64_t
+ReadFooter(int fd, const char* start, size_t have, size_t numChunks)
+{
+  // The trailer is the last bytes of the file, so keep the latest ones
+  // aside and check the rest as it goes by.
+  std::vector<char> block(kFooterBlockBytes + sizeof(PopTrailer));
+  memcpy(block.data(), start, have);
+  uint32_t crc = 0;
+  uint64_t indexLength = 0;
   for (;;) {
-    if (read(indexfd, &gIndex[gNumFrames], sizeof(uint64_t)) == 0) {
+    size_t n = ReadFully(fd, block.data() + have, kFooterBlockBytes);
+    have += n;
+    if (have > sizeof(PopTrailer)) {
+      size_t checked = have - sizeof(PopTrailer);
+      crc = PopChecksum(block.data(), checked, crc);
+      indexLength += checked;
+      memmove(block.data(), block.data() + checked, sizeof(PopTrailer));
+      have = sizeof(PopTrailer);
+    }
+    if (n < kFooterBlockBytes) {
       break;
     }
-    gNumFrames++;
   }
 
-  printf("%d frames\n", int(gNumFrames));
+  PopTrailer trailer;
+  memcpy(&trailer, block.data(), sizeof(trailer));
+  if (have != sizeof(trailer) || memcmp(trailer.magic, "PIDX", 4) ||
+      trailer.numChunks != numChunks || crc != trailer.checksum ||
+      indexLength != trailer.numFrames * sizeof(PopFrameEntry) +
+                     uint64_t(trailer.numChunks) * sizeof(PopChunkEntry)) {
+    Fail("corrupt .pop index");
+  }
+  return trailer.numFrames;
+}
+
+// Decodes a version 2 file from |fd|, whose first 4 bytes have been read,
+// and returns how many frames it holds. Chunks are read one at a time, and
+// only those since the last sync point are kept, as later ones can refer
+// back to them. A file, rather than a pipe, is checked through its index
+// first, and decoding starts from the sync point before the first frame
+// asked for. A file that was never closed, and so has no index, is
+// decoded up to its first incomplete or corrupt chunk.
+size_t
+DecodeStream(int fd, const std::string& popName, bool first)
+{
+  PopHeader header;
+  memcpy(header.magic, "PPOP", 4);
+  if (ReadFully(fd, header.magic + 4, sizeof(header) - 4) != sizeof(header) - 4 ||
+      header.headerSize < sizeof(header) || header.headerSize > (1 << 20)) {
+    Fail("bad .pop header");
+  }
+  std::vector<char> headerBytes(header.headerSize);
+  memcpy(headerBytes.data(), &header, sizeof(header));
+  if (ReadFully(fd, headerBytes.data() + sizeof(header), header.headerSize - sizeof(header)) !=
+      header.headerSize - sizeof(header)) {
+    Fail("bad .pop header");
+  }
+  ReadPopHeader(headerBytes.data(), headerBytes.size(), first);
+  if (first) {
+    uint16_t size[2] = { gWidth, gHeight };
+    WriteOutput(size, sizeof(size));
+  }
+
+  // The frames wanted, numbered within this file.
+  size_t base = gNumFrames;
+  size_t start = std::max(gStartFrame, base) - base;
+  size_t end = std::max(gEndFrame, base) - base;
 
   struct stat stbuf;
-  fstat(fd, &stbuf);
+  bool seekable = fstat(fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode);
+  bool indexed = false;
+  PopTrailer trailer;
+  uint64_t offset = header.headerSize;
+  if (seekable && uint64_t(stbuf.st_size) >= offset + sizeof(trailer)) {
+    PreadFully(fd, &trailer, sizeof(trailer), stbuf.st_size - sizeof(trailer));
+    indexed = memcmp(trailer.magic, "PIDX", 4) == 0;
+  }
+
+  // Whether a pipe has an index only shows at its end, so anything wrong
+  // before then is an error; a file without one is recovered instead.
+  bool recovering = seekable && !indexed;
+  if (indexed) {
+    fprintf(stderr, "%s: %llu frames in %u chunks, %llu bytes\n", popName.c_str(),
+            (unsigned long long)trailer.numFrames, trailer.numChunks,
+            (unsigned long long)stbuf.st_size);
+    CheckIndex(fd, stbuf.st_size, trailer);
+    if (start >= std::min<uint64_t>(end, trailer.numFrames)) {
+      return trailer.numFrames;
+    }
+    if (start) {
+      PopChunkEntry chunk = FindSyncChunk(fd, trailer, start);
+      if (chunk.firstFrame) {
+        fprintf(stderr, "starting at the sync point at frame %zu\n",
+                base + chunk.firstFrame);
+        offset = chunk.offset;
+        if (lseek(fd, offset, SEEK_SET) == -1) {
+          Fail("seek failed");
+        }
+      }
+    }
+  }
 
+  // Regions are placed on a black frame.
+  std::vector<char> frame(size_t(gWidth) * gHeight);
+
+  // The file from |windowBase| on, since the last sync point.
+  std::vector<char> window;
+  uint64_t windowBase = offset;
+  size_t numFrames = 0;
+  size_t numChunks = 0;
+  while (numFrames < end) {
+    PopChunkHeader chunk;
+    size_t have = ReadFully(fd, &chunk, sizeof(chunk));
+    if (have == sizeof(chunk) && memcmp(chunk.magic, "PCHK", 4) && !recovering) {
+      // The footer starts here.
+      if (indexed) {
+        return trailer.numFrames;
+      }
+      FlushOutput();
+      return ReadFooter(fd, reinterpret_cast<const char*>(&chunk), have, numChunks);
+    }
+    if (have < sizeof(chunk) || memcmp(chunk.magic, "PCHK", 4) ||
+        (indexed && chunk.length > trailer.framesOffset - offset)) {
+      break;
+    }
+
+    bool sync = chunk.firstFrame == 0 ||
+                (header.syncInterval && chunk.firstFrame % header.syncInterval == 0);
+    if (sync) {
+      window.clear();
+      windowBase = offset;
+    }
+    size_t at = window.size();
+    window.resize(at + sizeof(chunk) + chunk.length);
+    memcpy(&window[at], &chunk, sizeof(chunk));
+    if (ReadFully(fd, &window[at + sizeof(chunk)], chunk.length) != chunk.length) {
+      break;
+    }
+    if (PopChecksum(&window[at + sizeof(chunk)], chunk.length) != chunk.checksum) {
+      if (recovering) {
+        break;
+      }
+      FlushOutput();
+      fprintf(stderr, "chunk at %llu\n", (unsigned long long)offset);
+      Fail("corrupt .pop chunk");
+    }
+
+    gDecoder->SetInputBase(windowBase);
+    size_t recordOffset = at + sizeof(chunk);
+    for (size_t i = 0; i < chunk.numFrames; i++) {
+      recordOffset = gDecoder->ReadFrame(window.data(), recordOffset, frame.data());
+      WriteFrame(frame.data(), base + chunk.firstFrame + i);
+    }
+    offset += sizeof(chunk) + chunk.length;
+    numFrames = chunk.firstFrame + chunk.numFrames;
+    numChunks++;
+  }
+
+  if (indexed) {
+    return trailer.numFrames;
+  }
+  if (numFrames < end) {
+    fprintf(stderr, "no index: recovered %zu frames from %zu chunks\n", numFrames,
+            numChunks);
+  }
+  return numFrames;
+}
+
+// Decodes a version 1 .pop file and its .idx. Their records can refer to
+// anywhere before them, so the .pop is mapped whole and can't come from a
+// pipe.
+size_t
+DecodeVersion1(int fd, const std::string& popName, const std::string& idxName,
+               bool first)
+{
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) || !S_ISREG(stbuf.st_mode)) {
+    Fail("version 1 files can't be read from a pipe");
+  }
   size_t length = stbuf.st_size;
-  printf("File size: %zu bytes\n", length);
 
-  char* inputBuffer = (char*)mmap(nullptr, length,
-                                  PROT_READ,
-                                  MAP_FILE | MAP_PRIVATE,
-                                  fd, 0);
-  if (inputBuffer == MAP_FAILED) {
-    Fail("mmap failed");
+  char* inputBuffer = nullptr;
+  if (length) {
+    inputBuffer = (char*)mmap(nullptr, length,
+                              PROT_READ,
+                              MAP_FILE | MAP_PRIVATE,
+                              fd, 0);
+    if (inputBuffer == MAP_FAILED) {
+      Fail("mmap failed");
+    }
+  }
+
+  int indexfd = open(idxName.c_str(), O_RDONLY, 0664);
+  if (indexfd == -1) {
+    Fail("unable to open input files");
   }
+  ReadIndexHeader(indexfd, first);
+  fstat(indexfd, &stbuf);
+  size_t numFrames = (stbuf.st_size - lseek(indexfd, 0, SEEK_CUR)) / sizeof(uint64_t);
+  close(indexfd);
+  fprintf(stderr, "%s: %zu frames, %zu bytes\n", popName.c_str(), numFrames, length);
 
-  uint16_t data = gWidth;
-  write(outfd, &data, sizeof(data));
-  data = gHeight;
-  write(outfd, &data, sizeof(data));
+  if (first) {
+    uint16_t size[2] = { gWidth, gHeight };
+    WriteOutput(size, sizeof(size));
+  }
 
+  // Regions are placed on a black frame.
+  std::vector<char> frame(size_t(gWidth) * gHeight);
   size_t offset = 0;
-  while (offset < length) {
-    char scanLine[kMaxScanLineWidth];
-    offset = ReadScanline(inputBuffer, offset, scanLine);
-    write(outfd, scanLine, gWidth);
+  gDecoder->SetInputBase(0);
+  for (size_t i = 0; offset < length && gNumFrames + i < gEndFrame; i++) {
+    offset = gDecoder->ReadFrame(inputBuffer, offset, frame.data());
+    WriteFrame(frame.data(), gNumFrames + i);
+  }
+
+  if (length) {
+    munmap(inputBuffer, length);
+  }
+  return numFrames;
+}
+
+// Appends the frames of one .pop file, or stdin for "-", to the output; a
+// version 1 file also needs its .idx.
+void
+DecodeSegment(const std::string& popName, const std::string& idxName, bool first)
+{
+  int fd = popName == "-" ? STDIN_FILENO : open(popName.c_str(), O_RDONLY, 0664);
+  if (fd == -1) {
+    Fail("unable to open input files");
+  }
+
+  char magic[4];
+  if (ReadFully(fd, magic, sizeof(magic)) == sizeof(magic) &&
+      memcmp(magic, "PPOP", 4) == 0) {
+    gNumFrames += DecodeStream(fd, popName, first);
+  } else {
+    gNumFrames += DecodeVersion1(fd, popName, idxName, first);
+  }
+
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+}
+
+// |name| with its extension, if it has one, replaced by |extension|.
+std::string
+ReplaceExtension(const std::string& name, const char* extension)
+{
+  size_t dot = name.rfind('.');
+  size_t slash = name.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return name + extension;
+  }
+  return name.substr(0, dot) + extension;
+}
+
+// Decodes the segments listed in a manifest into one stream, a segment at a
+// time. Their names are relative to the manifest.
+void
+DecodeManifest(const std::string& manifestName)
+{
+  FILE* manifest = fopen(manifestName.c_str(), "r");
+  if (!manifest) {
+    Fail("unable to open segment manifest");
+  }
+  size_t slash = manifestName.rfind('/');
+  std::string dir = slash == std::string::npos ? "" : manifestName.substr(0, slash + 1);
+
+  char line[1024];
+  bool version1 = false;
+  if (!fgets(line, sizeof(line), manifest)) {
+    Fail("unknown segment manifest");
+  }
+  if (!strncmp(line, kSegmentsVersion1Line, strlen(kSegmentsVersion1Line))) {
+    version1 = true;
+  } else if (strncmp(line, kSegmentsVersionLine, strlen(kSegmentsVersionLine))) {
+    Fail("unknown segment manifest");
   }
 
-  close(fd);
-  close(outfd);
+  size_t numSegments = 0;
+  while (fgets(line, sizeof(line), manifest)) {
+    char popName[512], idxName[512] = "";
+    if (sscanf(line, "%511s %511s", popName, idxName) != 2) {
+      Fail("bad segment manifest line");
+    }
+    DecodeSegment(dir + popName, version1 ? dir + idxName : "", numSegments == 0);
+    numSegments++;
+  }
+  fclose(manifest);
+
+  fprintf(stderr, "%zu segments\n", numSegments);
+}
+
+static void
+Usage()
+{
+  fprintf(stderr,
+          "usage: decode [options] [INPUT [OUTPUT]]\n"
+          "Decodes INPUT, a .pop file, a .segments manifest or - for a .pop on\n"
+          "stdin, into raw video in OUTPUT (default video.raw2; - for stdout).\n"
+          "Without INPUT, video.segments is decoded if there is one, or else\n"
+          "video.pop. Only the chunks since the last sync point are kept in memory.\n"
+          "  -s, --start=FRAME     start at this frame, decoding from the sync point\n"
+          "                        before it (default 0)\n"
+          "  -n, --frames=N        only decode N frames\n");
+  exit(1);
+}
+
+int
+main(int argc, char** argv)
+{
+  static const struct option longOptions[] = {
+    { "start", required_argument, nullptr, 's' },
+    { "frames", required_argument, nullptr, 'n' },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  size_t numFrames = 0;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:n:", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 's': gStartFrame = strtoull(optarg, nullptr, 10); break;
+      case 'n': numFrames = strtoull(optarg, nullptr, 10); break;
+      default: Usage();
+    }
+  }
+  if (numFrames) {
+    gEndFrame = gStartFrame + numFrames;
+  }
+  if (argc - optind > 2) {
+    Usage();
+  }
+
+  std::string inputName;
+  if (optind < argc) {
+    inputName = argv[optind];
+  } else {
+    struct stat stbuf;
+    inputName = stat("video.segments", &stbuf) == 0 ? "video.segments" : "video.pop";
+  }
+  std::string outputName = optind + 1 < argc ? argv[optind + 1] : "video.raw2";
+
+  gOutFd = outputName == "-" ? STDOUT_FILENO
+                             : open(outputName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664);
+  if (gOutFd == -1) {
+    Fail("unable to open output file");
+  }
+  gOutput.reserve(kOutputBytes);
+
+  size_t suffix = std::string(".segments").size();
+  if (inputName.size() > suffix &&
+      inputName.compare(inputName.size() - suffix, suffix, ".segments") == 0) {
+    DecodeManifest(inputName);
+  } else {
+    DecodeSegment(inputName, ReplaceExtension(inputName, ".idx"), true);
+  }
+  FlushOutput();
+
+  fprintf(stderr, "%d frames\n", int(gNumFrames));
+  if (gStartFrame || gEndFrame != SIZE_MAX) {
+    size_t end = std::min(gEndFrame, gNumFrames);
+    fprintf(stderr, "wrote %zu frames from frame %zu\n",
+            end > gStartFrame ? end - gStartFrame : 0, gStartFrame);
+  }
+
+  if (gOutFd != STDOUT_FILENO) {
+    close(gOutFd);
+  }
 
   return 0;
 }
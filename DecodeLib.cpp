@@ -0,0 +1,234 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "DecodeLib.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "EncodeLib.h"
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+static const char*
+RunLengthDecode(const char* input, char* output, size_t width)
+{
+  const char* inp = input;
+  char* outp = output;
+
+  while (size_t(outp - output) < width) {
+    char count = *inp++;
+    char byte = *inp++;
+
+    for (; count; count--) {
+      *outp++ = byte;
+    }
+  }
+
+  return inp;
+}
+
+// Decodes a kPackedScanline row: literals are copied and runs are filled in
+// one call each.
+static const char*
+UnpackScanline(const char* input, char* output, size_t width)
+{
+  const uint8_t* inp = reinterpret_cast<const uint8_t*>(input);
+  char* outp = output;
+  char* end = output + width;
+
+  while (outp < end) {
+    uint8_t token = *inp++;
+    if (token < 128) {
+      size_t count = size_t(token) + 1;
+      memcpy(outp, inp, count);
+      outp += count;
+      inp += count;
+      continue;
+    }
+
+    size_t count = size_t(token) - 125;
+    if (token == 255) {
+      uint16_t length;
+      memcpy(&length, inp, sizeof(uint16_t));
+      inp += sizeof(uint16_t);
+      count = size_t(length) + 130;
+    }
+    memset(outp, *inp++, count);
+    outp += count;
+  }
+
+  return reinterpret_cast<const char*>(inp);
+}
+
+FrameDecoder::FrameDecoder(size_t width, size_t height,
+                           const std::vector<Region>& regions)
+ : mWidth(width)
+ , mHeight(height)
+ , mRegions(regions)
+ , mInputBase(0)
+ , mTileSize(0)
+ , mShift(0)
+{
+  if (mRegions.empty()) {
+    mRegions.push_back(Region(0, 0, width, height));
+  }
+  for (const Region& region : mRegions) {
+    for (size_t y = 0; y < region.height; y++) {
+      mRows.push_back(Row { (region.y + y) * mWidth + region.x, region.width });
+    }
+  }
+}
+
+size_t
+FrameDecoder::ReadScanline(const char* input, size_t offset, char* output, size_t width)
+{
+  if (input[offset] == kPackedScanline) {
+    offset++;
+    const char* result = UnpackScanline(input + offset, output, width);
+    offset += result - (input + offset);
+  } else if (input[offset] == kNewScanline) {
+    offset++;
+    const char* result = RunLengthDecode(input + offset, output, width);
+    offset += result - (input + offset);
+  } else if (input[offset] == kReuseScanline) {
+    offset++;
+    uint64_t innerOffset;
+    memcpy(&innerOffset, input + offset, sizeof(uint64_t));
+    offset += sizeof(uint64_t);
+
+    ReadScanline(input, innerOffset - mInputBase, output, width);
+  } else if (input[offset] == kDeltaScanline) {
+    offset++;
+    uint64_t baseOffset;
+    memcpy(&baseOffset, input + offset, sizeof(uint64_t));
+    offset += sizeof(uint64_t);
+
+    ReadScanline(input, baseOffset - mInputBase, output, width);
+
+    uint16_t spans;
+    memcpy(&spans, input + offset, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    char* outp = output;
+    for (; spans; spans--) {
+      uint16_t skip, length;
+      memcpy(&skip, input + offset, sizeof(uint16_t));
+      memcpy(&length, input + offset + 2, sizeof(uint16_t));
+      offset += 2 * sizeof(uint16_t);
+
+      outp += skip;
+      memcpy(outp, input + offset, length);
+      outp += length;
+      offset += length;
+    }
+  } else {
+    assert(false);
+  }
+
+  return offset;
+}
+
+// Cuts each region into tiles the way the encoder does.
+void
+FrameDecoder::SetTileSize(size_t tileSize)
+{
+  mTileSize = tileSize;
+  mTiles.clear();
+  for (const Region& region : mRegions) {
+    for (size_t y = 0; y < region.height; y += tileSize) {
+      for (size_t x = 0; x < region.width; x += tileSize) {
+        mTiles.push_back(Tile { (region.y + y) * mWidth + region.x + x,
+                                std::min(tileSize, region.width - x),
+                                std::min(tileSize, region.height - y) });
+      }
+    }
+  }
+  mTilePixels.resize(tileSize * tileSize);
+}
+
+// Draws the tiles of a kTileFrame record over |frame|, which holds the frame
+// before it.
+size_t
+FrameDecoder::ReadTiles(const char* input, size_t offset, char* frame)
+{
+  offset += 1 + sizeof(uint64_t);
+
+  uint16_t tileSize;
+  uint32_t count;
+  memcpy(&tileSize, input + offset, sizeof(uint16_t));
+  memcpy(&count, input + offset + sizeof(uint16_t), sizeof(uint32_t));
+  offset += sizeof(uint16_t) + sizeof(uint32_t);
+  if (tileSize != mTileSize) {
+    SetTileSize(tileSize);
+  }
+
+  for (; count; count--) {
+    uint32_t index;
+    memcpy(&index, input + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+    if (index >= mTiles.size()) {
+      Fail("tile outside the frame");
+    }
+
+    const Tile& tile = mTiles[index];
+    const char* result = UnpackScanline(input + offset, mTilePixels.data(),
+                                        tile.width * tile.height);
+    offset += result - (input + offset);
+    for (size_t y = 0; y < tile.height; y++) {
+      char* outp = frame + tile.start + y * mWidth;
+      const char* changes = &mTilePixels[y * tile.width];
+      for (size_t x = 0; x < tile.width; x++) {
+        outp[x] ^= changes[x];
+      }
+    }
+  }
+  return offset;
+}
+
+size_t
+FrameDecoder::ReadFrame(const char* input, size_t offset, char* frame)
+{
+  size_t row = 0;
+  while (row < mRows.size()) {
+    if (input[offset] == kCopyFrame) {
+      offset += 1 + sizeof(uint64_t);
+      row = mRows.size();
+    } else if (input[offset] == kTileFrame) {
+      offset = ReadTiles(input, offset, frame);
+      row = mRows.size();
+    } else if (input[offset] == kCopyRows) {
+      uint16_t count;
+      memcpy(&count, input + offset + 1 + sizeof(uint64_t), sizeof(uint16_t));
+      offset += 1 + sizeof(uint64_t) + sizeof(uint16_t);
+      row += count;
+    } else if (input[offset] == kScrollFrame) {
+      int16_t shift;
+      memcpy(&shift, input + offset + 1 + sizeof(uint64_t), sizeof(int16_t));
+      offset += 1 + sizeof(uint64_t) + sizeof(int16_t);
+      mShift = shift;
+      mPrevFrame.assign(frame, frame + mWidth * mHeight);
+    } else if (input[offset] == kShiftRows) {
+      uint16_t count;
+      memcpy(&count, input + offset + 1, sizeof(uint16_t));
+      offset += 1 + sizeof(uint16_t);
+      for (; count; count--, row++) {
+        memcpy(frame + mRows[row].start, &mPrevFrame[mRows[row + mShift].start],
+               mRows[row].width);
+      }
+    } else {
+      offset = ReadScanline(input, offset, frame + mRows[row].start, mRows[row].width);
+      row++;
+    }
+  }
+  return offset;
+}
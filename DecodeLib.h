@@ -0,0 +1,73 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef DecodeLib_h
+#define DecodeLib_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "Region.h"
+
+// Decodes the records of .pop frames, described in EncodeLib.h, into 8-bit
+// luma frames. Finding the frames in a file is up to the caller.
+class FrameDecoder
+{
+public:
+  // |regions| are the parts of the |width| x |height| picture that were
+  // recorded; empty means all of it.
+  FrameDecoder(size_t width, size_t height,
+               const std::vector<Region>& regions = std::vector<Region>());
+
+  // Records refer to each other by file offset. The |input| given to
+  // ReadFrame() holds the file from offset |base|, 0 by default, so only the
+  // part of it since the last sync point needs to be in memory.
+  void SetInputBase(uint64_t base) { mInputBase = base; }
+
+  // Reads the records of the frame at |offset| in |input| into |frame| and
+  // returns the offset after them. Frames are decoded in order into the same
+  // buffer, which still holds the previous frame, so rows copied from it, and
+  // the pixels around changed tiles, are already in place. Pixels outside
+  // the regions are never written.
+  size_t ReadFrame(const char* input, size_t offset, char* frame);
+
+  size_t FrameSize() const { return mWidth * mHeight; }
+
+private:
+  // Reads the scanline record at |offset| into |width| bytes of |output|.
+  size_t ReadScanline(const char* input, size_t offset, char* output, size_t width);
+  size_t ReadTiles(const char* input, size_t offset, char* frame);
+  void SetTileSize(size_t tileSize);
+
+  size_t mWidth, mHeight;
+  std::vector<Region> mRegions;
+  uint64_t mInputBase;
+
+  // Where each stored row starts in the frame, and its width.
+  struct Row
+  {
+    size_t start;
+    size_t width;
+  };
+  std::vector<Row> mRows;
+
+  // Where each tile of a kTileFrame goes in the frame, for tiles of
+  // mTileSize. They are worked out from the first tiled frame.
+  struct Tile
+  {
+    size_t start;
+    size_t width;
+    size_t height;
+  };
+  std::vector<Tile> mTiles;
+  size_t mTileSize;
+  std::vector<char> mTilePixels;
+
+  // The previous frame, kept while a scrolled frame is decoded over it, and
+  // how far it scrolled.
+  std::vector<char> mPrevFrame;
+  int mShift;
+};
+
+#endif // DecodeLib_h
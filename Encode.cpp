@@ -1,14 +1,15 @@
 /* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/time.h>
 #include <unistd.h>
 
+#include <string>
+
 #include "EncodeLib.h"
 
 static void
@@ -18,48 +19,114 @@ Fail(const char* err)
   exit(1);
 }
 
-int
-ReadSize(int fd)
+static void
+Usage()
+{
+  fprintf(stderr,
+          "usage: encode [options] [INPUT [OUTPUT]]\n"
+          "Encodes raw video from INPUT (default video.raw) into OUTPUT (default\n"
+          "video.pop); either can be - for stdin or stdout. Input is read a chunk\n"
+          "at a time, so memory doesn't grow with its length.\n"
+          "  -l, --tiles=SIZE      store changed SIZE x SIZE tiles instead of rows\n"
+          "  -j, --threads=N       encode on N threads (default: one per CPU)\n"
+          "  -c, --chunk=FRAMES    frames each thread encodes on their own (default 60);\n"
+          "                        the output only depends on this, not on -j\n"
+          "  -m, --motion=FILE     write how far each frame scrolled to FILE (default:\n"
+          "                        OUTPUT with .motion instead of .pop, or none for\n"
+          "                        stdout)\n");
+  exit(1);
+}
+
+// Reads |length| bytes unless the input ends first, and returns how many it
+// read.
+static size_t
+ReadFully(int fd, char* data, size_t length)
 {
-  uint16_t data;
-  read(fd, &data, sizeof(uint16_t));
-  return data;
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = read(fd, data + done, length - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      Fail("read failed");
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
 }
 
 int
 main(int argc, char** argv)
 {
-  int fd = open("video.raw", O_RDONLY, 0664);
+  static const struct option longOptions[] = {
+    { "tiles", required_argument, nullptr, 'l' },
+    { "threads", required_argument, nullptr, 'j' },
+    { "chunk", required_argument, nullptr, 'c' },
+    { "motion", required_argument, nullptr, 'm' },
+    { nullptr, 0, nullptr, 0 },
+  };
 
-  struct stat stbuf;
-  fstat(fd, &stbuf);
+  size_t tileSize = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? cpus : 1;
+  size_t chunkFrames = kDefaultParallelChunkFrames;
+  std::string motionName;
 
-  size_t length = stbuf.st_size;
-  printf("File size: %zu bytes\n", length);
-
-  char* inputBuffer = (char*)mmap(nullptr, length,
-                                  PROT_READ,
-                                  MAP_FILE | MAP_PRIVATE,
-                                  fd, 0);
-  if (inputBuffer == MAP_FAILED) {
-    Fail("mmap failed");
+  int opt;
+  while ((opt = getopt_long(argc, argv, "l:j:c:m:", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'l': tileSize = atoi(optarg); break;
+      case 'j': threads = atoi(optarg); break;
+      case 'c': chunkFrames = atoi(optarg); break;
+      case 'm': motionName = optarg; break;
+      default: Usage();
+    }
+  }
+  if (tileSize > kMaxTileSize || !threads || !chunkFrames || argc - optind > 2) {
+    Usage();
   }
 
-  char* ptr = inputBuffer;
-
-  int width = *((uint16_t*)ptr);
-  ptr += sizeof(uint16_t);
-  int height = *((uint16_t*)ptr);
-  ptr += sizeof(uint16_t);
+  std::string inputName = optind < argc ? argv[optind] : "video.raw";
+  std::string popName = optind + 1 < argc ? argv[optind + 1] : "video.pop";
+  if (motionName.empty() && popName != "-") {
+    size_t dot = popName.rfind('.');
+    size_t slash = popName.rfind('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+      motionName = popName.substr(0, dot);
+    } else {
+      motionName = popName;
+    }
+    motionName += ".motion";
+  }
 
-  length -= sizeof(uint16_t) * 2;
+  int fd = inputName == "-" ? STDIN_FILENO : open(inputName.c_str(), O_RDONLY);
+  if (fd == -1) {
+    Fail("unable to open input file");
+  }
 
-  printf("%d x %d\n", width, height);
+  uint16_t size[2];
+  if (ReadFully(fd, reinterpret_cast<char*>(size), sizeof(size)) != sizeof(size)) {
+    Fail("input too short");
+  }
+  int width = size[0];
+  int height = size[1];
+  fprintf(stderr, "%d x %d\n", width, height);
 
-  int numFrames = length / (size_t(width) * size_t(height));
+  // A frame cut short at the end of the input is dropped.
+  size_t frameSize = size_t(width) * size_t(height);
+  auto readFrames = [&](char* frames, size_t maxFrames) -> size_t {
+    return ReadFully(fd, frames, maxFrames * frameSize) / frameSize;
+  };
 
-  WriteCompressed("video.pop", "video.idx", width, height, inputBuffer, numFrames);
+  WriteCompressed(popName.c_str(), width, height, readFrames, tileSize,
+                  motionName.empty() ? nullptr : motionName.c_str(), threads, chunkFrames);
 
-  close(fd);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
   return 0;
 }
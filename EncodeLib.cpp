@@ -0,0 +1,1481 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "EncodeLib.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "Affinity.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ENCODE_X86 1
+#include <immintrin.h>
+#endif
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+static void
+WriteFully(int fd, const void* data, size_t length)
+{
+  const char* p = static_cast<const char*>(data);
+  while (length) {
+    ssize_t written = write(fd, p, length);
+    if (written <= 0) {
+      Fail("write failed");
+    }
+    p += written;
+    length -= written;
+  }
+}
+
+// Splits "dir/video.pop" into "dir/video" and ".pop".
+static void
+SplitExtension(const std::string& name, std::string* stem, std::string* extension)
+{
+  size_t dot = name.rfind('.');
+  size_t slash = name.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = name.size();
+  }
+  *stem = name.substr(0, dot);
+  *extension = name.substr(dot);
+}
+
+// "dir/video.pop" becomes "dir/video.0003.pop" for segment 3.
+static std::string
+SegmentName(const std::string& name, size_t segment)
+{
+  std::string stem, extension;
+  SplitExtension(name, &stem, &extension);
+
+  char number[16];
+  snprintf(number, sizeof(number), ".%04zu", segment);
+  return stem + number + extension;
+}
+
+static const char*
+BaseName(const std::string& name)
+{
+  size_t slash = name.rfind('/');
+  return name.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+// A 64-bit hash in the style of XXH64: four independent lanes of 8 bytes,
+// so the multiplies overlap, then a final mix. Only used to find candidate
+// matches, which are then compared in full.
+static const uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t kPrime3 = 0x165667B19E3779F9ull;
+static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t
+Rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+Read64(const char* p)
+{
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline uint64_t
+HashRound(uint64_t acc, uint64_t input)
+{
+  return Rotl(acc + input * kPrime2, 31) * kPrime1;
+}
+
+static uint64_t
+HashScanline(const char* p, size_t length)
+{
+  const char* end = p + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t v1 = kPrime1 + kPrime2;
+    uint64_t v2 = kPrime2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - kPrime1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = HashRound(v1, Read64(p));
+      v2 = HashRound(v2, Read64(p + 8));
+      v3 = HashRound(v3, Read64(p + 16));
+      v4 = HashRound(v4, Read64(p + 24));
+    }
+    hash = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+    for (uint64_t v : { v1, v2, v3, v4 }) {
+      hash = (hash ^ HashRound(0, v)) * kPrime1 + kPrime4;
+    }
+  } else {
+    hash = kPrime5;
+  }
+
+  hash += length;
+  for (; p + 8 <= end; p += 8) {
+    hash = Rotl(hash ^ HashRound(0, Read64(p)), 27) * kPrime1 + kPrime4;
+  }
+  for (; p < end; p++) {
+    hash = Rotl(hash ^ (uint8_t(*p) * kPrime5), 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+Encoder::Encoder(size_t width, size_t height, const std::vector<Region>& regions)
+ : mWidth(width)
+ , mHeight(height)
+ , mRegions(regions)
+ , mFrameSize(0)
+ , mPopFile(-1)
+ , mFps(0)
+ , mCreatedNs(-1)
+ , mOffset(0)
+ , mClosedBytes(0)
+ , mNumFrames(0)
+ , mChunkOffset(0)
+ , mChunkFirstFrame(0)
+ , mChunkFlags(0)
+ , mSyncInterval(0)
+ , mMaxSegmentFrames(0)
+ , mMaxSegmentBytes(0)
+ , mManifest(nullptr)
+ , mNumSegments(0)
+ , mSegmentFirstFrame(0)
+ , mSegmentFirstNs(0)
+ , mSegmentLastNs(0)
+ , mShift(0)
+ , mMotionFile(nullptr)
+ , mSourceFrameOffset(0)
+ , mTileSize(0)
+ , mOverlayDepth(0)
+ , mDedupEntries(kDefaultDedupEntries)
+ , mDedupSetMask(0)
+ , mMaxRowWidth(0)
+{
+  std::vector<Region> rows = regions;
+  if (rows.empty()) {
+    rows.push_back(Region(0, 0, width, height));
+  }
+
+  for (size_t i = 0; i < rows.size(); i++) {
+    const Region& region = rows[i];
+    for (size_t y = 0; y < region.height; y++) {
+      mRowStarts.push_back(mFrameSize);
+      mRowWidths.push_back(region.width);
+      mRowRegions.push_back(i);
+      mFrameSize += region.width;
+    }
+    mMaxRowWidth = std::max(mMaxRowWidth, region.width);
+  }
+}
+
+Encoder::~Encoder()
+{
+  Close();
+}
+
+void
+Encoder::SetSegments(size_t maxFrames, uint64_t maxBytes)
+{
+  mMaxSegmentFrames = maxFrames;
+  mMaxSegmentBytes = maxBytes;
+}
+
+void
+Encoder::SetDedupEntries(size_t entries)
+{
+  mDedupEntries = entries;
+}
+
+void
+Encoder::SetTileSize(size_t size)
+{
+  mTileSize = std::min(size, kMaxTileSize);
+}
+
+void
+Encoder::Open(const char* popName)
+{
+  mPopName = popName;
+  mClosedBytes = 0;
+  mNumFrames = 0;
+  mNumSegments = 0;
+  mDedupStats = DedupStats();
+  Prepare();
+
+  if (IsSegmented()) {
+    std::string stem, extension;
+    SplitExtension(mPopName, &stem, &extension);
+    mManifest = fopen((stem + ".segments").c_str(), "w");
+    if (!mManifest) {
+      Fail("unable to open segment manifest");
+    }
+    fprintf(mManifest, "%s\n", kSegmentsVersionLine);
+    fflush(mManifest);
+  }
+
+  if (!mMotionName.empty()) {
+    mMotionFile = fopen(mMotionName.c_str(), "wb");
+    if (!mMotionFile) {
+      Fail("unable to open motion file");
+    }
+    uint32_t header[2] = { 0, kMotionVersion };
+    memcpy(header, "PMOT", 4);
+    if (fwrite(header, sizeof(header), 1, mMotionFile) != 1) {
+      Fail("write failed");
+    }
+  }
+
+  OpenSegment();
+}
+
+// Sizes the hash table and cuts the frame into tiles.
+void
+Encoder::Prepare()
+{
+  // Sets are looked up with a mask, so round up to a power of two.
+  size_t sets = 0;
+  if (mDedupEntries) {
+    sets = 1;
+    while (sets * kDedupWays < mDedupEntries) {
+      sets *= 2;
+    }
+  }
+  mDedupSetMask = sets ? sets - 1 : 0;
+  mDedupTable.resize(sets * kDedupWays);
+  mDedupPixels.resize(mDedupTable.size() * mMaxRowWidth);
+
+  // Cut each region, in the order its rows are stored, into tiles.
+  mTiles.clear();
+  if (mTileSize) {
+    std::vector<Region> regions = mRegions;
+    if (regions.empty()) {
+      regions.push_back(Region(0, 0, mWidth, mHeight));
+    }
+
+    size_t start = 0;
+    size_t row = 0;
+    for (const Region& region : regions) {
+      for (size_t y = 0; y < region.height; y += mTileSize) {
+        for (size_t x = 0; x < region.width; x += mTileSize) {
+          mTiles.push_back(Tile { start + y * region.width + x, region.width, row + y,
+                                  std::min(mTileSize, region.width - x),
+                                  std::min(mTileSize, region.height - y) });
+        }
+      }
+      start += region.Area();
+      row += region.height;
+    }
+    mTilePixels.resize(mTileSize * mTileSize);
+  }
+}
+
+void
+Encoder::OpenSegment()
+{
+  std::string popName = mPopName;
+  if (IsSegmented()) {
+    popName = SegmentName(mPopName, mNumSegments);
+  }
+
+  if (popName == "-") {
+    mPopFile = dup(STDOUT_FILENO);
+  } else {
+    mPopFile = open(popName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664);
+  }
+  if (mPopFile == -1) {
+    Fail("unable to open output file");
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  PopHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "PPOP", 4);
+  header.version = kPopVersion;
+  header.headerSize = sizeof(header) + mRegions.size() * sizeof(PopRegion);
+  header.width = mWidth;
+  header.height = mHeight;
+  header.numRegions = mRegions.size();
+  header.pixelFormat = kPopPixelLuma8;
+  header.syncInterval = uint32_t(mSyncInterval);
+  header.fps = mFps;
+  header.createdNs = mCreatedNs >= 0 ? mCreatedNs
+                                     : int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+
+  std::vector<PopRegion> regions;
+  for (const Region& region : mRegions) {
+    regions.push_back(PopRegion { uint16_t(region.x), uint16_t(region.y),
+                                  uint16_t(region.width), uint16_t(region.height) });
+  }
+  WriteFully(mPopFile, &header, sizeof(header));
+  WriteFully(mPopFile, regions.data(), regions.size() * sizeof(PopRegion));
+
+  // Scanlines are only reused within a segment, so each one decodes alone.
+  mOffset = header.headerSize;
+  mSegmentFirstFrame = mNumFrames;
+  mFrameEntries.clear();
+  mChunkEntries.clear();
+  mOutput.clear();
+  mFixups.clear();
+  ForgetFrames();
+  mOutput.reserve(kPopChunkBytes + mFrameSize * 2 + mRowStarts.size());
+}
+
+// Starts over as if no frame had been stored, so nothing refers back.
+void
+Encoder::ForgetFrames()
+{
+  mPrevFrame.clear();
+  mOverlayDepth = 0;
+  mStaleRows.assign(mRowStarts.size(), false);
+  mPrevOffsets.assign(mRowStarts.size(), 0);
+  mPrevDepths.assign(mRowStarts.size(), 0);
+  mHomeFrames.assign(mRowStarts.size(), 0);
+  mHomeOffsets.assign(mRowStarts.size(), 0);
+  mHomeRows.assign(mRowStarts.size(), 0);
+  mPrevHashes.assign(mRowStarts.size(), 0);
+  mHashes.assign(mRowStarts.size(), 0);
+  mShifted.assign(mRowStarts.size(), false);
+  mUnchanged.assign(mRowStarts.size(), false);
+  for (DedupEntry& entry : mDedupTable) {
+    entry.lastUsed = 0;
+  }
+}
+
+bool
+Encoder::FindInTable(uint64_t hash, const char* scanline, size_t width,
+                     uint64_t* offset, size_t* depth)
+{
+  size_t first = (hash & mDedupSetMask) * kDedupWays;
+  for (size_t i = first; i < first + kDedupWays; i++) {
+    DedupEntry& entry = mDedupTable[i];
+    if (entry.lastUsed && entry.hash == hash && entry.width == width &&
+        memcmp(&mDedupPixels[i * mMaxRowWidth], scanline, width) == 0) {
+      entry.lastUsed = mNumFrames + 1;
+      *offset = entry.offset;
+      *depth = entry.depth;
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+Encoder::AddToTable(uint64_t hash, const char* scanline, size_t width,
+                    uint64_t offset, size_t depth)
+{
+  // Replace an empty entry, or else the one unused for longest.
+  size_t first = (hash & mDedupSetMask) * kDedupWays;
+  size_t victim = first;
+  for (size_t i = first; i < first + kDedupWays; i++) {
+    if (mDedupTable[i].lastUsed < mDedupTable[victim].lastUsed) {
+      victim = i;
+    }
+  }
+
+  DedupEntry& entry = mDedupTable[victim];
+  entry.hash = hash;
+  entry.offset = offset;
+  entry.width = width;
+  entry.depth = depth;
+  entry.lastUsed = mNumFrames + 1;
+  memcpy(&mDedupPixels[victim * mMaxRowWidth], scanline, width);
+}
+
+static void
+PushUint16(std::vector<char>* output, uint16_t value)
+{
+  const char* p = reinterpret_cast<const char*>(&value);
+  output->insert(output->end(), p, p + sizeof(value));
+}
+
+// Runs shorter than kMinRun are cheaper as part of a literal.
+static const size_t kMinRun = 3;
+static const size_t kLongRun = 130;
+static const size_t kMaxLiteral = 128;
+
+// Finds the first position at or after |i| that starts a run of at least
+// kMinRun equal bytes, or |width|.
+typedef size_t (*FindRunFn)(const uint8_t* s, size_t i, size_t width);
+
+// Finds the first position after |i| whose byte differs from s[i], or |width|.
+typedef size_t (*FindRunEndFn)(const uint8_t* s, size_t i, size_t width);
+
+// Whether the |width| bytes at |a| and |b| differ.
+typedef bool (*SpanDiffersFn)(const uint8_t* a, const uint8_t* b, size_t width);
+
+static size_t
+FindRunScalar(const uint8_t* s, size_t i, size_t width)
+{
+  for (; i + 2 < width; i++) {
+    if (s[i] == s[i + 1] && s[i] == s[i + 2]) {
+      return i;
+    }
+  }
+  return width;
+}
+
+static size_t
+FindRunEndScalar(const uint8_t* s, size_t i, size_t width)
+{
+  uint8_t byte = s[i];
+  for (i++; i < width && s[i] == byte; i++) {
+  }
+  return i;
+}
+
+static bool
+SpanDiffersScalar(const uint8_t* a, const uint8_t* b, size_t width)
+{
+  return memcmp(a, b, width) != 0;
+}
+
+#ifdef ENCODE_X86
+
+// A run starts wherever a byte equals the next two, so compare the row with
+// itself shifted by one and by two.
+
+__attribute__((target("sse2")))
+static size_t
+FindRunSSE2(const uint8_t* s, size_t i, size_t width)
+{
+  for (; i + 18 <= width; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 1));
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 2));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b),
+                                                    _mm_cmpeq_epi8(b, c)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return FindRunScalar(s, i, width);
+}
+
+__attribute__((target("sse2")))
+static size_t
+FindRunEndSSE2(const uint8_t* s, size_t i, size_t width)
+{
+  const __m128i byte = _mm_set1_epi8(char(s[i]));
+  for (i++; i + 16 <= width; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    uint32_t mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, byte)) & 0xffff;
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < width && s[i] == s[i - 1]; i++) {
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+FindRunAVX2(const uint8_t* s, size_t i, size_t width)
+{
+  for (; i + 34 <= width; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + 1));
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + 2));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, b),
+                                                          _mm256_cmpeq_epi8(b, c)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return FindRunSSE2(s, i, width);
+}
+
+__attribute__((target("avx2")))
+static size_t
+FindRunEndAVX2(const uint8_t* s, size_t i, size_t width)
+{
+  const __m256i byte = _mm256_set1_epi8(char(s[i]));
+  size_t start = i;
+  for (i++; i + 32 <= width; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+    uint32_t mask = ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, byte)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < width && s[i] == s[start]; i++) {
+  }
+  return i;
+}
+
+// Tile rows are narrow, so rather than stopping at the first difference the
+// span is xor-ed together and tested once.
+
+__attribute__((target("sse2")))
+static bool
+SpanDiffersSSE2(const uint8_t* a, const uint8_t* b, size_t width)
+{
+  __m128i diff = _mm_setzero_si128();
+  size_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+    __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+    diff = _mm_or_si128(diff, _mm_xor_si128(p, q));
+  }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff ||
+         memcmp(a + x, b + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static bool
+SpanDiffersAVX2(const uint8_t* a, const uint8_t* b, size_t width)
+{
+  if (width < 32) {
+    return SpanDiffersSSE2(a, b, width);
+  }
+  __m256i diff = _mm256_setzero_si256();
+  size_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + x));
+    __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + x));
+    diff = _mm256_or_si256(diff, _mm256_xor_si256(p, q));
+  }
+  return !_mm256_testz_si256(diff, diff) || memcmp(a + x, b + x, width - x);
+}
+
+#endif // ENCODE_X86
+
+struct ScanlineKernel
+{
+  const char* name;
+  FindRunFn findRun;
+  FindRunEndFn findRunEnd;
+  SpanDiffersFn spanDiffers;
+};
+
+static const ScanlineKernel*
+ChooseScanlineKernel()
+{
+  static const ScanlineKernel kScalar = {
+    "scalar", FindRunScalar, FindRunEndScalar, SpanDiffersScalar
+  };
+#ifdef ENCODE_X86
+  static const ScanlineKernel kSSE2 = {
+    "sse2", FindRunSSE2, FindRunEndSSE2, SpanDiffersSSE2
+  };
+  static const ScanlineKernel kAVX2 = {
+    "avx2", FindRunAVX2, FindRunEndAVX2, SpanDiffersAVX2
+  };
+
+  if (__builtin_cpu_supports("avx2")) {
+    return &kAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &kSSE2;
+  }
+#endif
+  return &kScalar;
+}
+
+// Parallel encoders call this from several threads at once, so the choice
+// is made by a static initializer, which runs exactly once.
+static const ScanlineKernel*
+GetScanlineKernel()
+{
+  static const ScanlineKernel* kernel = ChooseScanlineKernel();
+  return kernel;
+}
+
+const char*
+ScanlineKernelName()
+{
+  return GetScanlineKernel()->name;
+}
+
+void
+Encoder::EncodePacked(const char* scanline, size_t width)
+{
+  const ScanlineKernel* kernel = GetScanlineKernel();
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(scanline);
+
+  size_t i = 0;
+  while (i < width) {
+    size_t run = kernel->findRun(bytes, i, width);
+
+    while (i < run) {
+      size_t count = std::min(run - i, kMaxLiteral);
+      mOutput.push_back(char(count - 1));
+      mOutput.insert(mOutput.end(), scanline + i, scanline + i + count);
+      i += count;
+    }
+    if (run == width) {
+      break;
+    }
+
+    // Rows are at most 65535 wide, so one long run token covers any run.
+    size_t end = kernel->findRunEnd(bytes, run, width);
+    size_t count = end - run;
+    if (count < kLongRun) {
+      mOutput.push_back(char(128 + count - kMinRun));
+    } else {
+      mOutput.push_back(char(255));
+      PushUint16(&mOutput, count - kLongRun);
+    }
+    mOutput.push_back(scanline[run]);
+    i = end;
+  }
+}
+
+// Returns the first position at or after |i| where |a| and |b| differ, or
+// |width|.
+static size_t
+FindDifference(const char* a, const char* b, size_t i, size_t width)
+{
+  for (; i + 8 <= width; i += 8) {
+    uint64_t x;
+    uint64_t y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    if (x != y) {
+      return i + __builtin_ctzll(x ^ y) / 8;
+    }
+  }
+  for (; i < width && a[i] == b[i]; i++) {
+  }
+  return i;
+}
+
+bool
+Encoder::EncodeDelta(size_t row, const char* scanline, size_t maxSize)
+{
+  const size_t kSpanHeader = 2 * sizeof(uint16_t);
+
+  size_t width = mRowWidths[row];
+  const char* prev = &mPrevFrame[mRowStarts[row]];
+
+  mDelta.clear();
+  mDelta.push_back(kDeltaScanline);
+  const char* p = reinterpret_cast<const char*>(&mPrevOffsets[row]);
+  mDelta.insert(mDelta.end(), p, p + sizeof(uint64_t));
+  size_t countAt = mDelta.size();
+  PushUint16(&mDelta, 0);
+
+  uint16_t spans = 0;
+  size_t i = 0;
+  for (;;) {
+    size_t start = FindDifference(prev, scanline, i, width);
+    if (start == width) {
+      break;
+    }
+
+    // Extend the span over gaps too short to be worth a span header of their
+    // own.
+    size_t end = start + 1;
+    for (;;) {
+      while (end < width && prev[end] != scanline[end]) {
+        end++;
+      }
+      size_t next = FindDifference(prev, scanline, end, width);
+      if (next == width || next - end > kSpanHeader) {
+        break;
+      }
+      end = next + 1;
+    }
+
+    if (mDelta.size() + kSpanHeader + (end - start) > maxSize || spans == UINT16_MAX) {
+      return false;
+    }
+    PushUint16(&mDelta, start - i);
+    PushUint16(&mDelta, end - start);
+    mDelta.insert(mDelta.end(), scanline + start, scanline + end);
+    spans++;
+    i = end;
+  }
+
+  memcpy(&mDelta[countAt], &spans, sizeof(spans));
+  return true;
+}
+
+void
+Encoder::PushOffset(char type, uint64_t offset)
+{
+  mOutput.push_back(type);
+  mFixups.push_back(mOutput.size());
+  const char* p = reinterpret_cast<const char*>(&offset);
+  mOutput.insert(mOutput.end(), p, p + sizeof(uint64_t));
+}
+
+// Encodes a row that differs from the previous frame's.
+void
+Encoder::EncodeScanline(size_t row, const char* scanline, uint64_t hash)
+{
+  size_t width = mRowWidths[row];
+
+  if (!mDedupTable.empty() &&
+      FindInTable(hash, scanline, width, &mPrevOffsets[row], &mPrevDepths[row])) {
+    mDedupStats.tableHits++;
+    PushOffset(kReuseScanline, mPrevOffsets[row]);
+    return;
+  }
+
+  // A delta small enough is taken without packing the row at all; a larger
+  // one has to beat it.
+  const size_t kSmallDelta = 64;
+
+  uint64_t offset = mOffset + mOutput.size();
+  size_t depth = 0;
+  bool delta = !mPrevFrame.empty() && mPrevDepths[row] < kMaxDeltaDepth &&
+               EncodeDelta(row, scanline, width);
+  if (!delta || mDelta.size() > kSmallDelta) {
+    mOutput.push_back(kPackedScanline);
+    EncodePacked(scanline, width);
+    if (delta && mDelta.size() < mOutput.size() - (offset - mOffset)) {
+      mOutput.resize(offset - mOffset);
+    } else {
+      delta = false;
+    }
+  }
+  if (delta) {
+    mFixups.push_back(mOutput.size() + 1);
+    mOutput.insert(mOutput.end(), mDelta.begin(), mDelta.end());
+    depth = mPrevDepths[row] + 1;
+    mDedupStats.deltaRows++;
+  }
+
+  mPrevOffsets[row] = offset;
+  mPrevDepths[row] = depth;
+  if (!mDedupTable.empty()) {
+    AddToTable(hash, scanline, width, offset, depth);
+  }
+}
+
+// Finds the vertical shift, within kMaxShift rows, that lines up the most
+// changed rows with rows of the previous frame. Each changed row votes for
+// the distance to the previous row with the same hash; rows whose hash is
+// shared, like blank ones, don't vote.
+int
+Encoder::EstimateShift()
+{
+  size_t numRows = mRowStarts.size();
+
+  mShiftRows.clear();
+  for (size_t row = 0; row < numRows; row++) {
+    if (mStaleRows[row]) {
+      continue;
+    }
+    auto inserted = mShiftRows.insert(std::make_pair(mPrevHashes[row], row));
+    if (!inserted.second) {
+      inserted.first->second = SIZE_MAX;
+    }
+  }
+
+  mShiftVotes.assign(2 * kMaxShift + 1, 0);
+  for (size_t row = 0; row < numRows; row++) {
+    if (mUnchanged[row]) {
+      continue;
+    }
+    auto match = mShiftRows.find(mHashes[row]);
+    if (match == mShiftRows.end() || match->second == SIZE_MAX ||
+        mRowRegions[match->second] != mRowRegions[row]) {
+      continue;
+    }
+    ptrdiff_t shift = ptrdiff_t(match->second) - ptrdiff_t(row);
+    if (shift && size_t(std::abs(shift)) <= kMaxShift) {
+      mShiftVotes[shift + kMaxShift]++;
+    }
+  }
+
+  size_t best = kMaxShift;
+  for (size_t i = 0; i < mShiftVotes.size(); i++) {
+    if (mShiftVotes[i] > mShiftVotes[best]) {
+      best = i;
+    }
+  }
+  return mShiftVotes[best] >= kMinShiftRows ? int(best) - int(kMaxShift) : 0;
+}
+
+// Stores a frame as rows, each reused, copied or encoded.
+void
+Encoder::EncodeRows(const char* frame, uint64_t frameOffset)
+{
+  // Rows unchanged since the previous frame are the common case, so they are
+  // found first, with a plain compare. Rows changed by tiled frames since the
+  // last row frame are stored again, as their last records hold older
+  // pixels, though they may still be found in the hash table.
+  size_t numRows = mRowStarts.size();
+  size_t numUnchanged = 0;
+  for (size_t row = 0; row < numRows; row++) {
+    mUnchanged[row] = !mPrevFrame.empty() && !mStaleRows[row] &&
+      memcmp(&mPrevFrame[mRowStarts[row]], frame + mRowStarts[row], mRowWidths[row]) == 0;
+    numUnchanged += mUnchanged[row];
+    mHashes[row] = mUnchanged[row] ? mPrevHashes[row]
+                                   : HashScanline(frame + mRowStarts[row], mRowWidths[row]);
+  }
+  mDedupStats.rows += numRows;
+  mDedupStats.previousRowHits += numUnchanged;
+
+  if (numUnchanged == numRows && !mPrevFrame.empty()) {
+    PushOffset(kCopyFrame, mSourceFrameOffset);
+    mDedupStats.copiedFrames++;
+    return;
+  }
+
+  // A scrolled frame is mostly the previous one moved up or down. Rows that
+  // moved are copied from the previous frame, and take over the records of
+  // the rows they came from, so the source rows' state is kept before it is
+  // overwritten.
+  if (!mPrevFrame.empty() && numRows - numUnchanged >= kMinShiftRows) {
+    mShift = EstimateShift();
+  }
+  size_t numShifted = 0;
+  for (size_t row = 0; row < numRows; row++) {
+    size_t source = row + mShift;
+    mShifted[row] = mShift && mOverlayDepth < kMaxOverlayDepth && !mUnchanged[row] &&
+      source < numRows && mRowRegions[source] == mRowRegions[row] &&
+      !mStaleRows[source] && mPrevHashes[source] == mHashes[row] &&
+      memcmp(&mPrevFrame[mRowStarts[source]], frame + mRowStarts[row], mRowWidths[row]) == 0;
+    numShifted += mShifted[row];
+  }
+  if (numShifted) {
+    PushOffset(kScrollFrame, mSourceFrameOffset);
+    PushUint16(&mOutput, uint16_t(int16_t(mShift)));
+    mSourceOffsets = mPrevOffsets;
+    mSourceDepths = mPrevDepths;
+    mSourceHomeFrames = mHomeFrames;
+    mSourceHomeOffsets = mHomeOffsets;
+    mSourceHomeRows = mHomeRows;
+    mOverlayDepth++;
+    mDedupStats.scrolledFrames++;
+    mDedupStats.shiftedRows += numShifted;
+  } else {
+    mOverlayDepth = 0;
+  }
+  mSourceFrameOffset = frameOffset;
+
+  for (size_t row = 0; row < numRows; row++) {
+    if (mStaleRows[row]) {
+      mPrevDepths[row] = kMaxDeltaDepth;
+      mStaleRows[row] = false;
+    }
+  }
+
+  size_t row = 0;
+  while (row < numRows) {
+    // Runs of unchanged rows whose records are next to each other in one
+    // frame, and runs of moved rows, are stored with one record.
+    size_t end = row + 1;
+    if (mUnchanged[row]) {
+      while (end < numRows && end - row < UINT16_MAX && mUnchanged[end] &&
+             mHomeFrames[end] == mHomeFrames[row] &&
+             mHomeRows[end] == mHomeRows[end - 1] + 1) {
+        end++;
+      }
+    } else if (mShifted[row]) {
+      while (end < numRows && end - row < UINT16_MAX && mShifted[end]) {
+        end++;
+      }
+    }
+
+    if (mShifted[row]) {
+      mOutput.push_back(kShiftRows);
+      PushUint16(&mOutput, end - row);
+      for (size_t i = row; i < end; i++) {
+        size_t source = i + mShift;
+        mPrevOffsets[i] = mSourceOffsets[source];
+        mPrevDepths[i] = mSourceDepths[source];
+        mHomeFrames[i] = mSourceHomeFrames[source];
+        mHomeOffsets[i] = mSourceHomeOffsets[source];
+        mHomeRows[i] = mSourceHomeRows[source];
+      }
+    } else if (end - row > 1) {
+      PushOffset(kCopyRows, mHomeOffsets[row]);
+      PushUint16(&mOutput, end - row);
+    } else {
+      mHomeFrames[row] = mNumFrames;
+      mHomeOffsets[row] = mOffset + mOutput.size();
+      mHomeRows[row] = row;
+      if (mUnchanged[row]) {
+        PushOffset(kReuseScanline, mPrevOffsets[row]);
+      } else {
+        EncodeScanline(row, frame + mRowStarts[row], mHashes[row]);
+      }
+    }
+    row = end;
+  }
+
+  mPrevFrame.assign(frame, frame + mFrameSize);
+  mPrevHashes.swap(mHashes);
+}
+
+// Most rows of a frame don't change, so each row of a band of tiles is
+// compared whole first, and only rows that differ are compared tile by tile.
+void
+Encoder::FindDirtyTiles(const char* frame)
+{
+  const ScanlineKernel* kernel = GetScanlineKernel();
+  const uint8_t* prev = reinterpret_cast<const uint8_t*>(mPrevFrame.data());
+  const uint8_t* next = reinterpret_cast<const uint8_t*>(frame);
+
+  mDirtyTiles.clear();
+  size_t band = 0;
+  while (band < mTiles.size()) {
+    const Tile& first = mTiles[band];
+    size_t end = band + 1;
+    while (end < mTiles.size() && mTiles[end].row == first.row) {
+      end++;
+    }
+    size_t numDirty = mDirtyTiles.size();
+
+    for (size_t y = 0; y < first.height && mDirtyTiles.size() - numDirty < end - band; y++) {
+      size_t start = first.start + y * first.stride;
+      if (memcmp(prev + start, next + start, first.stride) == 0) {
+        continue;
+      }
+
+      // Tiles already found stay in order, and so does the band.
+      size_t found = numDirty;
+      for (size_t i = band; i < end; i++) {
+        if (found < mDirtyTiles.size() && mDirtyTiles[found] == i) {
+          found++;
+          continue;
+        }
+        size_t x = mTiles[i].start - first.start;
+        if (kernel->spanDiffers(prev + start + x, next + start + x, mTiles[i].width)) {
+          mDirtyTiles.insert(mDirtyTiles.begin() + found, i);
+          found++;
+        }
+      }
+    }
+    band = end;
+  }
+}
+
+// Stores a frame as the tiles FindDirtyTiles() found, drawn over the
+// previous frame.
+void
+Encoder::EncodeTiles(const char* frame, uint64_t frameOffset)
+{
+  if (mDirtyTiles.empty()) {
+    PushOffset(kCopyFrame, mSourceFrameOffset);
+    mDedupStats.copiedFrames++;
+    return;
+  }
+
+  PushOffset(kTileFrame, mSourceFrameOffset);
+  PushUint16(&mOutput, mTileSize);
+  uint32_t count = mDirtyTiles.size();
+  const char* p = reinterpret_cast<const char*>(&count);
+  mOutput.insert(mOutput.end(), p, p + sizeof(count));
+
+  for (uint32_t index : mDirtyTiles) {
+    const Tile& tile = mTiles[index];
+    p = reinterpret_cast<const char*>(&index);
+    mOutput.insert(mOutput.end(), p, p + sizeof(index));
+
+    // Pixels left alone become runs of zeros however busy the picture is.
+    char* pixels = mTilePixels.data();
+    for (size_t y = 0; y < tile.height; y++) {
+      const char* source = frame + tile.start + y * tile.stride;
+      char* prev = &mPrevFrame[tile.start + y * tile.stride];
+      for (size_t x = 0; x < tile.width; x++) {
+        pixels[y * tile.width + x] = source[x] ^ prev[x];
+      }
+      memcpy(prev, source, tile.width);
+      mStaleRows[tile.row + y] = true;
+    }
+    EncodePacked(pixels, tile.width * tile.height);
+  }
+
+  mSourceFrameOffset = frameOffset;
+  mOverlayDepth++;
+  mDedupStats.tileFrames++;
+  mDedupStats.tiles += mTiles.size();
+  mDedupStats.dirtyTiles += mDirtyTiles.size();
+}
+
+void
+Encoder::AddFrame(const char* frame, int64_t timeNs)
+{
+  size_t segmentFrames = mNumFrames - mSegmentFirstFrame;
+  if (segmentFrames &&
+      ((mMaxSegmentFrames && segmentFrames >= mMaxSegmentFrames) ||
+       (mMaxSegmentBytes && mOffset + mOutput.size() >= mMaxSegmentBytes))) {
+    CloseSegment();
+    OpenSegment();
+    segmentFrames = 0;
+  }
+
+  if (!segmentFrames) {
+    mSegmentFirstNs = timeNs;
+  }
+  mSegmentLastNs = timeNs;
+
+  // A sync point starts a chunk, and forgets every frame before it.
+  bool sync = segmentFrames == 0 || (mSyncInterval && segmentFrames % mSyncInterval == 0);
+  if (sync && segmentFrames) {
+    FlushChunk();
+    ForgetFrames();
+  }
+
+  // The chunk's header is filled in when it is written.
+  if (mOutput.empty()) {
+    mChunkOffset = mOffset;
+    mChunkFirstFrame = mFrameEntries.size();
+    mChunkFlags = sync ? kPopChunkSync : 0;
+    mOutput.resize(sizeof(PopChunkHeader));
+  }
+
+  uint64_t frameOffset = mOffset + mOutput.size();
+  mFrameEntries.push_back(PopFrameEntry { frameOffset, timeNs });
+  EncodeFrame(frame, frameOffset);
+
+  if (mMotionFile) {
+    int32_t shift = mShift;
+    if (fwrite(&shift, sizeof(shift), 1, mMotionFile) != 1) {
+      Fail("write failed");
+    }
+  }
+
+  mNumFrames++;
+  if (mOutput.size() >= kPopChunkBytes ||
+      mFrameEntries.size() - mChunkFirstFrame >= kPopChunkFrames) {
+    FlushChunk();
+  }
+}
+
+void
+Encoder::EncodeFrame(const char* frame, uint64_t frameOffset)
+{
+  mShift = 0;
+  if (mTileSize && !mPrevFrame.empty()) {
+    FindDirtyTiles(frame);
+  }
+
+  // When most tiles change, as in a scroll, rows are likely to do better.
+  if (mTileSize && !mPrevFrame.empty() &&
+      (mDirtyTiles.empty() ||
+       (mOverlayDepth < kMaxOverlayDepth && mDirtyTiles.size() * 2 < mTiles.size()))) {
+    EncodeTiles(frame, frameOffset);
+  } else {
+    EncodeRows(frame, frameOffset);
+  }
+}
+
+void
+Encoder::EncodeChunk(const char* frames, size_t numFrames, size_t firstFrame,
+                     EncodedChunk* chunk)
+{
+  Prepare();
+  ForgetFrames();
+  mDedupStats = DedupStats();
+  mNumFrames = firstFrame;
+
+  // Offsets are from the start of the chunk's header until AddChunk() moves
+  // them.
+  mOffset = 0;
+  mOutput.clear();
+  mOutput.resize(sizeof(PopChunkHeader));
+  mFixups.clear();
+  chunk->frames.clear();
+  chunk->shifts.clear();
+  for (size_t i = 0; i < numFrames; i++) {
+    uint64_t frameOffset = mOutput.size();
+    chunk->frames.push_back(PopFrameEntry { frameOffset, 0 });
+    EncodeFrame(frames + i * mFrameSize, frameOffset);
+    chunk->shifts.push_back(mShift);
+    mNumFrames++;
+  }
+
+  chunk->data.swap(mOutput);
+  chunk->fixups.swap(mFixups);
+  chunk->stats = mDedupStats;
+}
+
+void
+Encoder::AddChunk(EncodedChunk* chunk)
+{
+  FlushChunk();
+
+  uint64_t base = mOffset;
+  char* data = chunk->data.data();
+  for (uint32_t at : chunk->fixups) {
+    uint64_t offset;
+    memcpy(&offset, data + at, sizeof(offset));
+    offset += base;
+    memcpy(data + at, &offset, sizeof(offset));
+  }
+
+  mChunkOffset = base;
+  mChunkFirstFrame = mFrameEntries.size();
+  mChunkFlags = kPopChunkSync;
+  for (const PopFrameEntry& entry : chunk->frames) {
+    mFrameEntries.push_back(PopFrameEntry { entry.offset + base, entry.timeNs });
+  }
+  if (mMotionFile && !chunk->shifts.empty() &&
+      fwrite(chunk->shifts.data(), sizeof(int32_t), chunk->shifts.size(),
+             mMotionFile) != chunk->shifts.size()) {
+    Fail("write failed");
+  }
+  mDedupStats.Add(chunk->stats);
+  mNumFrames += chunk->frames.size();
+
+  mOutput.swap(chunk->data);
+  FlushChunk();
+
+  // Frames added after this one mustn't refer to what came before it.
+  ForgetFrames();
+}
+
+void
+Encoder::FlushChunk()
+{
+  if (mOutput.empty()) {
+    return;
+  }
+
+  PopChunkEntry entry;
+  entry.offset = mChunkOffset;
+  entry.length = mOutput.size() - sizeof(PopChunkHeader);
+  entry.firstFrame = mChunkFirstFrame;
+  entry.numFrames = mFrameEntries.size() - mChunkFirstFrame;
+  entry.checksum = PopChecksum(mOutput.data() + sizeof(PopChunkHeader), entry.length);
+  entry.flags = mChunkFlags;
+  mChunkEntries.push_back(entry);
+
+  PopChunkHeader header;
+  memcpy(header.magic, "PCHK", 4);
+  header.numFrames = entry.numFrames;
+  header.length = entry.length;
+  header.firstFrame = entry.firstFrame;
+  header.checksum = entry.checksum;
+  memcpy(mOutput.data(), &header, sizeof(header));
+
+  WriteFully(mPopFile, mOutput.data(), mOutput.size());
+  mOffset += mOutput.size();
+  mOutput.clear();
+  mFixups.clear();
+}
+
+void
+Encoder::Close()
+{
+  if (mPopFile != -1) {
+    CloseSegment();
+  }
+  if (mManifest) {
+    fclose(mManifest);
+    mManifest = nullptr;
+  }
+  if (mMotionFile) {
+    fclose(mMotionFile);
+    mMotionFile = nullptr;
+  }
+}
+
+void
+Encoder::CloseSegment()
+{
+  FlushChunk();
+
+  // The footer: frame entries, chunk entries and the trailer that finds them.
+  std::vector<char> footer;
+  const char* p = reinterpret_cast<const char*>(mFrameEntries.data());
+  footer.insert(footer.end(), p, p + mFrameEntries.size() * sizeof(PopFrameEntry));
+  p = reinterpret_cast<const char*>(mChunkEntries.data());
+  footer.insert(footer.end(), p, p + mChunkEntries.size() * sizeof(PopChunkEntry));
+
+  PopTrailer trailer;
+  trailer.framesOffset = mOffset;
+  trailer.numFrames = mFrameEntries.size();
+  trailer.chunksOffset = mOffset + mFrameEntries.size() * sizeof(PopFrameEntry);
+  trailer.numChunks = mChunkEntries.size();
+  trailer.checksum = PopChecksum(footer.data(), footer.size());
+  trailer.reserved = 0;
+  memcpy(trailer.magic, "PIDX", 4);
+  p = reinterpret_cast<const char*>(&trailer);
+  footer.insert(footer.end(), p, p + sizeof(trailer));
+
+  WriteFully(mPopFile, footer.data(), footer.size());
+  mOffset += footer.size();
+  close(mPopFile);
+  mPopFile = -1;
+
+  if (mManifest) {
+    fprintf(mManifest, "%s %zu %zu %llu %lld %lld\n",
+            BaseName(SegmentName(mPopName, mNumSegments)),
+            mSegmentFirstFrame, mNumFrames - mSegmentFirstFrame,
+            (unsigned long long)mOffset,
+            (long long)mSegmentFirstNs, (long long)mSegmentLastNs);
+    fflush(mManifest);
+  }
+
+  mClosedBytes += mOffset;
+  mOffset = 0;
+  mNumSegments++;
+}
+
+EncoderThread::EncoderThread(size_t width, size_t height, size_t poolSize,
+                             const std::vector<Region>& regions)
+ : mEncoder(width, height, regions)
+ , mPool(mEncoder.FrameSize(), poolSize)
+ , mFinishing(false)
+{
+}
+
+EncoderThread::~EncoderThread()
+{
+  Finish();
+}
+
+void
+EncoderThread::Start(const char* popName)
+{
+  mEncoder.Open(popName);
+  mThread = std::thread(&EncoderThread::Run, this);
+}
+
+void
+EncoderThread::PinToCpu(int cpu)
+{
+  PinThread(mThread, cpu);
+}
+
+char*
+EncoderThread::GetBuffer()
+{
+  return mPool.Get();
+}
+
+void
+EncoderThread::SubmitBuffer(char* buffer, int64_t timeNs)
+{
+  {
+    std::lock_guard<std::mutex> guard(mMutex);
+    mPendingBuffers.push_back(std::make_pair(buffer, timeNs));
+  }
+  mCondVar.notify_one();
+}
+
+void
+EncoderThread::ReturnBuffer(char* buffer)
+{
+  mPool.Put(buffer);
+}
+
+void
+EncoderThread::Finish()
+{
+  {
+    std::lock_guard<std::mutex> guard(mMutex);
+    mFinishing = true;
+  }
+  mCondVar.notify_one();
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+  mEncoder.Close();
+}
+
+void
+EncoderThread::Run()
+{
+  for (;;) {
+    char* buffer;
+    int64_t timeNs;
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mCondVar.wait(lock, [this] { return mFinishing || !mPendingBuffers.empty(); });
+      if (mPendingBuffers.empty()) {
+        return;
+      }
+      buffer = mPendingBuffers.front().first;
+      timeNs = mPendingBuffers.front().second;
+      mPendingBuffers.pop_front();
+    }
+
+    uint64_t start = NowNs();
+    mEncoder.AddFrame(buffer, timeNs);
+    mEncodeStats.Add(NowNs() - start);
+
+    mPool.Put(buffer);
+  }
+}
+
+void
+WriteCompressed(const char* popName, int width, int height, const FrameReader& readFrames,
+                size_t tileSize, const char* motionName,
+                size_t threads, size_t chunkFrames)
+{
+  // Every chunk starts a sync point.
+  Encoder encoder(width, height);
+  encoder.SetTileSize(tileSize);
+  encoder.SetSyncInterval(chunkFrames);
+  encoder.SetCreationTime(0);
+  if (motionName) {
+    encoder.SetMotionName(motionName);
+  }
+  encoder.Open(popName);
+
+  size_t frameSize = size_t(width) * size_t(height);
+  threads = std::max<size_t>(1, threads);
+
+  // A reader thread reads chunks in order, workers encode them and this
+  // thread writes them out in order. Chunks are numbered from |written|, the
+  // first one not written yet, in |pending|, which holds at most
+  // |maxPending| of them; their frame buffers are reused.
+  struct PendingChunk
+  {
+    std::vector<char> frames;
+    size_t numFrames;
+    std::unique_ptr<EncodedChunk> encoded;
+  };
+  std::mutex mutex;
+  std::condition_variable condVar;
+  std::deque<PendingChunk> pending;
+  std::vector<std::vector<char>> spareFrames;
+  size_t numRead = 0;
+  size_t nextChunk = 0;
+  size_t written = 0;
+  bool endOfInput = false;
+  const size_t maxPending = threads + 1;
+
+  auto read = [&]() {
+    for (;;) {
+      std::vector<char> frames;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condVar.wait(lock, [&] { return pending.size() < maxPending; });
+        if (!spareFrames.empty()) {
+          frames.swap(spareFrames.back());
+          spareFrames.pop_back();
+        }
+      }
+
+      frames.resize(chunkFrames * frameSize);
+      size_t numFrames = readFrames(frames.data(), chunkFrames);
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (numFrames) {
+          pending.push_back(PendingChunk { std::move(frames), numFrames, nullptr });
+          numRead++;
+        } else {
+          endOfInput = true;
+        }
+      }
+      condVar.notify_all();
+      if (!numFrames) {
+        return;
+      }
+    }
+  };
+
+  auto work = [&]() {
+    Encoder worker(width, height);
+    worker.SetTileSize(tileSize);
+    for (;;) {
+      size_t i;
+      PendingChunk* chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condVar.wait(lock, [&] { return nextChunk < numRead || endOfInput; });
+        if (nextChunk == numRead) {
+          return;
+        }
+        i = nextChunk++;
+        chunk = &pending[i - written];
+      }
+
+      std::unique_ptr<EncodedChunk> encoded(new EncodedChunk);
+      worker.EncodeChunk(chunk->frames.data(), chunk->numFrames, i * chunkFrames,
+                         encoded.get());
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        chunk->encoded = std::move(encoded);
+      }
+      condVar.notify_all();
+    }
+  };
+
+  uint64_t start = NowNs();
+  std::thread reader(read);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(work);
+  }
+
+  size_t numFrames = 0;
+  for (;;) {
+    std::unique_ptr<EncodedChunk> encoded;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condVar.wait(lock, [&] {
+        return (!pending.empty() && pending.front().encoded) ||
+               (endOfInput && written == numRead);
+      });
+      if (pending.empty()) {
+        break;
+      }
+      encoded = std::move(pending.front().encoded);
+    }
+    encoder.AddChunk(encoded.get());
+    numFrames += encoded->frames.size();
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      spareFrames.push_back(std::move(pending.front().frames));
+      pending.pop_front();
+      written++;
+    }
+    condVar.notify_all();
+  }
+
+  reader.join();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  uint64_t elapsedNs = NowNs() - start;
+
+  encoder.Close();
+
+  const DedupStats& dedup = encoder.GetDedupStats();
+  fprintf(stderr, "Encoded %zu frames on %zu thread%s: %.1f bytes/frame, %.1f MB/s\n",
+          numFrames, threads, threads == 1 ? "" : "s",
+          numFrames ? double(encoder.BytesWritten()) / numFrames : 0,
+          elapsedNs ? double(numFrames) * frameSize / (elapsedNs / 1000.0) : 0);
+  fprintf(stderr, "Reused %.1f%% of rows (%.1f%% from the previous frame's row), "
+          "%.1f%% stored as deltas\n",
+          dedup.HitRate() * 100,
+          dedup.rows ? dedup.previousRowHits * 100.0 / dedup.rows : 0,
+          dedup.rows ? dedup.deltaRows * 100.0 / dedup.rows : 0);
+  fprintf(stderr, "%llu frames were the same as the one before\n",
+          (unsigned long long)dedup.copiedFrames);
+  if (dedup.scrolledFrames) {
+    fprintf(stderr, "%llu frames scrolled, %.1f%% of rows stored as moved\n",
+            (unsigned long long)dedup.scrolledFrames,
+            dedup.shiftedRows * 100.0 / dedup.rows);
+  }
+  if (dedup.tileFrames) {
+    fprintf(stderr, "%llu frames stored as tiles, %.1f%% of their tiles changed\n",
+            (unsigned long long)dedup.tileFrames,
+            dedup.dirtyTiles * 100.0 / dedup.tiles);
+  }
+}
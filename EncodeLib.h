@@ -0,0 +1,519 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef EncodeLib_h
+#define EncodeLib_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stdio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "BufferPool.h"
+#include "PopFormat.h"
+#include "Region.h"
+#include "Stats.h"
+
+// Scanline record types in the .pop file. A kNewScanline record is followed by
+// run-length encoded (count, byte) pairs covering one row of the frame. A
+// kReuseScanline record is followed by the 64-bit offset of an earlier record
+// whose pixels should be used instead.
+//
+// Files written before kPackedScanline existed use kNewScanline; the encoder
+// only writes kPackedScanline records now. These hold a row as a series of
+// runs and literals, each starting with a token byte T:
+//
+//   T < 128          T + 1 literal bytes follow
+//   128 <= T < 255   a run of T - 125 (3 to 129) copies of the next byte
+//   T == 255         a 16-bit length L and a byte follow: a run of L + 130
+//
+// so noisy rows cost little more than their size, and long runs of any
+// length up to the widest row take four bytes.
+//
+// A kDeltaScanline record is followed by the 64-bit offset of an earlier
+// record, usually the same row of the previous frame, and a 16-bit span
+// count. Each span is a 16-bit count of bytes left as they are in the
+// earlier row, a 16-bit length and that many new bytes.
+//
+// Two records stand for several rows that are unchanged since the previous
+// frame. A decoder that still has the previous frame can skip them; one that
+// doesn't can follow the offset. A kCopyRows record is followed by the
+// 64-bit offset of a run of single-row records in an earlier frame and a
+// 16-bit row count, and replaces that many rows. A kCopyFrame record is
+// followed by the 64-bit offset of an earlier frame that was not itself a
+// kCopyFrame, and replaces the whole frame.
+//
+// A scrolled frame starts with a kScrollFrame record, followed by the 64-bit
+// offset of the frame before it, as for kCopyFrame, and the signed 16-bit
+// number of rows the picture moved up; negative is down. Its rows can then
+// include kShiftRows records, each followed by a 16-bit row count, which
+// stand for that many rows taken from the previous frame that many rows
+// further down. A decoder has to keep the previous frame aside to apply them.
+//
+// A kTileFrame record replaces a whole frame with the tiles that changed
+// since an earlier one. It is followed by the 64-bit offset of that frame,
+// a 16-bit tile size and a 32-bit tile count. Each tile is its 32-bit number
+// and its pixels xor-ed with those of the frame before, row after row, in the
+// packed form above. Tiles are numbered row by row over each region in turn,
+// or over the whole picture; those at the right and bottom edges are cut
+// short.
+const char kReuseScanline = 51;
+const char kDeltaScanline = 68;
+const char kCopyFrame = 70;
+const char kCopyRows = 82;
+const char kShiftRows = 83;
+const char kScrollFrame = 77;
+const char kPackedScanline = 80;
+const char kTileFrame = 84;
+const char kNewScanline = 122;
+
+// The name of the run search kernel the encoder uses on this CPU.
+const char*
+ScanlineKernelName();
+
+// Deltas are applied on top of their base, so a row that keeps changing a
+// little builds a chain. After this many links it is stored whole again, to
+// bound the work of decoding a single frame.
+const size_t kMaxDeltaDepth = 16;
+
+// Likewise, kTileFrame and kScrollFrame frames are drawn over the frame before
+// them, so after this many in a row the next changed frame is stored as rows
+// that don't need it.
+const size_t kMaxOverlayDepth = 30;
+
+// How far a frame can scroll between two frames and still be matched with
+// kShiftRows, and how many rows must agree on the distance.
+const size_t kMaxShift = 256;
+const size_t kMinShiftRows = 4;
+
+// A .motion file is an 8-byte header (the magic "PMOT", then uint32 version)
+// followed by an int32 for every frame, little endian: how many rows the
+// picture scrolled up since the previous frame, negative for down, or 0.
+const uint32_t kMotionVersion = 1;
+
+// The largest tile size SetTileSize() accepts.
+const size_t kMaxTileSize = 128;
+
+// A .pop chunk, see PopFormat.h, is written once it holds this many bytes
+// or frames.
+const size_t kPopChunkBytes = 1 << 20;
+const size_t kPopChunkFrames = 256;
+
+// Rows the encoder remembers for reuse beyond the previous frame.
+const size_t kDefaultDedupEntries = 4096;
+
+// How often rows were stored as a kReuseScanline record, and how much of
+// each tiled frame changed.
+struct DedupStats
+{
+  DedupStats()
+   : rows(0), previousRowHits(0), tableHits(0), deltaRows(0), copiedFrames(0)
+   , scrolledFrames(0), shiftedRows(0), tileFrames(0), tiles(0), dirtyTiles(0)
+  {}
+
+  uint64_t rows;
+
+  // Same as the row above it in the previous frame.
+  uint64_t previousRowHits;
+
+  // Found in the hash table: a different row, or an older frame.
+  uint64_t tableHits;
+
+  // Not reused, but stored as the changes to the previous frame's row.
+  uint64_t deltaRows;
+
+  // Frames identical to the previous one.
+  uint64_t copiedFrames;
+
+  // Frames with rows matched to the previous frame's moved up or down, and
+  // how many rows were.
+  uint64_t scrolledFrames;
+  uint64_t shiftedRows;
+
+  // Frames stored as kTileFrame records, the tiles they cover and how many
+  // of those were stored.
+  uint64_t tileFrames;
+  uint64_t tiles;
+  uint64_t dirtyTiles;
+
+  double HitRate() const {
+    return rows ? double(previousRowHits + tableHits) / rows : 0;
+  }
+
+  void Add(const DedupStats& other) {
+    rows += other.rows;
+    previousRowHits += other.previousRowHits;
+    tableHits += other.tableHits;
+    deltaRows += other.deltaRows;
+    copiedFrames += other.copiedFrames;
+    scrolledFrames += other.scrolledFrames;
+    shiftedRows += other.shiftedRows;
+    tileFrames += other.tileFrames;
+    tiles += other.tiles;
+    dirtyTiles += other.dirtyTiles;
+  }
+};
+
+// A chunk of frames encoded without reference to any earlier frame, by
+// Encoder::EncodeChunk(), to be placed in a file by Encoder::AddChunk().
+// Its record offsets are from the start of |data| until then.
+struct EncodedChunk
+{
+  // Room for a PopChunkHeader, then the payload.
+  std::vector<char> data;
+  std::vector<PopFrameEntry> frames;
+
+  // Where in |data| each record offset is, so the chunk can be moved.
+  std::vector<uint32_t> fixups;
+
+  // LastShift() after each frame, for the .motion file.
+  std::vector<int32_t> shifts;
+  DedupStats stats;
+};
+
+// Encodes 8-bit luma frames into a .pop file one frame at a time. In version
+// 1 files, the .idx file held a 16-bit width and height followed by the
+// 64-bit offset of the first scanline of every frame.
+//
+// A recording of regions of interest stores each region's rows in turn
+// instead of the whole picture. A version 1 index header starts with a zero
+// width and the number of regions, then the picture's width and height,
+// then the x, y, width and height of each region, all 16-bit.
+//
+// A segmented recording is split into .pop files that each decode on their
+// own; see SetSegments().
+//
+// Every row is hashed. A row matching the same row of the previous frame,
+// or any row still in a bounded hash table of recent rows, is stored as a
+// reference to it. Matches are checked byte for byte, so a hash collision
+// only costs a miss. Other rows are stored as the bytes that changed since
+// the previous frame when that is smaller than run-length encoding them.
+//
+// When many rows change, the encoder looks for the distance the picture
+// scrolled and stores the rows that moved as references to where they were.
+//
+// In tile mode a changed frame is instead stored as the tiles that differ
+// from the previous frame, so a small change costs a few tiles rather than
+// every row it touches; see SetTileSize().
+class Encoder
+{
+public:
+  Encoder(size_t width, size_t height,
+          const std::vector<Region>& regions = std::vector<Region>());
+  ~Encoder();
+
+  // Starts a new segment once the current one holds |maxFrames| frames or
+  // |maxBytes| bytes of .pop; 0 means no limit. Must be called before Open().
+  void SetSegments(size_t maxFrames, uint64_t maxBytes);
+
+  // Remember up to |entries| rows for reuse, evicting the least recently
+  // used; 0 only reuses the previous frame's rows. Must be called before
+  // Open().
+  void SetDedupEntries(size_t entries);
+
+  // Store frames as the |size| x |size| tiles that changed since the
+  // previous frame, up to kMaxTileSize; 0, the default, stores rows. Must be
+  // called before Open().
+  void SetTileSize(size_t size);
+
+  // The frame rate to record in the header; 0, the default, is unknown.
+  // Must be called before Open().
+  void SetFrameRate(double fps) { mFps = fps; }
+
+  // Start a sync point every |frames| frames, so a reader can start there;
+  // 0, the default, only puts one at the start of each file. Must be called
+  // before Open().
+  void SetSyncInterval(size_t frames) { mSyncInterval = frames; }
+
+  // The wall clock time to record in the header, in nanoseconds since the
+  // epoch; by default, when each file is opened. Must be called before
+  // Open().
+  void SetCreationTime(int64_t ns) { mCreatedNs = ns; }
+
+  // With segments, "video.pop" stands for video.0000.pop, video.0001.pop and
+  // so on, listed in video.segments. Without, "-" writes to stdout.
+  void Open(const char* popName);
+
+  // Write how far each frame scrolled to a .motion file. Must be called
+  // before Open().
+  void SetMotionName(const std::string& name) { mMotionName = name; }
+
+  // |timeNs| is the frame's stream time, kept in the index.
+  void AddFrame(const char* frame, int64_t timeNs = 0);
+  void Close();
+
+  // Encodes |numFrames| consecutive frames, the first of them frame number
+  // |firstFrame|, into a chunk of their own. The result only depends on the
+  // frames and the settings, so chunks can be encoded on several threads,
+  // each with its own Encoder, and still give the same file. Needs no
+  // Open().
+  void EncodeChunk(const char* frames, size_t numFrames, size_t firstFrame,
+                   EncodedChunk* chunk);
+
+  // Writes a chunk from EncodeChunk() at the end of the file. Frames added
+  // later don't refer to the frames before it. Not for segmented
+  // recordings.
+  void AddChunk(EncodedChunk* chunk);
+
+  bool IsSegmented() const { return mMaxSegmentFrames || mMaxSegmentBytes; }
+  size_t NumFrames() const { return mNumFrames; }
+  size_t NumSegments() const { return mNumSegments; }
+  uint64_t BytesWritten() const { return mClosedBytes + mOffset; }
+  const DedupStats& GetDedupStats() const { return mDedupStats; }
+
+  // How many rows the last frame scrolled up, negative for down, or 0.
+  int LastShift() const { return mShift; }
+
+  // The bytes in one frame passed to AddFrame().
+  size_t FrameSize() const { return mFrameSize; }
+
+private:
+  void Prepare();
+  void OpenSegment();
+  void CloseSegment();
+  void ForgetFrames();
+  void FlushChunk();
+  void EncodeFrame(const char* frame, uint64_t frameOffset);
+  void EncodeRows(const char* frame, uint64_t frameOffset);
+  void EncodeTiles(const char* frame, uint64_t frameOffset);
+  void FindDirtyTiles(const char* frame);
+  int EstimateShift();
+  void EncodeScanline(size_t row, const char* scanline, uint64_t hash);
+  void PushOffset(char type, uint64_t offset);
+  void EncodePacked(const char* scanline, size_t width);
+  bool EncodeDelta(size_t row, const char* scanline, size_t maxSize);
+  bool FindInTable(uint64_t hash, const char* scanline, size_t width,
+                   uint64_t* offset, size_t* depth);
+  void AddToTable(uint64_t hash, const char* scanline, size_t width,
+                  uint64_t offset, size_t depth);
+
+  size_t mWidth, mHeight;
+  std::vector<Region> mRegions;
+
+  // Where each stored row starts within a frame, its width and the region
+  // it is in.
+  std::vector<size_t> mRowStarts;
+  std::vector<size_t> mRowWidths;
+  std::vector<size_t> mRowRegions;
+  size_t mFrameSize;
+
+  int mPopFile;
+  double mFps;
+  int64_t mCreatedNs;
+
+  // mOffset is the size of the current .pop file so far; the chunk being
+  // filled, in mOutput, comes after it.
+  uint64_t mOffset;
+  uint64_t mClosedBytes;
+  size_t mNumFrames;
+
+  // The current segment's index, written out when it is closed, and where
+  // the chunk being filled starts and its flags.
+  std::vector<PopFrameEntry> mFrameEntries;
+  std::vector<PopChunkEntry> mChunkEntries;
+  uint64_t mChunkOffset;
+  size_t mChunkFirstFrame;
+  uint32_t mChunkFlags;
+  size_t mSyncInterval;
+
+  std::string mPopName;
+  size_t mMaxSegmentFrames;
+  uint64_t mMaxSegmentBytes;
+  FILE* mManifest;
+  size_t mNumSegments;
+  size_t mSegmentFirstFrame;
+  int64_t mSegmentFirstNs, mSegmentLastNs;
+
+  // The previous frame and, for each of its rows, the offset of the
+  // kPackedScanline or kDeltaScanline record that holds its pixels and the
+  // length of that record's delta chain.
+  std::vector<char> mPrevFrame;
+  std::vector<uint64_t> mPrevOffsets;
+  std::vector<size_t> mPrevDepths;
+
+  // The hash of every row of the previous frame, and of the frame being
+  // encoded.
+  std::vector<uint64_t> mPrevHashes;
+  std::vector<uint64_t> mHashes;
+
+  // For each row, the last frame that stored its pixels in a single-row
+  // record, where that record is and which row it was stored as. Unchanged
+  // rows whose records are for consecutive rows of the same home frame are
+  // adjacent there, so they can be copied with one kCopyRows.
+  std::vector<size_t> mHomeFrames;
+  std::vector<uint64_t> mHomeOffsets;
+  std::vector<size_t> mHomeRows;
+  std::vector<bool> mUnchanged;
+
+  // The distance the frame being encoded scrolled, the rows that match the
+  // previous frame's at that distance, and the previous frame's row state
+  // they are stored from.
+  int mShift;
+  std::vector<bool> mShifted;
+  std::vector<uint64_t> mSourceOffsets;
+  std::vector<size_t> mSourceDepths;
+  std::vector<size_t> mSourceHomeFrames;
+  std::vector<uint64_t> mSourceHomeOffsets;
+  std::vector<size_t> mSourceHomeRows;
+
+  // Scratch space for EstimateShift(): each previous row by hash, and the
+  // votes for each distance.
+  std::unordered_map<uint64_t, size_t> mShiftRows;
+  std::vector<size_t> mShiftVotes;
+
+  std::string mMotionName;
+  FILE* mMotionFile;
+
+  // The last frame that was not a kCopyFrame.
+  uint64_t mSourceFrameOffset;
+
+  // A tile within a stored frame: where it starts, the width of the rows it
+  // is cut from, its first row and its size.
+  struct Tile
+  {
+    size_t start;
+    size_t stride;
+    size_t row;
+    size_t width;
+    size_t height;
+  };
+  size_t mTileSize;
+  std::vector<Tile> mTiles;
+  std::vector<uint32_t> mDirtyTiles;
+  std::vector<char> mTilePixels;
+
+  // Frames drawn over the one before since the last one that wasn't, and the
+  // rows tiled frames changed, whose last records no longer match the
+  // previous frame.
+  size_t mOverlayDepth;
+  std::vector<bool> mStaleRows;
+
+  // A set-associative table of recently stored rows: kDedupWays entries per
+  // set, each with a copy of its pixels in mDedupPixels for checking
+  // matches. An entry's lastUsed is the frame count when it was last hit,
+  // or 0 if the entry is empty.
+  struct DedupEntry
+  {
+    uint64_t hash;
+    uint64_t offset;
+    uint16_t width;
+    uint16_t depth;
+    uint32_t lastUsed;
+  };
+  static const size_t kDedupWays = 4;
+  size_t mDedupEntries;
+  size_t mDedupSetMask;
+  size_t mMaxRowWidth;
+  std::vector<DedupEntry> mDedupTable;
+  std::vector<char> mDedupPixels;
+  DedupStats mDedupStats;
+
+  // Output for the chunk being filled, starting with room for its header;
+  // flushed with one write() per chunk. mFixups lists where in it record
+  // offsets were written.
+  std::vector<char> mOutput;
+  std::vector<uint32_t> mFixups;
+
+  // A delta record, built while deciding whether to use it.
+  std::vector<char> mDelta;
+};
+
+// Encodes frames on a background thread while capture is running. Callers
+// fill buffers taken from a fixed pool and submit them in frame order, so
+// memory use depends on the pool size rather than the recording length.
+class EncoderThread
+{
+public:
+  EncoderThread(size_t width, size_t height, size_t poolSize,
+                const std::vector<Region>& regions = std::vector<Region>());
+  ~EncoderThread();
+
+  // See Encoder::SetSegments(). Call before Start().
+  void SetSegments(size_t maxFrames, uint64_t maxBytes) {
+    mEncoder.SetSegments(maxFrames, maxBytes);
+  }
+
+  // See Encoder::SetDedupEntries(). Call before Start().
+  void SetDedupEntries(size_t entries) { mEncoder.SetDedupEntries(entries); }
+
+  // See Encoder::SetMotionName(). Call before Start().
+  void SetMotionName(const std::string& name) { mEncoder.SetMotionName(name); }
+
+  // See Encoder::SetTileSize(). Call before Start().
+  void SetTileSize(size_t size) { mEncoder.SetTileSize(size); }
+
+  // See Encoder::SetSyncInterval(). Call before Start().
+  void SetSyncInterval(size_t frames) { mEncoder.SetSyncInterval(frames); }
+
+  // See Encoder::SetFrameRate(). Call before Start().
+  void SetFrameRate(double fps) { mEncoder.SetFrameRate(fps); }
+
+  void Start(const char* popName);
+
+  // Call after Start().
+  void PinToCpu(int cpu);
+
+  // Returns a free frame buffer, or nullptr if every buffer is waiting to be
+  // encoded. Never blocks.
+  char* GetBuffer();
+  void SubmitBuffer(char* buffer, int64_t timeNs = 0);
+
+  // Puts back a buffer from GetBuffer() without encoding it.
+  void ReturnBuffer(char* buffer);
+
+  // Encodes the remaining frames and closes the output files.
+  void Finish();
+
+  size_t NumFrames() const { return mEncoder.NumFrames(); }
+  size_t NumSegments() const { return mEncoder.NumSegments(); }
+  uint64_t BytesWritten() const { return mEncoder.BytesWritten(); }
+  size_t FrameSize() const { return mEncoder.FrameSize(); }
+  const DedupStats& GetDedupStats() const { return mEncoder.GetDedupStats(); }
+  const StageStats& EncodeStats() const { return mEncodeStats; }
+
+private:
+  void Run();
+
+  Encoder mEncoder;
+  BufferPool mPool;
+
+  std::mutex mMutex;
+  std::condition_variable mCondVar;
+  std::deque<std::pair<char*, int64_t>> mPendingBuffers;
+  bool mFinishing;
+
+  std::thread mThread;
+
+  StageStats mEncodeStats;
+};
+
+// Frames per chunk WriteCompressed() encodes on its own.
+const size_t kDefaultParallelChunkFrames = 60;
+
+// Fills |frames| with up to |maxFrames| frames and returns how many it read,
+// or 0 once there are no more.
+typedef std::function<size_t(char* frames, size_t maxFrames)> FrameReader;
+
+// Encodes the frames |readFrames| gives into a .pop file on |threads|
+// threads, each encoding a chunk of |chunkFrames| frames at a time. The next
+// chunk is read while the ones before it are encoded, and no more than
+// |threads| + 1 chunks of frames are held at once, so memory doesn't grow
+// with the length of the input. Chunks don't refer to each other, and the
+// header has no creation time, so the file is the same whatever the number
+// of threads. A summary is printed to stderr, so the file can go to stdout.
+void
+WriteCompressed(const char* popName, int width, int height, const FrameReader& readFrames,
+                size_t tileSize = 0, const char* motionName = nullptr,
+                size_t threads = 1,
+                size_t chunkFrames = kDefaultParallelChunkFrames);
+
+#endif // EncodeLib_h
@@ -0,0 +1,318 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "FrameSource.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "Stats.h"
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+static const char*
+MapFile(const std::string& name, size_t* length)
+{
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    Fail("unable to open input file");
+  }
+
+  struct stat stbuf;
+  fstat(fd, &stbuf);
+  *length = stbuf.st_size;
+
+  char* buffer = (char*)mmap(nullptr, *length,
+                             PROT_READ,
+                             MAP_FILE | MAP_PRIVATE,
+                             fd, 0);
+  if (buffer == MAP_FAILED) {
+    Fail("mmap failed");
+  }
+
+  close(fd);
+  return buffer;
+}
+
+size_t
+RowBytes(PixelFormat format, size_t width)
+{
+  return format == kPixelFormatARGB ? width * 4 : width * 2;
+}
+
+const char*
+PixelFormatName(PixelFormat format)
+{
+  return format == kPixelFormatARGB ? "argb" : "uyvy";
+}
+
+PixelFormat
+ParsePixelFormat(const char* name)
+{
+  if (strcmp(name, "argb") == 0) {
+    return kPixelFormatARGB;
+  }
+  if (strcmp(name, "uyvy") == 0) {
+    return kPixelFormatUYVY;
+  }
+  Fail("unknown pixel format");
+  return kPixelFormatARGB;
+}
+
+const size_t kBoxSize = 64;
+const uint8_t kBackgroundLuma = 0x30;
+const uint8_t kBoxLuma = 0xe0;
+
+const int16_t kClickAmplitude = 8000;
+const size_t kClickLength = 48;
+
+SyntheticFrameSource::SyntheticFrameSource(const SyntheticOptions& options)
+ : mOptions(options)
+ , mSink(nullptr)
+ , mVideoFile(nullptr)
+ , mVideoFileLength(0)
+ , mAudioFile(nullptr)
+ , mAudioFileLength(0)
+ , mAudioFileOffset(0)
+ , mSlots(new Slot[options.numBuffers])
+ , mStopped(false)
+ , mFramesDelivered(0)
+ , mFramesDropped(0)
+{
+  size_t frameSize = RowBytes(mOptions.format, mOptions.width) * mOptions.height;
+
+  if (!mOptions.videoFile.empty()) {
+    mVideoFile = MapFile(mOptions.videoFile, &mVideoFileLength);
+    if (mVideoFileLength < frameSize) {
+      Fail("video file is smaller than one frame");
+    }
+  }
+
+  if (!mOptions.audioFile.empty()) {
+    mAudioFile = MapFile(mOptions.audioFile, &mAudioFileLength);
+    mAudioFileLength -= mAudioFileLength % (sizeof(int16_t) * kAudioChannels);
+    if (!mAudioFileLength) {
+      Fail("audio file is empty");
+    }
+  }
+
+  for (size_t i = 0; i < mOptions.numBuffers; i++) {
+    Slot* slot = &mSlots[i];
+    if (!mVideoFile) {
+      slot->frame.resize(frameSize);
+      FillRect(slot, 0, 0, mOptions.width, mOptions.height, kBackgroundLuma);
+    }
+  }
+}
+
+SyntheticFrameSource::~SyntheticFrameSource()
+{
+  Stop();
+
+  if (mVideoFile) {
+    munmap((void*)mVideoFile, mVideoFileLength);
+  }
+  if (mAudioFile) {
+    munmap((void*)mAudioFile, mAudioFileLength);
+  }
+}
+
+void
+SyntheticFrameSource::Start(FrameSink* sink)
+{
+  mSink = sink;
+  mStopped = false;
+  mThread = std::thread(&SyntheticFrameSource::Run, this);
+}
+
+void
+SyntheticFrameSource::Stop()
+{
+  mStopped = true;
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+/* static */ void
+SyntheticFrameSource::AddRefSlot(void* slot)
+{
+  static_cast<Slot*>(slot)->refCount++;
+}
+
+/* static */ void
+SyntheticFrameSource::ReleaseSlot(void* slot)
+{
+  static_cast<Slot*>(slot)->refCount--;
+}
+
+SyntheticFrameSource::Slot*
+SyntheticFrameSource::GetFreeSlot()
+{
+  for (size_t i = 0; i < mOptions.numBuffers; i++) {
+    if (mSlots[i].refCount == 0) {
+      return &mSlots[i];
+    }
+  }
+  return nullptr;
+}
+
+void
+SyntheticFrameSource::FillRect(Slot* slot, size_t x, size_t y, size_t w, size_t h, uint8_t luma)
+{
+  size_t rowBytes = RowBytes(mOptions.format, mOptions.width);
+
+  for (size_t row = y; row < y + h && row < mOptions.height; row++) {
+    char* p = &slot->frame[row * rowBytes];
+    for (size_t col = x; col < x + w && col < mOptions.width; col++) {
+      if (mOptions.format == kPixelFormatARGB) {
+        p[col * 4 + 0] = char(0xff);
+        p[col * 4 + 1] = luma;
+        p[col * 4 + 2] = luma;
+        p[col * 4 + 3] = luma;
+      } else {
+        p[col * 2 + 0] = char(0x80);
+        p[col * 2 + 1] = luma;
+      }
+    }
+  }
+}
+
+// Draws a box bouncing across the middle of an otherwise static screen, so
+// most scanlines repeat from frame to frame as they would on a desktop.
+void
+SyntheticFrameSource::GenerateVideo(Slot* slot, size_t frameNumber)
+{
+  size_t width = mOptions.width;
+  size_t y = (mOptions.height - kBoxSize) / 2;
+  size_t travel = width > kBoxSize ? width - kBoxSize : 1;
+
+  size_t x = (frameNumber * 8) % (travel * 2);
+  if (x >= travel) {
+    x = travel * 2 - x;
+  }
+
+  if (slot->boxX >= 0) {
+    FillRect(slot, slot->boxX, y, kBoxSize, kBoxSize, kBackgroundLuma);
+  }
+  FillRect(slot, x, y, kBoxSize, kBoxSize, kBoxLuma);
+  slot->boxX = x;
+}
+
+void
+SyntheticFrameSource::GenerateAudio(Slot* slot, size_t frameNumber, size_t sampleFrames)
+{
+  std::vector<int16_t>& audio = slot->audio;
+  audio.resize(sampleFrames * kAudioChannels);
+
+  if (mAudioFile) {
+    char* output = reinterpret_cast<char*>(audio.data());
+    size_t remaining = audio.size() * sizeof(int16_t);
+    while (remaining) {
+      size_t n = std::min(remaining, mAudioFileLength - mAudioFileOffset);
+      memcpy(output, mAudioFile + mAudioFileOffset, n);
+      output += n;
+      remaining -= n;
+      mAudioFileOffset = (mAudioFileOffset + n) % mAudioFileLength;
+    }
+    return;
+  }
+
+  // Low-level noise, well below the marker threshold.
+  uint32_t seed = uint32_t(frameNumber) * 2654435761u + 1;
+  for (size_t i = 0; i < audio.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    audio[i] = int16_t((seed >> 16) % 41) - 20;
+  }
+
+  if (mOptions.markerInterval && frameNumber % mOptions.markerInterval == 0) {
+    size_t start = (frameNumber * 37) % (sampleFrames - std::min(sampleFrames, kClickLength) + 1);
+    for (size_t i = start; i < start + kClickLength && i < sampleFrames; i++) {
+      audio[i * kAudioChannels] = (i - start) % 2 ? -kClickAmplitude : kClickAmplitude;
+    }
+  }
+}
+
+void
+SyntheticFrameSource::Run()
+{
+  size_t width = mOptions.width;
+  size_t height = mOptions.height;
+  size_t rowBytes = RowBytes(mOptions.format, width);
+  size_t frameSize = rowBytes * height;
+
+  int64_t duration = int64_t(kTimeScale / mOptions.fps);
+  size_t sampleFrames = size_t(kAudioSampleRate / mOptions.fps);
+
+  mSink->FormatChanged(width, height, mOptions.format, mOptions.fps);
+
+  auto start = std::chrono::steady_clock::now();
+  auto period = std::chrono::duration<double>(1.0 / mOptions.fps);
+
+  for (size_t n = 0; !mStopped; n++) {
+    if (mOptions.paced) {
+      auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(period * double(n));
+      std::this_thread::sleep_until(deadline);
+    }
+
+    Slot* slot = GetFreeSlot();
+    while (!slot && !mOptions.paced && !mStopped) {
+      std::this_thread::yield();
+      slot = GetFreeSlot();
+    }
+    if (!slot) {
+      mFramesDropped++;
+      continue;
+    }
+
+    BufferOwner owner;
+    owner.object = slot;
+    owner.addRef = AddRefSlot;
+    owner.release = ReleaseSlot;
+
+    VideoFrame video;
+    if (mVideoFile) {
+      size_t numFrames = mVideoFileLength / frameSize;
+      video.bytes = mVideoFile + (n % numFrames) * frameSize;
+    } else {
+      GenerateVideo(slot, n);
+      video.bytes = slot->frame.data();
+    }
+    video.width = width;
+    video.height = height;
+    video.rowBytes = rowBytes;
+    video.format = mOptions.format;
+    video.streamTime = int64_t(n) * duration;
+    video.duration = duration;
+    video.referenceTimeNs = NowNs();
+    video.hasInputSource = true;
+    video.owner = owner;
+
+    GenerateAudio(slot, n, sampleFrames);
+
+    AudioPacket audio;
+    audio.samples = slot->audio.data();
+    audio.sampleFrameCount = sampleFrames;
+    audio.packetTime = video.streamTime;
+    audio.owner = owner;
+
+    // Hold the slot while the sink looks at it.
+    slot->refCount++;
+    mSink->FrameArrived(&video, &audio);
+    slot->refCount--;
+
+    mFramesDelivered++;
+  }
+}
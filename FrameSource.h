@@ -0,0 +1,200 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef FrameSource_h
+#define FrameSource_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Stream and packet times are expressed in these units, matching the
+// timescale we pass to GetStreamTime/GetPacketTime.
+const int64_t kTimeScale = 60000;
+
+const size_t kAudioSampleRate = 48000;
+const size_t kAudioChannels = 2;
+
+enum PixelFormat
+{
+  kPixelFormatARGB, // 32 bits per pixel.
+  kPixelFormatUYVY, // 32 bits for every two pixels.
+};
+
+size_t
+RowBytes(PixelFormat format, size_t width);
+
+const char*
+PixelFormatName(PixelFormat format);
+
+// Parses "argb" or "uyvy", failing on anything else.
+PixelFormat
+ParsePixelFormat(const char* name);
+
+// Whatever owns the memory behind a VideoFrame or AudioPacket. A sink that
+// needs the data after FrameArrived returns takes a reference and releases it
+// when done. A null |object| means the memory lives as long as the source.
+struct BufferOwner
+{
+  void* object;
+  void (*addRef)(void* object);
+  void (*release)(void* object);
+
+  void AddRef() const {
+    if (object) {
+      addRef(object);
+    }
+  }
+
+  void Release() const {
+    if (object) {
+      release(object);
+    }
+  }
+};
+
+struct VideoFrame
+{
+  const char* bytes;
+  size_t width, height;
+  size_t rowBytes;
+  PixelFormat format;
+  int64_t streamTime;
+  int64_t duration;
+
+  // When the frame was captured on a clock shared by every input, so that
+  // recordings from several inputs can be lined up, or 0 if unknown.
+  int64_t referenceTimeNs;
+
+  bool hasInputSource;
+  BufferOwner owner;
+};
+
+// 16-bit interleaved stereo samples.
+struct AudioPacket
+{
+  const int16_t* samples;
+  size_t sampleFrameCount;
+  int64_t packetTime;
+  BufferOwner owner;
+};
+
+// Receives frames from a FrameSource. FrameArrived is called on the source's
+// thread and the data it points to is only valid for the duration of the call,
+// unless the sink takes a reference through the frame's owner.
+class FrameSink
+{
+public:
+  virtual void FormatChanged(size_t width, size_t height,
+                             PixelFormat format, double fps) = 0;
+  virtual void FrameArrived(const VideoFrame* video, const AudioPacket* audio) = 0;
+};
+
+class FrameSource
+{
+public:
+  virtual ~FrameSource() {}
+
+  virtual void Start(FrameSink* sink) = 0;
+  virtual void Stop() = 0;
+};
+
+struct SyntheticOptions
+{
+  SyntheticOptions()
+   : width(1920)
+   , height(1080)
+   , format(kPixelFormatARGB)
+   , fps(60)
+   , paced(true)
+   , markerInterval(60)
+   , numBuffers(8)
+  {}
+
+  size_t width, height;
+  PixelFormat format;
+
+  // Nominal frame rate, used for timestamps and audio packet sizes. Frames
+  // are delivered at this rate if |paced| is set and as fast as the sink
+  // accepts them otherwise.
+  double fps;
+  bool paced;
+
+  // A click is generated on the left audio channel every |markerInterval|
+  // frames.
+  size_t markerInterval;
+
+  // Frames that can be in flight at once.
+  size_t numBuffers;
+
+  // If set, video frames are read from this file of headerless frames in
+  // |format| (e.g. ffmpeg -f rawvideo -pix_fmt argb or uyvy422), looping at
+  // the end. Otherwise a moving test pattern is generated.
+  std::string videoFile;
+
+  // If set, audio is read from this file of 48 kHz s16le stereo samples,
+  // looping at the end. Otherwise generated clicks are used.
+  std::string audioFile;
+};
+
+// Feeds generated or file-backed frames to a sink from its own thread, so the
+// processing pipeline can be exercised without a capture card. Like a card,
+// it delivers frames from a small pool of buffers; when the sink holds on to
+// all of them, paced sources drop the frame and unpaced ones wait.
+class SyntheticFrameSource : public FrameSource
+{
+public:
+  explicit SyntheticFrameSource(const SyntheticOptions& options);
+  virtual ~SyntheticFrameSource();
+
+  virtual void Start(FrameSink* sink);
+  virtual void Stop();
+
+  size_t FramesDelivered() const { return mFramesDelivered; }
+  size_t FramesDropped() const { return mFramesDropped; }
+
+private:
+  struct Slot
+  {
+    Slot() : refCount(0), boxX(-1) {}
+
+    std::atomic<int32_t> refCount;
+    std::vector<char> frame;
+    std::vector<int16_t> audio;
+
+    // Where the box was last drawn into |frame|, or -1.
+    long boxX;
+  };
+
+  static void AddRefSlot(void* slot);
+  static void ReleaseSlot(void* slot);
+
+  void Run();
+
+  Slot* GetFreeSlot();
+  void FillRect(Slot* slot, size_t x, size_t y, size_t w, size_t h, uint8_t luma);
+  void GenerateVideo(Slot* slot, size_t frameNumber);
+  void GenerateAudio(Slot* slot, size_t frameNumber, size_t sampleFrames);
+
+  SyntheticOptions mOptions;
+  FrameSink* mSink;
+
+  const char* mVideoFile;
+  size_t mVideoFileLength;
+  const char* mAudioFile;
+  size_t mAudioFileLength;
+  size_t mAudioFileOffset;
+
+  std::unique_ptr<Slot[]> mSlots;
+
+  std::thread mThread;
+  std::atomic<bool> mStopped;
+  std::atomic<size_t> mFramesDelivered;
+  std::atomic<size_t> mFramesDropped;
+};
+
+#endif // FrameSource_h
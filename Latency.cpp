@@ -0,0 +1,254 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "Latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LATENCY_X86 1
+#include <immintrin.h>
+#endif
+
+// Each of these counts the pixels of |frame| that differ from |reference| by
+// more than |level|, negating |frame| first if |invert| is set.
+typedef size_t (*CountChangedFn)(const char* reference, const char* frame,
+                                 size_t pixels, uint8_t level, bool invert);
+
+static size_t
+CountChangedScalar(const char* reference, const char* frame, size_t pixels,
+                   uint8_t level, bool invert)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    uint8_t a = reference[i];
+    uint8_t b = invert ? 0 - uint8_t(frame[i]) : uint8_t(frame[i]);
+    count += (a > b ? a - b : b - a) > level;
+  }
+  return count;
+}
+
+#ifdef LATENCY_X86
+
+// There is no unsigned byte compare, so a difference is above |level| when
+// saturating it down by |level| leaves something.
+
+__attribute__((target("sse2")))
+static size_t
+CountChangedSSE2(const char* reference, const char* frame, size_t pixels,
+                 uint8_t level, bool invert)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i limit = _mm_set1_epi8(char(level));
+
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(reference + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(frame + i));
+    if (invert) {
+      b = _mm_sub_epi8(zero, b);
+    }
+
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    __m128i same = _mm_cmpeq_epi8(_mm_subs_epu8(diff, limit), zero);
+    count += 16 - __builtin_popcount(_mm_movemask_epi8(same));
+  }
+
+  return count + CountChangedScalar(reference + i, frame + i, pixels - i, level, invert);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t
+CountChangedAVX2(const char* reference, const char* frame, size_t pixels,
+                 uint8_t level, bool invert)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i limit = _mm256_set1_epi8(char(level));
+
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= pixels; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(reference + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(frame + i));
+    if (invert) {
+      b = _mm256_sub_epi8(zero, b);
+    }
+
+    __m256i diff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+    __m256i same = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, limit), zero);
+    count += 32 - __builtin_popcount(uint32_t(_mm256_movemask_epi8(same)));
+  }
+
+  return count + CountChangedSSE2(reference + i, frame + i, pixels - i, level, invert);
+}
+
+#endif // LATENCY_X86
+
+static CountChangedFn
+ChooseCountChanged()
+{
+#ifdef LATENCY_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    return CountChangedAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return CountChangedSSE2;
+  }
+#endif
+  return CountChangedScalar;
+}
+
+static CountChangedFn
+GetCountChanged()
+{
+  static CountChangedFn countChanged = ChooseCountChanged();
+  return countChanged;
+}
+
+LatencyMeter::LatencyMeter()
+ : mChangeLevel(kDefaultChangeLevel)
+ , mChangedPixels(kDefaultChangedPixels)
+ , mReport(true)
+ , mArmed(false)
+ , mOnsetNs(0)
+ , mMisses(0)
+{
+}
+
+void
+LatencyMeter::Init(size_t width, size_t height, const std::vector<Region>& regions)
+{
+  Region watched = mRegion;
+  if (watched.IsEmpty()) {
+    watched = Region(0, 0, width, height);
+  }
+
+  std::vector<Region> recorded = regions;
+  if (recorded.empty()) {
+    recorded.push_back(Region(0, 0, width, height));
+  }
+
+  // Where the rectangle crosses each recorded row, merging runs that follow
+  // on from each other in the recorded frame.
+  mSpans.clear();
+  size_t offset = 0;
+  size_t total = 0;
+  for (const Region& region : recorded) {
+    size_t left = std::max(region.x, watched.x);
+    size_t right = std::min(region.x + region.width, watched.x + watched.width);
+    for (size_t y = region.y; y < region.y + region.height; y++, offset += region.width) {
+      if (left >= right || y < watched.y || y >= watched.y + watched.height) {
+        continue;
+      }
+
+      Span span = { offset + left - region.x, right - left };
+      if (!mSpans.empty() && mSpans.back().offset + mSpans.back().length == span.offset) {
+        mSpans.back().length += span.length;
+      } else {
+        mSpans.push_back(span);
+      }
+      total += span.length;
+    }
+  }
+
+  mReference.resize(total);
+}
+
+void
+LatencyMeter::Arm(int64_t onsetNs, const char* frame, bool inverted)
+{
+  if (mArmed) {
+    if (mReport) {
+      printf("Latency: no reaction before the next marker\n");
+    }
+    mMisses++;
+  }
+
+  // Keep the reference un-negated, so comparisons only have to undo the
+  // decoration on the frame side.
+  char* out = mReference.data();
+  for (const Span& span : mSpans) {
+    const char* in = frame + span.offset;
+    for (size_t i = 0; i < span.length; i++) {
+      out[i] = inverted ? 0 - in[i] : in[i];
+    }
+    out += span.length;
+  }
+
+  mArmed = true;
+  mOnsetNs = onsetNs;
+}
+
+void
+LatencyMeter::AddFrame(int64_t frameNs, const char* frame, bool inverted)
+{
+  if (!mArmed) {
+    return;
+  }
+
+  CountChangedFn countChanged = GetCountChanged();
+
+  // Compare a block at a time so a big change is found after a block or two.
+  const size_t kBlockSize = 4096;
+
+  size_t changed = 0;
+  const char* reference = mReference.data();
+  for (const Span& span : mSpans) {
+    for (size_t i = 0; i < span.length && changed < mChangedPixels; i += kBlockSize) {
+      size_t pixels = std::min(kBlockSize, span.length - i);
+      changed += countChanged(reference + i, frame + span.offset + i, pixels,
+                              mChangeLevel, inverted);
+    }
+    if (changed >= mChangedPixels) {
+      break;
+    }
+    reference += span.length;
+  }
+
+  if (changed >= mChangedPixels) {
+    mArmed = false;
+    mLatenciesMs.push_back((frameNs - mOnsetNs) / 1000000.0);
+    if (mReport) {
+      printf("Latency: %.2f ms (p50 %.2f, p95 %.2f, p99 %.2f over %zu events)\n",
+             mLatenciesMs.back(), PercentileMs(50), PercentileMs(95),
+             PercentileMs(99), mLatenciesMs.size());
+    }
+    return;
+  }
+
+  if (frameNs - mOnsetNs > kLatencyTimeoutNs) {
+    mArmed = false;
+    mMisses++;
+    if (mReport) {
+      printf("Latency: no reaction within %lld ms\n",
+             (long long)(kLatencyTimeoutNs / 1000000));
+    }
+  }
+}
+
+double
+LatencyMeter::PercentileMs(double p) const
+{
+  if (mLatenciesMs.empty()) {
+    return 0;
+  }
+
+  // Events come about once a second, so sorting a copy is cheap.
+  std::vector<double> sorted(mLatenciesMs);
+  size_t rank = size_t(p / 100.0 * (sorted.size() - 1) + 0.5);
+  std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+  return sorted[rank];
+}
+
+void
+LatencyMeter::PrintSummary() const
+{
+  printf("  %zu latency events, %zu missed\n", NumEvents(), NumMisses());
+  if (NumEvents()) {
+    printf("  latency p50 %.2f ms, p95 %.2f ms, p99 %.2f ms\n",
+           PercentileMs(50), PercentileMs(95), PercentileMs(99));
+  }
+}
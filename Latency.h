@@ -0,0 +1,95 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef Latency_h
+#define Latency_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "Region.h"
+
+// A pixel must move by more than this to count as changed.
+const uint8_t kDefaultChangeLevel = 24;
+
+// A frame is a reaction once this many pixels have changed.
+const size_t kDefaultChangedPixels = 16;
+
+// Give up on a marker if nothing has changed after this long.
+const int64_t kLatencyTimeoutNs = 1000000000;
+
+// Measures input-to-photon latency as frames are committed: after a marker,
+// the first frame that differs from the marker frame counts as the reaction,
+// and its distance from the onset is the latency. Frames are compared against
+// a copy of the marker frame, so only frames following a marker cost anything,
+// and a comparison stops as soon as enough pixels have changed.
+//
+// Only recorded pixels can be watched, so with regions of interest the
+// latency rectangle is cut down to the parts of it that are recorded.
+//
+// Frames arrive decorated, with marker frames negated; |inverted| says so,
+// and the comparison undoes it.
+class LatencyMeter
+{
+public:
+  LatencyMeter();
+
+  void SetChangeLevel(uint8_t level) { mChangeLevel = level; }
+  void SetChangedPixels(size_t pixels) { mChangedPixels = pixels; }
+
+  // Only look for reactions in this rectangle of the luma frame. An empty one,
+  // the default, watches every recorded pixel.
+  void SetRegion(const Region& region) { mRegion = region; }
+
+  // Print a line for every event as it is measured.
+  void SetReport(bool report) { mReport = report; }
+
+  // Called once the recorded frames are known: |width| x |height| luma
+  // frames of which only |regions| are recorded, each region's rows in turn,
+  // or all of it if there are none.
+  void Init(size_t width, size_t height, const std::vector<Region>& regions);
+
+  // Recorded pixels that lie in the rectangle; 0 if it misses them all.
+  size_t WatchedPixels() const { return mReference.size(); }
+
+  // Starts a measurement from a marker heard at |onsetNs|, with |frame| as
+  // the picture before any reaction. A measurement still in progress is
+  // counted as a miss.
+  void Arm(int64_t onsetNs, const char* frame, bool inverted);
+
+  // Called with every other luma frame, in order.
+  void AddFrame(int64_t frameNs, const char* frame, bool inverted);
+
+  bool IsArmed() const { return mArmed; }
+  size_t NumEvents() const { return mLatenciesMs.size(); }
+  size_t NumMisses() const { return mMisses; }
+
+  // The |p|th percentile (0 to 100) of the latencies so far, in ms.
+  double PercentileMs(double p) const;
+
+  void PrintSummary() const;
+
+private:
+  uint8_t mChangeLevel;
+  size_t mChangedPixels;
+  Region mRegion;
+  bool mReport;
+
+  // Runs of the recorded frame that lie in the rectangle, stored one after
+  // another in mReference.
+  struct Span
+  {
+    size_t offset;
+    size_t length;
+  };
+  std::vector<Span> mSpans;
+  std::vector<char> mReference;
+
+  bool mArmed;
+  int64_t mOnsetNs;
+  size_t mMisses;
+  std::vector<double> mLatenciesMs;
+};
+
+#endif // Latency_h
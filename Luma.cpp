@@ -0,0 +1,298 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "Luma.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LUMA_X86 1
+#include <immintrin.h>
+#endif
+
+static bool
+AlwaysSupported()
+{
+  return true;
+}
+
+// The reference implementations; the vector versions must match them exactly.
+static void
+ExtractLumaARGBScalar(const char* input, char* output, size_t pixels, bool invert)
+{
+  for (size_t i = 0; i < pixels; i++) {
+    // Not sure why, but this channel seems to contain the luminosity.
+    int32_t luminosity = input[i * 4 + 2];
+
+    output[i] = invert ? 256 - luminosity : luminosity;
+  }
+}
+
+static void
+ExtractLumaUYVYScalar(const char* input, char* output, size_t pixels, bool invert)
+{
+  for (size_t i = 0; i < pixels; i++) {
+    int32_t luminosity = input[i * 2 + 1];
+
+    output[i] = invert ? 256 - luminosity : luminosity;
+  }
+}
+
+static void
+ExtractLumaUYVYHalfScalar(const char* input, char* output, size_t pixels, bool invert)
+{
+  for (size_t i = 0; i < pixels; i++) {
+    int32_t luminosity = input[i * 4 + 1]; // y0; skip cb0, cr0 and y1.
+
+    output[i] = invert ? 256 - luminosity : luminosity;
+  }
+}
+
+#ifdef LUMA_X86
+
+// ARGB and decimated UYVY both take one byte out of every four, so they share
+// an implementation parameterized on the byte's position: kShift is 16 for
+// ARGB and 8 for UYVY. Full-resolution UYVY takes the high byte of every
+// 16-bit word instead.
+//
+// 256 - x truncated to a byte is just -x, so inverting is a subtract from
+// zero in every vector version.
+
+template<int kShift>
+static void
+ExtractDwordByteScalar(const char* input, char* output, size_t pixels, bool invert)
+{
+  if (kShift == 16) {
+    ExtractLumaARGBScalar(input, output, pixels, invert);
+  } else {
+    ExtractLumaUYVYHalfScalar(input, output, pixels, invert);
+  }
+}
+
+static bool
+SSE2Supported()
+{
+  return __builtin_cpu_supports("sse2");
+}
+
+template<int kShift>
+__attribute__((target("sse2")))
+static void
+ExtractDwordByteSSE2(const char* input, char* output, size_t pixels, bool invert)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    const __m128i* in = reinterpret_cast<const __m128i*>(input + i * 4);
+    __m128i a = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(in + 0), kShift), mask);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(in + 1), kShift), mask);
+    __m128i c = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(in + 2), kShift), mask);
+    __m128i d = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(in + 3), kShift), mask);
+
+    __m128i luma = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    if (invert) {
+      luma = _mm_sub_epi8(zero, luma);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), luma);
+  }
+
+  ExtractDwordByteScalar<kShift>(input + i * 4, output + i, pixels - i, invert);
+}
+
+__attribute__((target("sse2")))
+static void
+ExtractLumaUYVYSSE2(const char* input, char* output, size_t pixels, bool invert)
+{
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    const __m128i* in = reinterpret_cast<const __m128i*>(input + i * 2);
+    __m128i a = _mm_srli_epi16(_mm_loadu_si128(in + 0), 8);
+    __m128i b = _mm_srli_epi16(_mm_loadu_si128(in + 1), 8);
+
+    __m128i luma = _mm_packus_epi16(a, b);
+    if (invert) {
+      luma = _mm_sub_epi8(zero, luma);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), luma);
+  }
+
+  ExtractLumaUYVYScalar(input + i * 2, output + i, pixels - i, invert);
+}
+
+static bool
+AVX2Supported()
+{
+  return __builtin_cpu_supports("avx2");
+}
+
+template<int kShift>
+__attribute__((target("avx2")))
+static void
+ExtractDwordByteAVX2(const char* input, char* output, size_t pixels, bool invert)
+{
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  const __m256i zero = _mm256_setzero_si256();
+  // The packs work within 128-bit lanes; this puts the dwords back in order.
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  size_t i = 0;
+  for (; i + 32 <= pixels; i += 32) {
+    const __m256i* in = reinterpret_cast<const __m256i*>(input + i * 4);
+    __m256i a = _mm256_and_si256(_mm256_srli_epi32(_mm256_loadu_si256(in + 0), kShift), mask);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(_mm256_loadu_si256(in + 1), kShift), mask);
+    __m256i c = _mm256_and_si256(_mm256_srli_epi32(_mm256_loadu_si256(in + 2), kShift), mask);
+    __m256i d = _mm256_and_si256(_mm256_srli_epi32(_mm256_loadu_si256(in + 3), kShift), mask);
+
+    __m256i luma = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+    luma = _mm256_permutevar8x32_epi32(luma, order);
+    if (invert) {
+      luma = _mm256_sub_epi8(zero, luma);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), luma);
+  }
+
+  ExtractDwordByteSSE2<kShift>(input + i * 4, output + i, pixels - i, invert);
+}
+
+__attribute__((target("avx2")))
+static void
+ExtractLumaUYVYAVX2(const char* input, char* output, size_t pixels, bool invert)
+{
+  const __m256i zero = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 32 <= pixels; i += 32) {
+    const __m256i* in = reinterpret_cast<const __m256i*>(input + i * 2);
+    __m256i a = _mm256_srli_epi16(_mm256_loadu_si256(in + 0), 8);
+    __m256i b = _mm256_srli_epi16(_mm256_loadu_si256(in + 1), 8);
+
+    __m256i luma = _mm256_packus_epi16(a, b);
+    luma = _mm256_permute4x64_epi64(luma, _MM_SHUFFLE(3, 1, 2, 0));
+    if (invert) {
+      luma = _mm256_sub_epi8(zero, luma);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), luma);
+  }
+
+  ExtractLumaUYVYSSE2(input + i * 2, output + i, pixels - i, invert);
+}
+
+static bool
+AVX512Supported()
+{
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+template<int kShift>
+__attribute__((target("avx512f,avx512bw")))
+static void
+ExtractDwordByteAVX512(const char* input, char* output, size_t pixels, bool invert)
+{
+  const __m512i mask = _mm512_set1_epi32(0xff);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13,
+                                          2, 6, 10, 14, 3, 7, 11, 15);
+
+  size_t i = 0;
+  for (; i + 64 <= pixels; i += 64) {
+    const char* in = input + i * 4;
+    __m512i a = _mm512_and_si512(_mm512_srli_epi32(_mm512_loadu_si512(in + 0), kShift), mask);
+    __m512i b = _mm512_and_si512(_mm512_srli_epi32(_mm512_loadu_si512(in + 64), kShift), mask);
+    __m512i c = _mm512_and_si512(_mm512_srli_epi32(_mm512_loadu_si512(in + 128), kShift), mask);
+    __m512i d = _mm512_and_si512(_mm512_srli_epi32(_mm512_loadu_si512(in + 192), kShift), mask);
+
+    __m512i luma = _mm512_packus_epi16(_mm512_packs_epi32(a, b), _mm512_packs_epi32(c, d));
+    luma = _mm512_permutexvar_epi32(order, luma);
+    if (invert) {
+      luma = _mm512_sub_epi8(zero, luma);
+    }
+    _mm512_storeu_si512(output + i, luma);
+  }
+
+  ExtractDwordByteAVX2<kShift>(input + i * 4, output + i, pixels - i, invert);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+ExtractLumaUYVYAVX512(const char* input, char* output, size_t pixels, bool invert)
+{
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+
+  size_t i = 0;
+  for (; i + 64 <= pixels; i += 64) {
+    const char* in = input + i * 2;
+    __m512i a = _mm512_srli_epi16(_mm512_loadu_si512(in + 0), 8);
+    __m512i b = _mm512_srli_epi16(_mm512_loadu_si512(in + 64), 8);
+
+    __m512i luma = _mm512_packus_epi16(a, b);
+    luma = _mm512_permutexvar_epi64(order, luma);
+    if (invert) {
+      luma = _mm512_sub_epi8(zero, luma);
+    }
+    _mm512_storeu_si512(output + i, luma);
+  }
+
+  ExtractLumaUYVYAVX2(input + i * 2, output + i, pixels - i, invert);
+}
+
+#endif // LUMA_X86
+
+const LumaKernel kLumaKernels[] = {
+  { "scalar", ExtractLumaARGBScalar, ExtractLumaUYVYScalar,
+    ExtractLumaUYVYHalfScalar, AlwaysSupported },
+#ifdef LUMA_X86
+  { "sse2", ExtractDwordByteSSE2<16>, ExtractLumaUYVYSSE2,
+    ExtractDwordByteSSE2<8>, SSE2Supported },
+  { "avx2", ExtractDwordByteAVX2<16>, ExtractLumaUYVYAVX2,
+    ExtractDwordByteAVX2<8>, AVX2Supported },
+  { "avx512", ExtractDwordByteAVX512<16>, ExtractLumaUYVYAVX512,
+    ExtractDwordByteAVX512<8>, AVX512Supported },
+#endif
+};
+
+const size_t kNumLumaKernels = sizeof(kLumaKernels) / sizeof(kLumaKernels[0]);
+
+// The last supported kernel is the widest.
+static const LumaKernel*
+BestLumaKernel()
+{
+  const LumaKernel* best = &kLumaKernels[0];
+  for (size_t i = 0; i < kNumLumaKernels; i++) {
+    if (kLumaKernels[i].supported()) {
+      best = &kLumaKernels[i];
+    }
+  }
+  return best;
+}
+
+// Set by SetLumaKernel(); workers may read it while it is being set.
+static std::atomic<const LumaKernel*> gLumaKernel(nullptr);
+
+const LumaKernel*
+GetLumaKernel()
+{
+  // Initialized once even when several workers get here first.
+  static const LumaKernel* best = BestLumaKernel();
+
+  const LumaKernel* kernel = gLumaKernel;
+  return kernel ? kernel : best;
+}
+
+bool
+SetLumaKernel(const char* name)
+{
+  for (size_t i = 0; i < kNumLumaKernels; i++) {
+    if (strcmp(kLumaKernels[i].name, name) == 0 && kLumaKernels[i].supported()) {
+      gLumaKernel = &kLumaKernels[i];
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef Luma_h
+#define Luma_h
+
+#include <stddef.h>
+
+// Copies |pixels| luma values from one row of |input| to |output|, negating
+// each value if |invert| is set.
+typedef void (*ExtractLumaFn)(const char* input, char* output, size_t pixels, bool invert);
+
+struct LumaKernel
+{
+  const char* name;
+
+  // ARGB input: the luma is the third byte of each pixel.
+  ExtractLumaFn extractARGB;
+
+  // UYVY input: every Y byte.
+  ExtractLumaFn extractUYVY;
+
+  // UYVY input: only the first Y of each pair, so |pixels| outputs consume
+  // 2 * |pixels| input pixels.
+  ExtractLumaFn extractUYVYHalf;
+
+  bool (*supported)();
+};
+
+// All kernels built into this binary, scalar reference first. Entries whose
+// supported() returns false can't run on this CPU.
+extern const LumaKernel kLumaKernels[];
+extern const size_t kNumLumaKernels;
+
+// The kernel used by ProcessFrame: the widest one the CPU supports, chosen on
+// first use.
+const LumaKernel*
+GetLumaKernel();
+
+// Overrides the kernel choice by name. Returns false if the kernel is unknown
+// or unsupported.
+bool
+SetLumaKernel(const char* name);
+
+#endif // Luma_h
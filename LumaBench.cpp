@@ -0,0 +1,123 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+// Checks every luma kernel the CPU supports against the scalar reference and
+// times it on 1080p and 4K frames of each input layout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "Luma.h"
+#include "Stats.h"
+
+struct Variant
+{
+  const char* name;
+  ExtractLumaFn LumaKernel::*extract;
+
+  // Input bytes consumed per output pixel.
+  size_t inputBytes;
+};
+
+static const Variant kVariants[] = {
+  { "argb", &LumaKernel::extractARGB, 4 },
+  { "uyvy", &LumaKernel::extractUYVY, 2 },
+  { "uyvy/2", &LumaKernel::extractUYVYHalf, 4 },
+};
+
+static bool
+CheckKernel(const LumaKernel& kernel, const Variant& variant)
+{
+  const ExtractLumaFn reference = kLumaKernels[0].*variant.extract;
+  const ExtractLumaFn extract = kernel.*variant.extract;
+
+  // Odd lengths and offsets exercise the scalar tails and unaligned loads.
+  const size_t kMaxPixels = 1000;
+  std::vector<char> input(kMaxPixels * variant.inputBytes + 4);
+  for (size_t i = 0; i < input.size(); i++) {
+    input[i] = char(rand());
+  }
+
+  std::vector<char> expected(kMaxPixels), actual(kMaxPixels);
+  for (size_t pixels = 0; pixels < kMaxPixels; pixels += 7) {
+    for (size_t offset = 0; offset < 4; offset++) {
+      for (int invert = 0; invert < 2; invert++) {
+        reference(&input[offset], expected.data(), pixels, invert);
+        memset(actual.data(), 0, actual.size());
+        extract(&input[offset], actual.data(), pixels, invert);
+        if (memcmp(expected.data(), actual.data(), pixels) != 0) {
+          fprintf(stderr, "%s %s: mismatch with %zu pixels, offset %zu, invert %d\n",
+                  kernel.name, variant.name, pixels, offset, invert);
+          return false;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+// Times one frame's worth of rows; |width| and |height| are the output size.
+static void
+TimeKernel(const LumaKernel& kernel, const Variant& variant,
+           size_t width, size_t height, size_t iterations)
+{
+  const ExtractLumaFn extract = kernel.*variant.extract;
+  const size_t rowBytes = width * variant.inputBytes;
+
+  std::vector<char> input(rowBytes * height);
+  for (size_t i = 0; i < input.size(); i++) {
+    input[i] = char(i * 7);
+  }
+  std::vector<char> output(width * height);
+
+  StageStats stats;
+  for (size_t n = 0; n < iterations; n++) {
+    uint64_t start = NowNs();
+    for (size_t h = 0; h < height; h++) {
+      extract(&input[h * rowBytes], &output[h * width], width, n & 1);
+    }
+    stats.Add(NowNs() - start);
+  }
+
+  printf("  %-8s %-7s %4zux%-4zu %8.1f us/frame mean %8.1f us max %6.2f GB/s in %7.0f fps\n",
+         kernel.name, variant.name, width, height, stats.MeanUs(), stats.MaxUs(),
+         double(input.size()) / (stats.MeanUs() * 1000.0),
+         1000000.0 / stats.MeanUs());
+}
+
+int
+main(int argc, char** argv)
+{
+  size_t iterations = 200;
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+  }
+
+  printf("selected kernel: %s\n", GetLumaKernel()->name);
+
+  bool ok = true;
+  for (size_t i = 0; i < kNumLumaKernels; i++) {
+    const LumaKernel& kernel = kLumaKernels[i];
+    if (!kernel.supported()) {
+      printf("  %-8s unsupported on this CPU\n", kernel.name);
+      continue;
+    }
+
+    for (const Variant& variant : kVariants) {
+      if (!CheckKernel(kernel, variant)) {
+        ok = false;
+        continue;
+      }
+
+      // Decimated output is half the size in each direction.
+      size_t scale = variant.extract == &LumaKernel::extractUYVYHalf ? 2 : 1;
+      TimeKernel(kernel, variant, 1920 / scale, 1080 / scale, iterations);
+      TimeKernel(kernel, variant, 3840 / scale, 2160 / scale, iterations / 4 + 1);
+    }
+  }
+
+  return ok ? 0 : 1;
+}
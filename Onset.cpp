@@ -0,0 +1,202 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "Onset.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "FrameSource.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ONSET_X86 1
+#include <immintrin.h>
+#endif
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+// Each of these returns the first frame at or after |start| whose left sample
+// is above |threshold|, or |frames| if there is none.
+typedef size_t (*FindAboveFn)(const int16_t* samples, size_t start,
+                              size_t frames, int16_t threshold);
+
+static size_t
+FindAboveScalar(const int16_t* samples, size_t start, size_t frames, int16_t threshold)
+{
+  for (size_t i = start; i < frames; i++) {
+    if (samples[i * kAudioChannels] > threshold) {
+      return i;
+    }
+  }
+  return frames;
+}
+
+#ifdef ONSET_X86
+
+// A stereo frame is one dword with the left sample in its low word, so after a
+// 16-bit compare only the low two bytes of every four in the byte mask
+// belong to the left channel.
+
+__attribute__((target("sse2")))
+static size_t
+FindAboveSSE2(const int16_t* samples, size_t start, size_t frames, int16_t threshold)
+{
+  const __m128i limit = _mm_set1_epi16(threshold);
+
+  size_t i = start;
+  for (; i + 16 <= frames; i += 16) {
+    const __m128i* in = reinterpret_cast<const __m128i*>(samples + i * 2);
+    __m128i a = _mm_cmpgt_epi16(_mm_loadu_si128(in + 0), limit);
+    __m128i b = _mm_cmpgt_epi16(_mm_loadu_si128(in + 1), limit);
+    __m128i c = _mm_cmpgt_epi16(_mm_loadu_si128(in + 2), limit);
+    __m128i d = _mm_cmpgt_epi16(_mm_loadu_si128(in + 3), limit);
+
+    // Quiet audio is the common case, so test all four at once and only
+    // work out which frame it was on a hit.
+    uint64_t mask =
+      uint64_t(uint16_t(_mm_movemask_epi8(a))) |
+      uint64_t(uint16_t(_mm_movemask_epi8(b))) << 16 |
+      uint64_t(uint16_t(_mm_movemask_epi8(c))) << 32 |
+      uint64_t(uint16_t(_mm_movemask_epi8(d))) << 48;
+    mask &= 0x3333333333333333ull;
+    if (mask) {
+      return i + __builtin_ctzll(mask) / 4;
+    }
+  }
+
+  return FindAboveScalar(samples, i, frames, threshold);
+}
+
+__attribute__((target("avx2")))
+static size_t
+FindAboveAVX2(const int16_t* samples, size_t start, size_t frames, int16_t threshold)
+{
+  const __m256i limit = _mm256_set1_epi16(threshold);
+
+  size_t i = start;
+  for (; i + 16 <= frames; i += 16) {
+    const __m256i* in = reinterpret_cast<const __m256i*>(samples + i * 2);
+    __m256i a = _mm256_cmpgt_epi16(_mm256_loadu_si256(in + 0), limit);
+    __m256i b = _mm256_cmpgt_epi16(_mm256_loadu_si256(in + 1), limit);
+
+    uint64_t mask =
+      uint64_t(uint32_t(_mm256_movemask_epi8(a))) |
+      uint64_t(uint32_t(_mm256_movemask_epi8(b))) << 32;
+    mask &= 0x3333333333333333ull;
+    if (mask) {
+      return i + __builtin_ctzll(mask) / 4;
+    }
+  }
+
+  return FindAboveScalar(samples, i, frames, threshold);
+}
+
+#endif // ONSET_X86
+
+struct OnsetKernel
+{
+  const char* name;
+  FindAboveFn findAbove;
+};
+
+static const OnsetKernel*
+ChooseOnsetKernel()
+{
+  static const OnsetKernel kScalar = { "scalar", FindAboveScalar };
+#ifdef ONSET_X86
+  static const OnsetKernel kSSE2 = { "sse2", FindAboveSSE2 };
+  static const OnsetKernel kAVX2 = { "avx2", FindAboveAVX2 };
+
+  if (__builtin_cpu_supports("avx2")) {
+    return &kAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &kSSE2;
+  }
+#endif
+  return &kScalar;
+}
+
+// Every worker calls this, so the choice is made by a static initializer,
+// which runs once however many threads get here first.
+static const OnsetKernel*
+GetOnsetKernel()
+{
+  static const OnsetKernel* kernel = ChooseOnsetKernel();
+  return kernel;
+}
+
+const char*
+OnsetKernelName()
+{
+  return GetOnsetKernel()->name;
+}
+
+size_t
+FindOnsets(const int16_t* samples, size_t frames, int16_t threshold,
+           size_t debounce, uint32_t* onsets, size_t maxOnsets)
+{
+  FindAboveFn findAbove = GetOnsetKernel()->findAbove;
+
+  size_t count = 0;
+  size_t i = 0;
+  while (count < maxOnsets && i < frames) {
+    i = findAbove(samples, i, frames, threshold);
+    if (i == frames) {
+      break;
+    }
+
+    onsets[count++] = i;
+    i += debounce ? debounce : 1;
+  }
+  return count;
+}
+
+EventLog::EventLog()
+ : mFile(nullptr)
+ , mNumEvents(0)
+{
+}
+
+EventLog::~EventLog()
+{
+  Close();
+}
+
+void
+EventLog::Open(const std::string& name)
+{
+  mFile = fopen(name.c_str(), "wb");
+  if (!mFile) {
+    Fail("unable to open events file");
+  }
+
+  uint32_t header[4] = { 0, kEventsVersion, kTimeScale, kAudioSampleRate };
+  memcpy(header, "PEVT", 4);
+  if (fwrite(header, sizeof(header), 1, mFile) != 1) {
+    Fail("write failed");
+  }
+  mNumEvents = 0;
+}
+
+void
+EventLog::Write(const OnsetEvent& event)
+{
+  if (fwrite(&event, sizeof(event), 1, mFile) != 1) {
+    Fail("write failed");
+  }
+  mNumEvents++;
+}
+
+void
+EventLog::Close()
+{
+  if (mFile) {
+    fclose(mFile);
+    mFile = nullptr;
+  }
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef Onset_h
+#define Onset_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+// A left-channel sample must exceed this to count as a marker click.
+const int16_t kDefaultOnsetThreshold = 100;
+
+// Crossings closer than this to the previous onset are part of the same
+// click: 50 ms at 48 kHz.
+const size_t kDefaultOnsetDebounce = 2400;
+
+// Finds the sample frames of |samples| (16-bit interleaved stereo) where the
+// left channel goes above |threshold|, each at least |debounce| frames after
+// the one before. Writes up to |maxOnsets| frame offsets to |onsets| and
+// returns how many it wrote. Stops scanning as soon as |onsets| is full, so
+// passing a |maxOnsets| of 1 is a cheap "is there a click" test.
+size_t
+FindOnsets(const int16_t* samples, size_t frames, int16_t threshold,
+           size_t debounce, uint32_t* onsets, size_t maxOnsets);
+
+// The name of the search kernel FindOnsets uses on this CPU.
+const char*
+OnsetKernelName();
+
+// One record of a .events file.
+struct OnsetEvent
+{
+  // The audio packet's time, as returned by GetPacketTime, in kTimeScale
+  // units.
+  int64_t packetTime;
+
+  // packetTime plus sampleOffset, in nanoseconds of stream time.
+  int64_t streamTimeNs;
+
+  // Sample frames after packetTime.
+  uint32_t sampleOffset;
+
+  // The index in the .pop file of the frame the packet arrived with, or -1
+  // if that frame was not recorded.
+  int32_t frame;
+};
+
+// A .events file is a 16-byte header (the magic "PEVT", then uint32 version,
+// time scale and sample rate) followed by OnsetEvent records, little endian.
+const uint32_t kEventsVersion = 1;
+
+class EventLog
+{
+public:
+  EventLog();
+  ~EventLog();
+
+  void Open(const std::string& name);
+  void Close();
+
+  bool IsOpen() const { return !!mFile; }
+  size_t NumEvents() const { return mNumEvents; }
+
+  void Write(const OnsetEvent& event);
+
+private:
+  FILE* mFile;
+  size_t mNumEvents;
+};
+
+#endif // Onset_h
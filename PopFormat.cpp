@@ -0,0 +1,75 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "PopFormat.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// CRC-32C, reflected, as in iSCSI and SSE4.2. The table version goes a byte
+// at a time; the instruction does eight.
+static uint32_t
+Crc32cScalar(uint32_t crc, const uint8_t* p, size_t length)
+{
+  struct Table
+  {
+    Table() {
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+          c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+        }
+        entries[i] = c;
+      }
+    }
+    uint32_t entries[256];
+  };
+  static const Table table;
+
+  for (size_t i = 0; i < length; i++) {
+    crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+Crc32cSSE42(uint32_t crc, const uint8_t* p, size_t length)
+{
+  uint64_t crc64 = crc;
+  for (; length >= 8; p += 8, length -= 8) {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    crc64 = _mm_crc32_u64(crc64, x);
+  }
+  crc = uint32_t(crc64);
+  for (; length; p++, length--) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const uint8_t* p, size_t length);
+
+static Crc32cFn
+ChooseCrc32c()
+{
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return Crc32cSSE42;
+  }
+#endif
+  return Crc32cScalar;
+}
+
+uint32_t
+PopChecksum(const void* data, size_t length, uint32_t crc)
+{
+  // Chunks are checksummed on the parallel encoders, so choose once, in a
+  // static initializer.
+  static const Crc32cFn crc32c = ChooseCrc32c();
+  return ~crc32c(~crc, static_cast<const uint8_t*>(data), length);
+}
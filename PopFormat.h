@@ -0,0 +1,122 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef PopFormat_h
+#define PopFormat_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A .pop file holds everything needed to play it back. All fields are little
+// endian. It starts with a PopHeader and the regions it lists, then the
+// frames in chunks, each a PopChunkHeader followed by the records of its
+// frames, and ends with a footer: a PopFrameEntry for every frame, a
+// PopChunkEntry for every chunk and a PopTrailer. Record offsets are from
+// the start of the file.
+//
+// Chunks are written as they fill, and the footer once the file is closed,
+// so a writer never has to seek back. A chunk flagged kPopChunkSync starts a
+// sync point: no record from it on refers to anything before it, so a reader
+// can fetch and decode the frames from one sync point to the next on their
+// own. Sync points come every PopHeader::syncInterval frames, so a reader
+// going through the file in order, from a pipe say, knows them too and only
+// has to keep the chunks since the last one. The entries are fixed size and
+// in frame order, so a reader can find a frame by number or time in the
+// mapped footer without reading it all in, and a file cut short by a crash
+// can still be read chunk by chunk. Each chunk's payload carries a CRC-32C.
+//
+// Files written before this format, version 1, have no header: the .pop
+// holds only records, and a separate .idx holds the size, the regions and
+// the frame offsets, as described for Encoder in EncodeLib.h. Decoders still
+// read them.
+const uint32_t kPopVersion = 2;
+
+// The only pixel format so far: one 8-bit luma byte per pixel.
+const uint8_t kPopPixelLuma8 = 1;
+
+// PopChunkEntry flags. The first chunk of every file is a sync point.
+const uint32_t kPopChunkSync = 1;
+
+// A rectangle of the picture that was recorded.
+struct PopRegion
+{
+  uint16_t x, y, width, height;
+};
+
+struct PopHeader
+{
+  char magic[4];          // "PPOP"
+  uint32_t version;       // kPopVersion
+  uint32_t headerSize;    // this header and the regions after it
+  uint16_t width;         // of the picture
+  uint16_t height;
+  uint16_t numRegions;    // 0 for the whole picture
+  uint8_t pixelFormat;    // kPopPixelLuma8
+  uint8_t reserved1;
+  uint32_t syncInterval;  // a sync point at every multiple, or 0 for only
+                          // at the first frame
+  double fps;             // nominal frame rate, or 0 if unknown
+  int64_t createdNs;      // wall clock time it was recorded, or 0 if unknown
+  // Then a PopRegion for each region.
+};
+
+struct PopChunkHeader
+{
+  char magic[4];          // "PCHK"
+  uint32_t numFrames;
+  uint64_t length;        // of the payload that follows
+  uint32_t firstFrame;    // within the file
+  uint32_t checksum;      // CRC-32C of the payload
+};
+
+struct PopFrameEntry
+{
+  uint64_t offset;        // of the frame's first record
+  int64_t timeNs;         // stream time, or 0 if unknown
+};
+
+struct PopChunkEntry
+{
+  uint64_t offset;        // of the chunk's PopChunkHeader
+  uint64_t length;        // of its payload
+  uint32_t firstFrame;
+  uint32_t numFrames;
+  uint32_t checksum;
+  uint32_t flags;         // kPopChunkSync or 0
+};
+
+struct PopTrailer
+{
+  uint64_t framesOffset;  // of the first PopFrameEntry
+  uint64_t numFrames;
+  uint64_t chunksOffset;  // of the first PopChunkEntry
+  uint32_t numChunks;
+  uint32_t checksum;      // CRC-32C of the frame and chunk entries
+  uint32_t reserved;
+  char magic[4];          // "PIDX", the last bytes of the file
+};
+
+static_assert(sizeof(PopRegion) == 8, "PopRegion has padding");
+static_assert(sizeof(PopHeader) == 40, "PopHeader has padding");
+static_assert(sizeof(PopChunkHeader) == 24, "PopChunkHeader has padding");
+static_assert(sizeof(PopFrameEntry) == 16, "PopFrameEntry has padding");
+static_assert(sizeof(PopChunkEntry) == 32, "PopChunkEntry has padding");
+static_assert(sizeof(PopTrailer) == 40, "PopTrailer has padding");
+
+// The CRC-32C of |length| bytes, as stored in a .pop file. Pass the result
+// for the data before as |crc| to go on from there.
+uint32_t
+PopChecksum(const void* data, size_t length, uint32_t crc = 0);
+
+// A segmented recording's manifest is a text file starting with the line
+// "segments 2", then one line per finished segment:
+//
+//   POP FIRST_FRAME NUM_FRAMES POP_BYTES FIRST_NS LAST_NS
+//
+// POP is a file name relative to the manifest, and the times are the
+// stream times of the segment's first and last frames. A segment is listed
+// once it is closed, so the manifest of an interrupted recording is still
+// usable. Version 1 manifests also list each segment's .idx after its .pop.
+const char* const kSegmentsVersionLine = "segments 2";
+const char* const kSegmentsVersion1Line = "segments 1";
+
+#endif // PopFormat_h
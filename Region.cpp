@@ -0,0 +1,58 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#include "Region.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+Fail(const char* err)
+{
+  fprintf(stderr, "error: %s\n", err);
+  exit(1);
+}
+
+bool
+ParseRegion(const char* text, Region* region)
+{
+  unsigned long x, y, width, height;
+  char end;
+  if (sscanf(text, "%lu,%lu,%lu,%lu%c", &x, &y, &width, &height, &end) != 4) {
+    return false;
+  }
+
+  *region = Region(x, y, width, height);
+  return !region->IsEmpty();
+}
+
+void
+LoadRegions(const std::string& fileName, std::vector<Region>* regions)
+{
+  FILE* file = fopen(fileName.c_str(), "r");
+  if (!file) {
+    Fail("unable to open region file");
+  }
+
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    size_t length = strlen(line);
+    while (length && isspace((unsigned char)line[length - 1])) {
+      line[--length] = '\0';
+    }
+
+    const char* p = line + strspn(line, " \t");
+    if (!*p || *p == '#') {
+      continue;
+    }
+
+    Region region;
+    if (!ParseRegion(p, &region)) {
+      Fail("region file lines must be X,Y,W,H");
+    }
+    regions->push_back(region);
+  }
+
+  fclose(file);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef Region_h
+#define Region_h
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// A rectangle of a luma frame.
+struct Region
+{
+  Region() : x(0), y(0), width(0), height(0) {}
+  Region(size_t x, size_t y, size_t width, size_t height)
+   : x(x), y(y), width(width), height(height)
+  {}
+
+  size_t x, y, width, height;
+
+  bool IsEmpty() const { return !width || !height; }
+  size_t Area() const { return width * height; }
+
+  bool Contains(const Region& other) const {
+    return other.x >= x && other.y >= y &&
+           other.x + other.width <= x + width &&
+           other.y + other.height <= y + height;
+  }
+};
+
+// The number of pixels in all of |regions|.
+inline size_t
+TotalArea(const std::vector<Region>& regions)
+{
+  size_t area = 0;
+  for (const Region& region : regions) {
+    area += region.Area();
+  }
+  return area;
+}
+
+// Parses "X,Y,W,H". Returns false if |text| is malformed or the rectangle is
+// empty.
+bool
+ParseRegion(const char* text, Region* region);
+
+// Appends the regions listed in |fileName|, one "X,Y,W,H" per line. Blank
+// lines and lines starting with '#' are skipped. Fails on anything else.
+void
+LoadRegions(const std::string& fileName, std::vector<Region>* regions);
+
+#endif // Region_h
@@ -0,0 +1,85 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef SPSCQueue_h
+#define SPSCQueue_h
+
+#include <stddef.h>
+
+#include <atomic>
+#include <vector>
+
+// A bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Neither side ever blocks or takes a lock, so it is safe to push from
+// the capture callback.
+template<class T>
+class SPSCQueue
+{
+public:
+  // |capacity| is rounded up to a power of two.
+  explicit SPSCQueue(size_t capacity)
+   : mHead(0)
+   , mTail(0)
+   , mHighWater(0)
+  {
+    size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    mSlots.resize(size);
+    mMask = size - 1;
+  }
+
+  size_t Capacity() const { return mSlots.size(); }
+
+  // Producer only. Returns false if the queue is full.
+  bool Push(const T& item) {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    size_t head = mHead.load(std::memory_order_acquire);
+    if (tail - head == mSlots.size()) {
+      return false;
+    }
+
+    mSlots[tail & mMask] = item;
+    mTail.store(tail + 1, std::memory_order_release);
+
+    size_t depth = tail + 1 - head;
+    if (depth > mHighWater.load(std::memory_order_relaxed)) {
+      mHighWater.store(depth, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue is empty.
+  bool Pop(T* item) {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    size_t tail = mTail.load(std::memory_order_acquire);
+    if (head == tail) {
+      return false;
+    }
+
+    *item = mSlots[head & mMask];
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate when called concurrently with Push or Pop.
+  size_t Depth() const {
+    return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire);
+  }
+
+  // The largest depth the producer has seen right after a push.
+  size_t HighWater() const { return mHighWater.load(std::memory_order_relaxed); }
+
+private:
+  std::vector<T> mSlots;
+  size_t mMask;
+
+  // Keep the consumer's and producer's indices on separate cache lines.
+  char mPad0[64];
+  std::atomic<size_t> mHead;
+  char mPad1[64];
+  std::atomic<size_t> mTail;
+  std::atomic<size_t> mHighWater;
+};
+
+#endif // SPSCQueue_h
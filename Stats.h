@@ -0,0 +1,107 @@
+/* -*- Mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; tab-width: 8 -*- */
+
+#ifndef Stats_h
+#define Stats_h
+
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+
+// Monotonic time in nanoseconds, for timing the capture stages.
+inline uint64_t
+NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Timings for one pipeline stage, with a log-bucketed histogram in the style
+// of HdrHistogram: every power of two is split into kSubBuckets linear
+// buckets, so a percentile is known to within an eighth of its value, from
+// 1 ns up to about half an hour.
+//
+// A StageStats belongs to the one thread that calls Add(), so recording is a
+// handful of plain stores with no locks or atomics. Read it, or Merge() the
+// per-thread copies, once that thread has stopped.
+struct StageStats
+{
+  static const int kSubBucketBits = 3;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  static const int kMaxExponent = 41;
+  static const int kNumBuckets = (kMaxExponent - kSubBucketBits + 1) * kSubBuckets;
+
+  StageStats() : count(0), totalNs(0), maxNs(0), buckets() {}
+
+  void Add(uint64_t ns) {
+    count++;
+    totalNs += ns;
+    if (ns > maxNs) {
+      maxNs = ns;
+    }
+    buckets[BucketIndex(ns)]++;
+  }
+
+  void Merge(const StageStats& other) {
+    count += other.count;
+    totalNs += other.totalNs;
+    if (other.maxNs > maxNs) {
+      maxNs = other.maxNs;
+    }
+    for (int i = 0; i < kNumBuckets; i++) {
+      buckets[i] += other.buckets[i];
+    }
+  }
+
+  double MeanUs() const { return count ? double(totalNs) / count / 1000.0 : 0; }
+  double MaxUs() const { return double(maxNs) / 1000.0; }
+
+  // The |p|th percentile (0 to 100), as the middle of its bucket.
+  double PercentileUs(double p) const {
+    uint64_t rank = uint64_t(p / 100.0 * count + 0.5);
+    if (rank < 1) {
+      rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        double ns = (BucketStart(i) + BucketStart(i + 1) - 1) / 2.0;
+        return std::min(ns, double(maxNs)) / 1000.0;
+      }
+    }
+    return MaxUs();
+  }
+
+  // Values below kSubBuckets get a bucket each; above that, the exponent
+  // picks a run of kSubBuckets buckets and the next bits pick one of them.
+  static int BucketIndex(uint64_t ns) {
+    if (ns < uint64_t(kSubBuckets)) {
+      return int(ns);
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= kMaxExponent) {
+      return kNumBuckets - 1;
+    }
+    int mantissa = int(ns >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+    return (exponent - kSubBucketBits + 1) * kSubBuckets + mantissa;
+  }
+
+  static uint64_t BucketStart(int index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    int exponent = index / kSubBuckets + kSubBucketBits - 1;
+    int mantissa = index % kSubBuckets;
+    return uint64_t(kSubBuckets + mantissa) << (exponent - kSubBucketBits);
+  }
+
+  uint64_t count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+  uint64_t buckets[kNumBuckets];
+};
+
+#endif // Stats_h
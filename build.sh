@@ -1,5 +1,13 @@
 #!/bin/bash
 
-clang++ -std=c++14 -O3 -o capture -I ~/decklink-sdk/Mac/include/ Capture.cpp EncodeLib.cpp -framework CoreFoundation
+clang++ -std=c++14 -O3 -o capture -I ~/decklink-sdk/Mac/include/ Capture.cpp CaptureDaemon.cpp CaptureLib.cpp FrameSource.cpp Luma.cpp Onset.cpp Latency.cpp Region.cpp EncodeLib.cpp PopFormat.cpp BufferPool.cpp -framework CoreFoundation
 
-clang++ -std=c++14 Encode.cpp EncodeLib.cpp -o encode -Wall -O3
+clang++ -std=c++14 Encode.cpp EncodeLib.cpp PopFormat.cpp BufferPool.cpp Region.cpp -o encode -Wall -O3 -pthread
+
+clang++ -std=c++14 Bench.cpp CaptureLib.cpp FrameSource.cpp Luma.cpp Onset.cpp Latency.cpp Region.cpp EncodeLib.cpp PopFormat.cpp BufferPool.cpp -o bench -Wall -O3 -pthread
+
+clang++ -std=c++14 LumaBench.cpp Luma.cpp -o lumabench -Wall -O3
+
+clang++ -std=c++14 Decode.cpp DecodeLib.cpp PopFormat.cpp -o decode -Wall -O3
+
+clang++ -std=c++14 CodecBench.cpp DecodeLib.cpp EncodeLib.cpp PopFormat.cpp BufferPool.cpp Region.cpp -o codecbench -Wall -O3 -pthread
@@ -1,6 +1,28 @@
 const kReuseScanline = 51;
+const kDeltaScanline = 68;
+const kCopyFrame = 70;
+const kCopyRows = 82;
+const kShiftRows = 83;
+const kScrollFrame = 77;
+const kPackedScanline = 80;
+const kTileFrame = 84;
 const kNewScanline = 122;
 
+// Version 2 .pop files hold their own index; see EncodeLib.h.
+const kPopVersion = 2;
+const kPopHeaderSize = 40;
+const kPopChunkHeaderSize = 24;
+const kPopFrameEntrySize = 16;
+const kPopChunkEntrySize = 32;
+const kPopTrailerSize = 40;
+const kPopChunkSync = 1;
+
+// Enough of a .pop file to hold its header and the start of its first chunk.
+const kPopFirstFetch = 65536;
+
+const kSegmentsVersionLine = "segments 2";
+const kSegmentsVersion1Line = "segments 1";
+
 function sendRequest(url) {
   return new Promise((resolve) => {
     let req = new XMLHttpRequest();
@@ -15,37 +37,322 @@ function sendRequest(url) {
   });
 }
 
-function Decoder(popBuffer, idxBuffer) {
-  this.popBuffer = popBuffer;
-  this.idxBuffer = idxBuffer;
+// Resolves with the bytes of |url| from |start| up to |end|. A server that
+// ignores the range sends the whole file, which |partial| tells apart;
+// |length| is the size of the whole file either way.
+function sendRangeRequest(url, start, end) {
+  return new Promise((resolve) => {
+    let req = new XMLHttpRequest();
+    req.onload = (event) => {
+      if (!req.response) {
+        return;
+      }
+      let partial = req.status == 206;
+      let length = req.response.byteLength;
+      if (partial) {
+        let range = /\/(\d+)$/.exec(req.getResponseHeader("Content-Range") || "");
+        length = range ? parseInt(range[1]) : start + req.response.byteLength;
+      }
+      resolve({ buffer: req.response, partial: partial, length: length });
+    };
+    req.open("GET", url);
+    req.setRequestHeader("Range", "bytes=" + start + "-" + (end - 1));
+    req.responseType = "arraybuffer";
+    req.send();
+  });
+}
+
+// Resolves with the text at |url|, or null if there is none.
+function sendOptionalRequest(url) {
+  return new Promise((resolve) => {
+    let req = new XMLHttpRequest();
+    req.onload = (event) => {
+      resolve(req.status >= 200 && req.status < 300 ? req.response : null);
+    };
+    req.onerror = (event) => {
+      resolve(null);
+    };
+    req.open("GET", url);
+    req.responseType = "text";
+    req.send();
+  });
+}
+
+// Reads a little-endian uint64 from a DataView. Offsets past 2^53 can't be
+// represented exactly, but no file that large can be loaded either.
+function getUint64(view, offset) {
+  return view.getUint32(offset + 4, true) * 0x100000000 + view.getUint32(offset, true);
+}
+
+let crc32cTable = null;
+
+// The CRC-32C of |length| bytes from |start|, as stored in .pop files.
+function popChecksum(bytes, start, length) {
+  if (!crc32cTable) {
+    crc32cTable = new Uint32Array(256);
+    for (let i = 0; i < 256; i++) {
+      let c = i;
+      for (let k = 0; k < 8; k++) {
+        c = (c >>> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+      }
+      crc32cTable[i] = c;
+    }
+  }
+
+  let crc = -1;
+  for (let i = start, end = start + length; i < end; i++) {
+    crc = crc32cTable[(crc ^ bytes[i]) & 0xff] ^ (crc >>> 8);
+  }
+  return ~crc >>> 0;
+}
+
+function isPop2(popBuffer) {
+  let magic = new Uint8Array(popBuffer, 0, Math.min(4, popBuffer.byteLength));
+  return String.fromCharCode(...magic) == "PPOP";
+}
+
+// Loads a .pop file, and for a version 1 file the .idx next to it. If the
+// server takes range requests, a version 2 file is fetched as its header and
+// index, and then a window between two sync points at a time as it plays.
+function loadDecoder(popUrl, idxUrl) {
+  return sendRangeRequest(popUrl, 0, kPopFirstFetch).then((first) => {
+    if (!first.partial || first.length <= kPopFirstFetch) {
+      if (isPop2(first.buffer) || !idxUrl) {
+        return new Decoder(first.buffer, null, null);
+      }
+      return sendRequest(idxUrl).then((idxBuffer) => {
+        return new Decoder(first.buffer, idxBuffer, null);
+      });
+    }
+    if (!isPop2(first.buffer)) {
+      return Promise.all([sendRequest(popUrl), sendRequest(idxUrl)]).then((buffers) => {
+        return new Decoder(buffers[0], buffers[1], null);
+      });
+    }
 
-  this.readIndex();
+    let length = first.length;
+    return sendRangeRequest(popUrl, length - kPopTrailerSize, length).then((trailer) => {
+      let framesOffset = getUint64(new DataView(trailer.buffer), 0);
+      if (framesOffset >= length) {
+        throw "recording has no index";
+      }
+      return sendRangeRequest(popUrl, framesOffset, length);
+    }).then((footer) => {
+      return new Decoder(first.buffer, null, {
+        url: popUrl,
+        footer: footer.buffer,
+        footerStart: length - footer.buffer.byteLength,
+      });
+    });
+  });
+}
 
+// Decodes a whole .pop file in |popBuffer|, or one whose header is in
+// |popBuffer| and whose chunks are fetched from |remote.url|.
+function Decoder(popBuffer, idxBuffer, remote) {
+  this.popBuffer = popBuffer;
+  this.idxBuffer = idxBuffer;
   this.input = new Uint8Array(this.popBuffer);
+  this.inputBase = 0;
+
+  if (idxBuffer) {
+    this.readIndex();
+  } else if (remote) {
+    this.url = remote.url;
+    this.windows = new Map();
+    this.readContainer(new DataView(remote.footer), remote.footerStart);
+    this.input = null;
+  } else {
+    this.readContainer(new DataView(this.popBuffer), 0);
+    this.checkChunks(this.input, 0, 0, this.numChunks);
+  }
 }
 
+// Where each stored row goes in the RGBA output.
+Decoder.prototype.setFormat = function(width, height, regions) {
+  this.width = width;
+  this.height = height;
+  this.regions = regions;
+  this.rows = new Array();
+  for (let region of this.regions) {
+    for (let y = 0; y < region.height; y++) {
+      this.rows.push({
+        outOffset: ((region.y + y) * width + region.x) * 4,
+        width: region.width,
+      });
+    }
+  }
+};
+
+// The offset of a frame's first record. Index entries are read where they
+// are, so a long recording costs no more memory than its files.
+Decoder.prototype.frameOffset = function(frameIndex) {
+  return getUint64(this.indexView, this.indexStart + frameIndex * this.indexStride);
+};
+
+// Reads the header of a version 2 file, and its footer from |footer|, which
+// holds the end of the file from offset |footerStart|.
+Decoder.prototype.readContainer = function(footer, footerStart) {
+  let view = new DataView(this.popBuffer);
+  if (view.byteLength < kPopHeaderSize || footer.byteLength < kPopTrailerSize ||
+      view.getUint32(4, true) != kPopVersion || view.getUint8(18) != 1) {
+    throw "unsupported .pop version";
+  }
+
+  let regions = new Array();
+  let numRegions = view.getUint16(16, true);
+  for (let i = 0; i < numRegions; i++) {
+    let offset = kPopHeaderSize + i * 8;
+    regions.push({
+      x: view.getUint16(offset, true),
+      y: view.getUint16(offset + 2, true),
+      width: view.getUint16(offset + 4, true),
+      height: view.getUint16(offset + 6, true),
+    });
+  }
+  let width = view.getUint16(12, true);
+  let height = view.getUint16(14, true);
+  if (!numRegions) {
+    regions.push({ x: 0, y: 0, width: width, height: height });
+  }
+  this.setFormat(width, height, regions);
+  this.fps = view.getFloat64(24, true);
+
+  // The decoder in Decode.cpp can recover a file that was never closed.
+  let bytes = new Uint8Array(footer.buffer, footer.byteOffset, footer.byteLength);
+  let trailer = footer.byteLength - kPopTrailerSize;
+  if (String.fromCharCode(...bytes.subarray(trailer + 36, trailer + 40)) != "PIDX") {
+    throw "recording has no index";
+  }
+  let framesOffset = getUint64(footer, trailer);
+  let numFrames = getUint64(footer, trailer + 8);
+  let chunksOffset = getUint64(footer, trailer + 16);
+  let numChunks = footer.getUint32(trailer + 24, true);
+  let indexLength = footerStart + trailer - framesOffset;
+  if (framesOffset < footerStart ||
+      indexLength != numFrames * kPopFrameEntrySize + numChunks * kPopChunkEntrySize ||
+      popChecksum(bytes, framesOffset - footerStart, indexLength) !=
+          footer.getUint32(trailer + 28, true)) {
+    throw "corrupt .pop index";
+  }
+
+  this.indexView = footer;
+  this.indexStart = framesOffset - footerStart;
+  this.indexStride = kPopFrameEntrySize;
+  this.numFrames = numFrames;
+  this.chunksStart = chunksOffset - footerStart;
+  this.numChunks = numChunks;
+  this.framesOffset = framesOffset;
+};
+
+Decoder.prototype.chunkEntry = function(i) {
+  let view = this.indexView;
+  let entry = this.chunksStart + i * kPopChunkEntrySize;
+  return {
+    offset: getUint64(view, entry),
+    length: getUint64(view, entry + 8),
+    firstFrame: view.getUint32(entry + 16, true),
+    checksum: view.getUint32(entry + 24, true),
+    sync: view.getUint32(entry + 28, true) & kPopChunkSync,
+  };
+};
+
+// Checks chunks |first| up to |end| against their checksums. |bytes| holds
+// the file from offset |start|.
+Decoder.prototype.checkChunks = function(bytes, start, first, end) {
+  for (let i = first; i < end; i++) {
+    let chunk = this.chunkEntry(i);
+    let offset = chunk.offset + kPopChunkHeaderSize - start;
+    if (offset < 0 || chunk.offset + kPopChunkHeaderSize + chunk.length > this.framesOffset ||
+        offset + chunk.length > bytes.length ||
+        popChecksum(bytes, offset, chunk.length) != chunk.checksum) {
+      throw "corrupt .pop chunk " + i;
+    }
+  }
+};
+
+// The chunk holding |frameIndex|, moved back to the sync point before it.
+// Records never refer back past a sync point, so decoding can start there.
+Decoder.prototype.findSyncChunk = function(frameIndex) {
+  let low = 0;
+  let high = this.numChunks - 1;
+  while (low < high) {
+    let mid = (low + high + 1) >> 1;
+    if (this.chunkEntry(mid).firstFrame <= frameIndex) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  while (low > 0 && !this.chunkEntry(low).sync) {
+    low--;
+  }
+  return low;
+};
+
+// Fetches the chunks from sync chunk |i| up to the next sync point.
+Decoder.prototype.loadWindow = function(i) {
+  if (!this.windows.has(i)) {
+    let end = i + 1;
+    while (end < this.numChunks && !this.chunkEntry(end).sync) {
+      end++;
+    }
+    let start = this.chunkEntry(i).offset;
+    let stop = end < this.numChunks ? this.chunkEntry(end).offset : this.framesOffset;
+    let entry = { bytes: null, start: start, next: end };
+    entry.promise = sendRangeRequest(this.url, start, stop).then((response) => {
+      let bytes = new Uint8Array(response.buffer);
+      if (!response.partial) {
+        bytes = bytes.subarray(start, stop);
+      }
+      this.checkChunks(bytes, start, i, end);
+      entry.bytes = bytes;
+      return this;
+    });
+    this.windows.set(i, entry);
+  }
+  return this.windows.get(i);
+};
+
+// Reads a version 1 .idx file.
 Decoder.prototype.readIndex = function() {
   let array16 = new Uint16Array(this.idxBuffer);
   let width = array16[0];
   let height = array16[1];
-
-  this.width = width;
-  this.height = height;
-  this.index = new Array();
-
-  let array32 = new Uint32Array(this.idxBuffer);
-  for (let i = 1; i < array32.length; i += 2) {
-    this.index.push(array32[i]);
+  let headerSize = 4;
+
+  // A zero width means the recording only holds some regions of the picture,
+  // listed after its real size.
+  let regions = new Array();
+  if (width == 0) {
+    let numRegions = height;
+    width = array16[2];
+    height = array16[3];
+    for (let i = 0; i < numRegions; i++) {
+      regions.push({
+        x: array16[4 + i * 4],
+        y: array16[5 + i * 4],
+        width: array16[6 + i * 4],
+        height: array16[7 + i * 4],
+      });
+    }
+    headerSize = 8 + numRegions * 8;
+  } else {
+    regions.push({ x: 0, y: 0, width: width, height: height });
   }
+  this.setFormat(width, height, regions);
 
-  this.numFrames = this.index.length;
+  this.indexView = new DataView(this.idxBuffer);
+  this.indexStart = headerSize;
+  this.indexStride = 8;
+  this.numFrames = Math.floor((this.idxBuffer.byteLength - headerSize) / 8);
 };
 
 Decoder.prototype.runLengthDecode = function(inOffset) {
   let output = this.output;
   let outStart = this.outOffset;
   let outOffset = this.outOffset;
-  let width = this.width * 4;
+  let width = this.rowWidth * 4;
   let input = this.input;
 
   while (outOffset - outStart < width) {
@@ -65,35 +372,163 @@ Decoder.prototype.runLengthDecode = function(inOffset) {
   return inOffset;
 };
 
+// See getUint64().
 Decoder.prototype.readUint64 = function(inOffset) {
-  let x1 = this.input[inOffset + 0];
-  let x2 = this.input[inOffset + 1];
-  let x3 = this.input[inOffset + 2];
-  let x4 = this.input[inOffset + 3];
-  let x5 = this.input[inOffset + 4];
-  let x6 = this.input[inOffset + 5];
-  let x7 = this.input[inOffset + 6];
-
-  // Don't include the high bits since JS can't represent them anyway.
-  return (x1 << (8*0)) |
-         (x2 << (8*1)) |
-         (x3 << (8*2)) |
-         (x4 << (8*3)) |
-         (x5 << (8*4)) |
-         (x6 << (8*5)) |
-         (x7 << (8*6));
+  return this.readUint32(inOffset + 4) * 0x100000000 + this.readUint32(inOffset);
+};
+
+// Records refer to each other by file offset, so this makes those offsets
+// relative to the part of the file in |input|.
+Decoder.prototype.readOffset = function(inOffset) {
+  return this.readUint64(inOffset) - this.inputBase;
+};
+
+// Decodes packed runs and literals into a |width| x |height| rectangle of
+// the picture starting at pixel |outStart|. Pixels are written a whole RGBA
+// word at a time through |output32|, so runs become a single fill. With
+// |xor| the bytes are changes to the pixels already there, and runs of zeros
+// are skipped.
+Decoder.prototype.unpackRect = function(inOffset, outStart, width, height, xor) {
+  let output32 = this.output32;
+  let input = this.input;
+  let stride = this.width;
+  let outOffset = outStart;
+  let x = 0;
+
+  while (height) {
+    let token = input[inOffset++];
+    let literal = token < 128;
+    let count = token + 1;
+    let b = 0;
+    if (!literal) {
+      count = token - 125;
+      if (token == 255) {
+        count = (input[inOffset] | (input[inOffset + 1] << 8)) + 130;
+        inOffset += 2;
+      }
+      b = input[inOffset++];
+    }
+
+    // Spans of a tile carry on into its next row.
+    while (count) {
+      let n = Math.min(count, width - x);
+      let start = outOffset + x;
+      if (literal) {
+        for (let i = start; i < start + n; i++) {
+          let v = input[inOffset++];
+          if (xor) {
+            v ^= output32[i] & 0xff;
+          }
+          output32[i] = v * 0x10101 + 0xff000000;
+        }
+      } else if (!xor) {
+        output32.fill(b * 0x10101 + 0xff000000, start, start + n);
+      } else if (b) {
+        for (let i = start; i < start + n; i++) {
+          output32[i] = ((output32[i] & 0xff) ^ b) * 0x10101 + 0xff000000;
+        }
+      }
+      x += n;
+      count -= n;
+      if (x == width) {
+        x = 0;
+        outOffset += stride;
+        height--;
+      }
+    }
+  }
+
+  return inOffset;
+};
+
+// Decodes a kPackedScanline row.
+Decoder.prototype.packedDecode = function(inOffset) {
+  return this.unpackRect(inOffset, this.outOffset >> 2, this.rowWidth, 1, false);
+};
+
+// Cuts each region into tiles the way the encoder does.
+Decoder.prototype.setTileSize = function(tileSize) {
+  this.tileSize = tileSize;
+  this.tiles = new Array();
+  for (let region of this.regions) {
+    for (let y = 0; y < region.height; y += tileSize) {
+      for (let x = 0; x < region.width; x += tileSize) {
+        this.tiles.push({
+          outStart: (region.y + y) * this.width + region.x + x,
+          width: Math.min(tileSize, region.width - x),
+          height: Math.min(tileSize, region.height - y),
+        });
+      }
+    }
+  }
+};
+
+Decoder.prototype.readUint32 = function(inOffset) {
+  let input = this.input;
+  return (input[inOffset] | (input[inOffset + 1] << 8) |
+          (input[inOffset + 2] << 16) | (input[inOffset + 3] << 24)) >>> 0;
+};
+
+// Applies the tiles of a kTileFrame record to the frame before it.
+Decoder.prototype.decodeTiles = function(inOffset) {
+  let input = this.input;
+  let tileSize = input[inOffset + 9] | (input[inOffset + 10] << 8);
+  let count = this.readUint32(inOffset + 11);
+  inOffset += 15;
+  if (tileSize != this.tileSize) {
+    this.setTileSize(tileSize);
+  }
+
+  for (; count; count--) {
+    let tile = this.tiles[this.readUint32(inOffset)];
+    inOffset = this.unpackRect(inOffset + 4, tile.outStart, tile.width, tile.height,
+                               true);
+  }
+  return inOffset;
 };
 
 Decoder.prototype.readScanline = function(inOffset) {
-  if (this.input[inOffset] == kNewScanline) {
+  if (this.input[inOffset] == kPackedScanline) {
+    inOffset++;
+    inOffset = this.packedDecode(inOffset);
+  } else if (this.input[inOffset] == kNewScanline) {
     inOffset++;
     inOffset = this.runLengthDecode(inOffset);
   } else if (this.input[inOffset] == kReuseScanline) {
     inOffset++;
-    let innerOffset = this.readUint64(inOffset);
+    let innerOffset = this.readOffset(inOffset);
     inOffset += 8;
 
     this.readScanline(innerOffset);
+  } else if (this.input[inOffset] == kDeltaScanline) {
+    inOffset++;
+    let baseOffset = this.readOffset(inOffset);
+    inOffset += 8;
+
+    // Decode the row this one changes, then patch the changed spans over it.
+    let outStart = this.outOffset;
+    this.readScanline(baseOffset);
+
+    let input = this.input;
+    let output = this.output;
+    let spans = input[inOffset] | (input[inOffset + 1] << 8);
+    inOffset += 2;
+
+    let outOffset = outStart;
+    for (; spans; spans--) {
+      let skip = input[inOffset] | (input[inOffset + 1] << 8);
+      let length = input[inOffset + 2] | (input[inOffset + 3] << 8);
+      inOffset += 4;
+
+      outOffset += skip * 4;
+      for (let end = inOffset + length; inOffset < end; inOffset++) {
+        let b = input[inOffset];
+        output[outOffset++] = b;
+        output[outOffset++] = b;
+        output[outOffset++] = b;
+        output[outOffset++] = 255;
+      }
+    }
   } else {
     throw "ERROR";
   }
@@ -101,17 +536,226 @@ Decoder.prototype.readScanline = function(inOffset) {
   return inOffset;
 };
 
+// Resolves once decodeFrame can be called for |frameIndex|. Only the window
+// being shown and the one after it are kept when the file is fetched in
+// windows.
+Decoder.prototype.prepare = function(frameIndex) {
+  if (!this.url) {
+    return Promise.resolve();
+  }
+
+  let i = this.findSyncChunk(frameIndex);
+  let window = this.loadWindow(i);
+  for (let loaded of Array.from(this.windows.keys())) {
+    if (loaded != i && loaded != window.next) {
+      this.windows.delete(loaded);
+    }
+  }
+
+  // Fetch the next window while this one plays.
+  if (window.next < this.numChunks) {
+    this.loadWindow(window.next);
+  }
+  return window.promise;
+};
+
 Decoder.prototype.decodeFrame = function(frameIndex, output) {
   this.outOffset = 0;
   this.output = output;
 
-  let inOffset = this.index[frameIndex];
-  let height = this.height;
-  for (let h = 0; h < height; h++) {
-    inOffset = this.readScanline(inOffset);
+  // Pixels outside the regions are never written, so make them opaque black.
+  if (this.clearedOutput !== output) {
+    for (let i = 3; i < output.length; i += 4) {
+      output[i] = 255;
+    }
+    this.clearedOutput = output;
+    this.output32 = new Uint32Array(output.buffer, output.byteOffset,
+                                    output.length >> 2);
+  }
+
+  // Rows copied from the previous frame are already in place if that is what
+  // |output| holds; otherwise the copies are followed back to their records.
+  if (this.url) {
+    let window = this.windows.get(this.findSyncChunk(frameIndex));
+    if (!window || !window.bytes) {
+      throw "window not loaded";
+    }
+    this.input = window.bytes;
+    this.inputBase = window.start;
+  }
+
+  let skipCopies = this.lastOutput === output && this.lastFrameIndex == frameIndex - 1;
+  this.decodeRows(this.frameOffset(frameIndex) - this.inputBase, 0, this.rows.length,
+                  skipCopies);
+  this.lastOutput = output;
+  this.lastFrameIndex = frameIndex;
+};
+
+Decoder.prototype.decodeRows = function(inOffset, row, count, skipCopies) {
+  let input = this.input;
+  let end = row + count;
+  while (row < end) {
+    let type = input[inOffset];
+    if (type == kCopyFrame) {
+      if (!skipCopies) {
+        this.decodeRows(this.readOffset(inOffset + 1), 0, this.rows.length, false);
+      }
+      inOffset += 9;
+      row = this.rows.length;
+    } else if (type == kTileFrame) {
+      if (!skipCopies) {
+        this.decodeRows(this.readOffset(inOffset + 1), 0, this.rows.length, false);
+      }
+      inOffset = this.decodeTiles(inOffset);
+      row = this.rows.length;
+    } else if (type == kCopyRows) {
+      let rows = input[inOffset + 9] | (input[inOffset + 10] << 8);
+      if (!skipCopies) {
+        this.decodeRows(this.readOffset(inOffset + 1), row, rows, false);
+      }
+      inOffset += 11;
+      row += rows;
+    } else if (type == kScrollFrame) {
+      // Moved rows are copied from the previous frame, so keep it aside.
+      if (!skipCopies) {
+        this.decodeRows(this.readOffset(inOffset + 1), 0, this.rows.length, false);
+      }
+      if (!this.prev32 || this.prev32.length != this.output32.length) {
+        this.prev32 = new Uint32Array(this.output32.length);
+      }
+      this.prev32.set(this.output32);
+      this.shift = ((input[inOffset + 10] << 24) >> 16) | input[inOffset + 9];
+      inOffset += 11;
+    } else if (type == kShiftRows) {
+      let rows = input[inOffset + 1] | (input[inOffset + 2] << 8);
+      for (let i = row; i < row + rows; i++) {
+        let from = this.rows[i + this.shift].outOffset >> 2;
+        let width = this.rows[i].width;
+        this.output32.set(this.prev32.subarray(from, from + width),
+                          this.rows[i].outOffset >> 2);
+      }
+      inOffset += 3;
+      row += rows;
+    } else {
+      this.rowWidth = this.rows[row].width;
+      this.outOffset = this.rows[row].outOffset;
+      inOffset = this.readScanline(inOffset);
+      row++;
+    }
+  }
+  return inOffset;
+};
+
+// Plays the segments listed in a .segments manifest as one recording. Only
+// the segment being shown and its neighbours are kept loaded, so long
+// recordings don't have to fit in memory.
+function SegmentedDecoder(base, manifest) {
+  let lines = manifest.split("\n");
+  let version = lines[0].trim();
+  if (version != kSegmentsVersionLine && version != kSegmentsVersion1Line) {
+    throw "unknown segment manifest";
+  }
+
+  // Version 1 manifests list an .idx after each .pop.
+  let idxFields = version == kSegmentsVersion1Line ? 1 : 0;
+
+  this.base = base;
+  this.segments = new Array();
+  for (let line of lines.slice(1)) {
+    let fields = line.trim().split(/\s+/);
+    if (fields.length < 3 + idxFields) {
+      continue;
+    }
+    this.segments.push({
+      pop: fields[0],
+      idx: idxFields ? fields[1] : null,
+      firstFrame: parseInt(fields[1 + idxFields]),
+      numFrames: parseInt(fields[2 + idxFields]),
+    });
+  }
+  if (!this.segments.length) {
+    throw "empty segment manifest";
+  }
+
+  let last = this.segments[this.segments.length - 1];
+  this.numFrames = last.firstFrame + last.numFrames;
+  this.loaded = new Map();
+}
+
+// Resolves with the decoder once the first segment, which gives the size, is
+// loaded.
+SegmentedDecoder.prototype.init = function() {
+  return this.loadSegment(0).then((decoder) => {
+    this.width = decoder.width;
+    this.height = decoder.height;
+    return this;
+  });
+};
+
+SegmentedDecoder.prototype.findSegment = function(frameIndex) {
+  let low = 0;
+  let high = this.segments.length - 1;
+  while (low < high) {
+    let mid = (low + high + 1) >> 1;
+    if (this.segments[mid].firstFrame <= frameIndex) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+};
+
+SegmentedDecoder.prototype.loadSegment = function(i) {
+  if (!this.loaded.has(i)) {
+    let segment = this.segments[i];
+    let entry = { decoder: null };
+    entry.promise = loadDecoder(this.base + "/" + segment.pop,
+                                segment.idx && this.base + "/" + segment.idx).then((decoder) => {
+      entry.decoder = decoder;
+      return decoder;
+    });
+    this.loaded.set(i, entry);
+  }
+  return this.loaded.get(i).promise;
+};
+
+SegmentedDecoder.prototype.prepare = function(frameIndex) {
+  let i = this.findSegment(frameIndex);
+  for (let loaded of Array.from(this.loaded.keys())) {
+    if (Math.abs(loaded - i) > 1) {
+      this.loaded.delete(loaded);
+    }
+  }
+
+  // Fetch the next segment while this one plays.
+  if (i + 1 < this.segments.length) {
+    this.loadSegment(i + 1);
+  }
+  return this.loadSegment(i).then((decoder) => {
+    return decoder.prepare(frameIndex - this.segments[i].firstFrame);
+  });
+};
+
+SegmentedDecoder.prototype.decodeFrame = function(frameIndex, output) {
+  let i = this.findSegment(frameIndex);
+  let entry = this.loaded.get(i);
+  if (!entry || !entry.decoder) {
+    throw "segment not loaded";
   }
+  entry.decoder.decodeFrame(frameIndex - this.segments[i].firstFrame, output);
 };
 
+// Loads the recording in |base|, segmented or not.
+function loadRecording(base) {
+  return sendOptionalRequest(base + "/video.segments").then((manifest) => {
+    if (manifest) {
+      return new SegmentedDecoder(base, manifest).init();
+    }
+    return loadDecoder(base + "/video.pop", base + "/video.idx");
+  });
+}
+
 function start(decoder1, decoder2) {
   let progressElt = document.getElementById("progress");
   let statusElt = document.getElementById("status");
@@ -127,14 +771,22 @@ function start(decoder1, decoder2) {
   let frameIndex = 0;
   let playing = true;
 
+  // Resolves once the frame is shown, which may wait for a segment to load.
   function draw() {
-    decoder1.decodeFrame(frameIndex, imageData1.data);
-    decoder2.decodeFrame(frameIndex, imageData2.data);
-    ctx1.putImageData(imageData1, 0, 0);
-    ctx2.putImageData(imageData2, 0, 0);
+    let index = frameIndex;
+    return Promise.all([decoder1.prepare(index), decoder2.prepare(index)]).then(() => {
+      if (index != frameIndex) {
+        return;
+      }
 
-    progressElt.setAttribute("value", frameIndex);
-    statusElt.innerHTML = (frameIndex + 1) + "/" + decoder1.numFrames;
+      decoder1.decodeFrame(frameIndex, imageData1.data);
+      decoder2.decodeFrame(frameIndex, imageData2.data);
+      ctx1.putImageData(imageData1, 0, 0);
+      ctx2.putImageData(imageData2, 0, 0);
+
+      progressElt.setAttribute("value", frameIndex);
+      statusElt.innerHTML = (frameIndex + 1) + "/" + decoder1.numFrames;
+    });
   }
 
   function playOne() {
@@ -148,9 +800,9 @@ function start(decoder1, decoder2) {
     }
 
     frameIndex++;
-    draw();
-
-    requestAnimationFrame(playOne);
+    draw().then(() => {
+      requestAnimationFrame(playOne);
+    });
   }
   requestAnimationFrame(playOne);
 
@@ -189,23 +841,13 @@ let urlParams = new URLSearchParams(window.location.search);
 let base1 = urlParams.get("l");
 let base2 = urlParams.get("l2");
 
-let files = [
-  sendRequest(base1 + "/video.pop"),
-  sendRequest(base1 + "/video.idx"),
-];
-
+let recordings = [loadRecording(base1)];
 if (base2) {
-  files.push(sendRequest(base2 + "/video.pop"));
-  files.push(sendRequest(base2 + "/video.idx"));
+  recordings.push(loadRecording(base2));
 }
 
-console.log(files);
-
-Promise.all(files).then((files) => {
-  let decoder1 = new Decoder(files[0], files[1]);
-  let decoder2 = decoder1;
-  if (files.length > 2) {
-    decoder2 = new Decoder(files[2], files[3]);
-  }
+Promise.all(recordings).then((decoders) => {
+  let decoder1 = decoders[0];
+  let decoder2 = decoders.length > 1 ? decoders[1] : decoder1;
   start(decoder1, decoder2);
 });